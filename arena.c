@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "arena.h"
+
+struct ArenaBlock
+{
+    ArenaBlock* next;
+    size_t size, used;
+    max_align_t data[];
+};
+
+static const size_t ARENA_BLOCK_SIZE = 1 << 20;
+
+static void* ArenaProtobufAlloc (void* allocator_data, size_t size)
+{
+    return ArenaAlloc ((Arena*) allocator_data, size);
+}
+
+static void ArenaProtobufFree (void* allocator_data, void* pointer)
+{
+    // Memory is freed by ArenaDestructor
+    (void) allocator_data;
+    (void) pointer;
+    return;
+}
+
+Arena* ArenaConstructor (void)
+{
+    Arena* arena = (Arena*) calloc (1, sizeof (*arena));
+    if (!arena)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
+    }
+
+    pthread_mutex_init (&arena->lock, NULL);
+    arena->allocator.alloc = ArenaProtobufAlloc;
+    arena->allocator.free  = ArenaProtobufFree;
+    arena->allocator.allocator_data = arena;
+    return arena;
+}
+
+void ArenaDestructor (Arena* arena)
+{
+    if (!arena)
+        return;
+
+    for (ArenaBlock* block = arena->blocks; block; )
+    {
+        ArenaBlock* next = block->next;
+        free (block);
+        block = next;
+    }
+
+    pthread_mutex_destroy (&arena->lock);
+    free (arena);
+    return;
+}
+
+void* ArenaAlloc (Arena* arena, size_t size)
+{
+    assert (arena);
+
+    size = (size + sizeof (max_align_t) - 1) / sizeof (max_align_t) * sizeof (max_align_t);
+    pthread_mutex_lock (&arena->lock);
+
+    ArenaBlock* block = arena->blocks;
+    if (!block || block->size - block->used < size)
+    {
+        // Big allocations have their own blocks
+        size_t block_size = size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*) calloc (1, sizeof (*block) + block_size);
+
+        if (!block)
+        {
+            pthread_mutex_unlock (&arena->lock);
+            perror ("Can't allocate memory");
+            return NULL;
+        }
+
+        block->size = block_size;
+        if (arena->blocks && block_size != ARENA_BLOCK_SIZE)
+        {
+            // Current block isn't full yet, new one is placed after it
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+        else
+        {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    void* memory = (char*) block->data + block->used;
+    block->used += size;
+
+    pthread_mutex_unlock (&arena->lock);
+    return memory;
+}
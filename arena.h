@@ -0,0 +1,20 @@
+// Arena allocator: memory is taken by small parts from big blocks and freed all at once.
+// It's used as ProtobufCAllocator for unpacking of images, so free_unpacked isn't needed.
+
+#include <pthread.h>
+#include <protobuf-c/protobuf-c.h>
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock* blocks;
+    pthread_mutex_t lock; // every process has its own arena, processes are converted in parallel
+    ProtobufCAllocator allocator; // allocator_data == this arena
+} Arena;
+
+Arena* ArenaConstructor (void);
+void ArenaDestructor (Arena* arena);
+
+// Thread-safe. Memory is zeroed and aligned as for malloc.
+void* ArenaAlloc (Arena* arena, size_t size);
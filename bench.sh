@@ -0,0 +1,92 @@
+#!/bin/sh
+# End-to-end benchmark of converting: synthetic coredump and donor are made by gencore, neither criu nor root is needed.
+#
+# Usage: ./bench.sh [gencore options]          e.g. ./bench.sh -s 2048 -v 500 -t 16 -z 70
+# Environment:
+#     RUNS=3                    converting is repeated, the best time is taken
+#     JOBS=$(nproc)             -j of criu-necromancer
+#     FLAGS=""                  other options of criu-necromancer, e.g. "-f" or "-P"
+#     WORK=$(mktemp -d)         directory for coredump and images, it's removed at the end, if it was created here
+#     NECROMANCER=./criu-necromancer  GENCORE=./gencore
+#
+# Output: one line per phase (gen, convert) with time, MB/s of coredump, pages/s, peak RSS,
+# JSON of --stats of the best converting (time of phases inside necromancer, bytes and pages),
+# then the number of syscalls of each phase, if strace is installed.
+
+set -e
+
+RUNS=${RUNS:-3}
+JOBS=${JOBS:-$(nproc 2>/dev/null || echo 1)}
+NECROMANCER=${NECROMANCER:-./criu-necromancer}
+GENCORE=${GENCORE:-./gencore}
+
+if [ -z "$WORK" ]; then
+    WORK=$(mktemp -d)
+    trap 'rm -rf "$WORK"' EXIT
+fi
+
+now () { date +%s.%N; }
+elapsed () { awk -v start="$1" -v end="$(now)" 'BEGIN { printf "%.3f", end - start }'; }
+
+# Time and peak RSS of command: GNU time gives RSS, without it only time is measured.
+# Failed command stops the benchmark with its stderr.
+measure () {
+    status=0
+    if [ -x /usr/bin/time ]; then
+        /usr/bin/time -f "%e %M" -o "$WORK/time" "$@" > /dev/null 2> "$WORK/stderr" || status=$?
+        result=$(cat "$WORK/time")
+    else
+        start=$(now)
+        "$@" > /dev/null 2> "$WORK/stderr" || status=$?
+        result="$(elapsed "$start") -"
+    fi
+
+    if [ "$status" -ne 0 ]; then
+        cat "$WORK/stderr" >&2
+        echo "Error: $1 exited with status $status." >&2
+        exit 1
+    fi
+    echo "$result"
+}
+
+report () { # phase seconds rss_kb
+    echo "$1 $2 $3" | awk -v size="$CORE_SIZE" -v pages="$PAGES" '{
+        t = ($2 > 0) ? $2 : 0.001
+        printf "%-8s time=%.3fs  %.1f MB/s  %.0f pages/s  peak_rss=%s KB\n", $1, $2, size / t / 1048576, pages / t, $3 }'
+}
+
+start=$(now)
+INFO=$("$GENCORE" -o "$WORK" "$@")
+GEN_TIME=$(elapsed "$start")
+CORE_SIZE=$(echo "$INFO" | sed -n 's/.*core_size=\([0-9]*\).*/\1/p')
+PAGES=$(echo "$INFO" | sed -n 's/.*pages=\([0-9]*\).*/\1/p')
+echo "$INFO jobs=$JOBS flags=$FLAGS"
+report gen "$GEN_TIME" -
+
+# Donor isn't changed with -o, every run writes to fresh output directory
+BEST=""
+for run in $(seq "$RUNS"); do
+    rm -rf "$WORK/images" "$WORK/store"
+    rm -f "$WORK/stats.json"
+    # shellcheck disable=SC2086
+    RESULT=$(measure "$NECROMANCER" -c "$WORK/core" -i "$WORK/donor" -o "$WORK/images" -j "$JOBS" --stats="$WORK/stats.json" $FLAGS)
+    if [ -z "$BEST" ] || awk -v a="${RESULT%% *}" -v b="${BEST%% *}" 'BEGIN { exit !(a < b) }'; then
+        BEST=$RESULT
+        cp "$WORK/stats.json" "$WORK/best.json" 2> /dev/null || true
+    fi
+done
+report convert $BEST
+cat "$WORK/best.json" 2> /dev/null || true
+
+# Syscalls are counted by separate runs of both phases, strace exits with status of traced command
+if command -v strace > /dev/null 2>&1; then
+    rm -rf "$WORK/images" "$WORK/store" "$WORK/gen"
+    measure strace -f -c -o "$WORK/strace.gen" "$GENCORE" -o "$WORK/gen" "$@" > /dev/null
+    # shellcheck disable=SC2086
+    measure strace -f -c -o "$WORK/strace.convert" "$NECROMANCER" -c "$WORK/core" -i "$WORK/donor" -o "$WORK/images" -j "$JOBS" $FLAGS > /dev/null
+    for phase in gen convert; do
+        echo "syscalls of $phase:"
+        sed -n '3,12p' "$WORK/strace.$phase"
+        tail -n 1 "$WORK/strace.$phase"
+    done
+fi
@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <errno.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "catalog.h"
+#include "fileworking.h"
+
+static int CompareLayoutItems (const void* a, const void* b)
+{
+    const LayoutItem* item_a = (const LayoutItem*) a;
+    const LayoutItem* item_b = (const LayoutItem*) b;
+
+    if (item_a->size != item_b->size)
+        return (item_a->size < item_b->size) ? -1 : 1;
+    return (item_a->prot > item_b->prot) - (item_a->prot < item_b->prot);
+}
+
+// FNV-1a
+uint64_t GetLayoutFingerprint (const LayoutItem* layout, size_t n_layout)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i_item = 0; i_item < n_layout; i_item++)
+    {
+        uint64_t values[2] = {layout[i_item].size, layout[i_item].prot};
+        const unsigned char* bytes = (const unsigned char*) values;
+
+        for (size_t i_byte = 0; i_byte < sizeof (values); i_byte++)
+            hash = (hash ^ bytes[i_byte]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static int CatalogPush (Catalog* catalog, CatalogEntry* entry)
+{
+    if (catalog->n_entries == catalog->capacity)
+    {
+        size_t new_capacity = catalog->capacity ? 2 * catalog->capacity : 64;
+        CatalogEntry* new_entries = (CatalogEntry*) realloc (catalog->entries, new_capacity * sizeof (*new_entries));
+        if (!new_entries)
+        {
+            perror ("Can't allocate memory");
+            return -1;
+        }
+
+        catalog->entries = new_entries;
+        catalog->capacity = new_capacity;
+    }
+
+    catalog->entries[catalog->n_entries++] = *entry;
+    return 0;
+}
+
+static void CatalogEntryFree (CatalogEntry* entry)
+{
+    free (entry->path);
+    free (entry->layout);
+    *entry = (CatalogEntry) {};
+}
+
+// One line of catalog, line is changed during parsing
+static int ParseCatalogLine (char* line, CatalogEntry* entry)
+{
+    char* pos = line;
+    char* build_id = strsep (&pos, " ");
+    if (!pos)
+        return -1;
+
+    if (strcmp (build_id, "-") != 0)
+        strncpy (entry->build_id, build_id, BUILD_ID_HEX_SIZE - 1);
+
+    entry->fingerprint = strtoull (pos, &pos, 16);
+    entry->n_layout = strtoull (pos, &pos, 10);
+    if (*pos != ' ')
+        return -1;
+
+    entry->layout = (LayoutItem*) calloc (entry->n_layout + 1, sizeof (*entry->layout));
+    if (!entry->layout)
+        return -1;
+
+    if (entry->n_layout == 0) // layout is written as "-"
+        pos = strchr (pos + 1, ' ');
+    if (!pos)
+        return -1;
+
+    for (size_t i_item = 0; i_item < entry->n_layout; i_item++)
+    {
+        entry->layout[i_item].size = strtoull (pos + 1, &pos, 16);
+        if (*pos != '/')
+            return -1;
+        entry->layout[i_item].prot = (uint32_t) strtoul (pos + 1, &pos, 16);
+        if (*pos != ',' && *pos != ' ')
+            return -1;
+    }
+
+    if (*pos != ' ')
+        return -1;
+
+    // Files of old versions keep layout in order of addresses
+    qsort (entry->layout, entry->n_layout, sizeof (*entry->layout), CompareLayoutItems);
+
+    pos[strcspn (pos, "\n")] = '\0';
+    entry->path = strdup (pos + 1);
+    return entry->path ? 0 : -1;
+}
+
+Catalog* CatalogLoad (const char* filename)
+{
+    assert (filename);
+
+    Catalog* catalog = (Catalog*) calloc (1, sizeof (*catalog));
+    if (!catalog)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
+    }
+
+    FILE* file = fopen (filename, "r");
+    if (!file)
+        return catalog;
+
+    char* line = NULL;
+    size_t line_capacity = 0;
+    size_t n_line = 0;
+
+    while (getline (&line, &line_capacity, file) != -1)
+    {
+        n_line++;
+        CatalogEntry entry = {};
+
+        if (ParseCatalogLine (line, &entry) || CatalogPush (catalog, &entry))
+        {
+            fprintf (stderr, "Warning: Bad line %zu in catalog %s, it's skipped.\n", n_line, filename);
+            CatalogEntryFree (&entry);
+        }
+    }
+
+    free (line);
+    fclose (file);
+    return catalog;
+}
+
+int CatalogSave (const Catalog* catalog, const char* filename)
+{
+    assert (catalog);
+    assert (filename);
+
+    // Name of temporary file is unique, so concurrent savers don't write to the same file
+    char* tmp_filename = NULL;
+    if (asprintf (&tmp_filename, "%s.XXXXXX", filename) == -1)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    int fd = mkstemp (tmp_filename);
+    FILE* file = (fd != -1) ? fdopen (fd, "w") : NULL;
+    if (!file)
+    {
+        fprintf (stderr, "Error: Can't write catalog %s : %s.\n", tmp_filename, strerror (errno));
+        if (fd != -1)
+        {
+            close (fd);
+            unlink (tmp_filename);
+        }
+        free (tmp_filename);
+        return -1;
+    }
+    // mkstemp creates file with 0600, catalog is read by other users too
+    fchmod (fd, 0644);
+
+    for (size_t i_entry = 0; i_entry < catalog->n_entries; i_entry++)
+    {
+        const CatalogEntry* entry = catalog->entries + i_entry;
+        fprintf (file, "%s %016" PRIx64 " %zu ", entry->build_id[0] ? entry->build_id : "-", entry->fingerprint, entry->n_layout);
+
+        if (entry->n_layout == 0)
+            fprintf (file, "-");
+        for (size_t i_item = 0; i_item < entry->n_layout; i_item++)
+            fprintf (file, "%s%" PRIx64 "/%x", i_item ? "," : "", entry->layout[i_item].size, entry->layout[i_item].prot);
+
+        fprintf (file, " %s\n", entry->path);
+    }
+
+    int res = (fclose (file) == 0 && rename (tmp_filename, filename) == 0) ? 0 : -1;
+    if (res)
+    {
+        fprintf (stderr, "Error: Can't write catalog %s.\n", filename);
+        unlink (tmp_filename);
+    }
+
+    free (tmp_filename);
+    return res;
+}
+
+int CatalogLock (const char* filename)
+{
+    assert (filename);
+
+    char* lock_filename = NULL;
+    if (asprintf (&lock_filename, "%s.lock", filename) == -1)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    int fd = open (lock_filename, O_RDWR | O_CREAT, 0666);
+    if (fd == -1 || flock (fd, LOCK_EX))
+    {
+        fprintf (stderr, "Error: Can't lock catalog %s : %s.\n", filename, strerror (errno));
+        if (fd != -1)
+            close (fd);
+        fd = -1;
+    }
+
+    free (lock_filename);
+    return fd;
+}
+
+void CatalogUnlock (int lock_fd)
+{
+    if (lock_fd != -1)
+        close (lock_fd);
+    return;
+}
+
+void CatalogFree (Catalog* catalog)
+{
+    if (!catalog)
+        return;
+
+    for (size_t i_entry = 0; i_entry < catalog->n_entries; i_entry++)
+        CatalogEntryFree (catalog->entries + i_entry);
+
+    free (catalog->entries);
+    free (catalog);
+    return;
+}
+
+int CatalogAdd (Catalog* catalog, const char* path, const char* build_id, const LayoutItem* layout, size_t n_layout)
+{
+    assert (catalog);
+    assert (path);
+    assert (layout || !n_layout);
+
+    CatalogEntry entry = {.fingerprint = GetLayoutFingerprint (layout, n_layout), .n_layout = n_layout};
+    if (build_id)
+        strncpy (entry.build_id, build_id, BUILD_ID_HEX_SIZE - 1);
+
+    entry.path = strdup (path);
+    entry.layout = (LayoutItem*) calloc (n_layout + 1, sizeof (*entry.layout));
+    if (!entry.path || !entry.layout)
+    {
+        perror ("Can't allocate memory");
+        CatalogEntryFree (&entry);
+        return -1;
+    }
+
+    // Fingerprint is counted in order of addresses, layout is sorted once for all lookups
+    memcpy (entry.layout, layout, n_layout * sizeof (*layout));
+    qsort (entry.layout, n_layout, sizeof (*entry.layout), CompareLayoutItems);
+
+    for (size_t i_entry = 0; i_entry < catalog->n_entries; i_entry++)
+        if (strcmp (catalog->entries[i_entry].path, path) == 0)
+        {
+            CatalogEntryFree (catalog->entries + i_entry);
+            catalog->entries[i_entry] = entry;
+            return 0;
+        }
+
+    if (CatalogPush (catalog, &entry))
+    {
+        CatalogEntryFree (&entry);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Size of intersection of two sorted multisets
+static size_t CountCommonItems (const LayoutItem* a, size_t n_a, const LayoutItem* b, size_t n_b)
+{
+    size_t n_common = 0;
+
+    for (size_t i_a = 0, i_b = 0; i_a < n_a && i_b < n_b; )
+    {
+        int cmp = CompareLayoutItems (a + i_a, b + i_b);
+        if (cmp == 0)
+        {
+            n_common++;
+            i_a++;
+            i_b++;
+        }
+        else if (cmp < 0)
+            i_a++;
+        else
+            i_b++;
+    }
+
+    return n_common;
+}
+
+static LayoutItem* GetSortedLayout (const LayoutItem* layout, size_t n_layout)
+{
+    LayoutItem* sorted = (LayoutItem*) calloc (n_layout + 1, sizeof (*sorted));
+    if (!sorted)
+        return NULL;
+
+    memcpy (sorted, layout, n_layout * sizeof (*layout));
+    qsort (sorted, n_layout, sizeof (*sorted), CompareLayoutItems);
+    return sorted;
+}
+
+const CatalogEntry* CatalogLookup (const Catalog* catalog, const char* build_id, const LayoutItem* layout, size_t n_layout)
+{
+    assert (catalog);
+    assert (layout || !n_layout);
+
+    uint64_t fingerprint = GetLayoutFingerprint (layout, n_layout);
+    LayoutItem* sorted = GetSortedLayout (layout, n_layout);
+    if (!sorted)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
+    }
+
+    const CatalogEntry* best = NULL;
+    int64_t best_score = INT64_MIN;
+
+    for (size_t i_entry = 0; i_entry < catalog->n_entries; i_entry++)
+    {
+        const CatalogEntry* entry = catalog->entries + i_entry;
+        int64_t score = 0;
+
+        // Other binary is the worst donor, equal layout is the best one
+        if (build_id && build_id[0] && entry->build_id[0])
+            score += (strcmp (build_id, entry->build_id) == 0) ? (1LL << 40) : -(1LL << 40);
+
+        if (entry->fingerprint == fingerprint && entry->n_layout == n_layout)
+            score += 1LL << 32;
+        else
+        {
+            size_t n_common = CountCommonItems (sorted, n_layout, entry->layout, entry->n_layout);
+            score += 2 * (int64_t) n_common - (int64_t) (n_layout - n_common) - (int64_t) (entry->n_layout - n_common);
+        }
+
+        if (score > best_score)
+        {
+            best_score = score;
+            best = entry;
+        }
+    }
+
+    free (sorted);
+    return best;
+}
+
+int FindBuildIdInNotes (const char* notes, size_t size, char* build_id)
+{
+    assert (notes);
+    assert (build_id);
+
+    // Notes in ELF files and coredumps have the same format, align = 4
+    for (size_t pos = 0; pos + sizeof (Elf64_Nhdr) <= size; )
+    {
+        const Elf64_Nhdr* nhdr = (const Elf64_Nhdr*) (notes + pos);
+        size_t name_size = (nhdr->n_namesz + 3) & ~(size_t) 3;
+        size_t desc_size = (nhdr->n_descsz + 3) & ~(size_t) 3;
+        if (pos + sizeof (*nhdr) + name_size + desc_size > size)
+            break;
+
+        const char* name = notes + pos + sizeof (*nhdr);
+        const unsigned char* desc = (const unsigned char*) name + name_size;
+
+        if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == sizeof (ELF_NOTE_GNU) && 
+            memcmp (name, ELF_NOTE_GNU, sizeof (ELF_NOTE_GNU)) == 0 && nhdr->n_descsz <= BUILD_ID_MAX_SIZE)
+        {
+            for (size_t i_byte = 0; i_byte < nhdr->n_descsz; i_byte++)
+                sprintf (build_id + 2 * i_byte, "%02x", desc[i_byte]);
+            build_id[2 * nhdr->n_descsz] = '\0';
+            return 0;
+        }
+
+        pos += sizeof (*nhdr) + name_size + desc_size;
+    }
+
+    return -1;
+}
+
+// ToDo: mode32
+int GetFileBuildId (const char* filename, char* build_id)
+{
+    assert (filename);
+    assert (build_id);
+
+    size_t size = 0;
+    int fd = -1;
+    char* buf = MapFile (filename, &size, &fd);
+    if (!buf)
+    {
+        UnmapFile (NULL, 0, fd);
+        return -1;
+    }
+
+    int res = -1;
+    const Elf64_Ehdr* elf_hdr = (const Elf64_Ehdr*) buf;
+
+    if (size >= sizeof (*elf_hdr) && memcmp (elf_hdr->e_ident, ELFMAG, SELFMAG) == 0 && 
+        elf_hdr->e_ident[EI_CLASS] == ELFCLASS64 && elf_hdr->e_phentsize == sizeof (Elf64_Phdr) &&
+        elf_hdr->e_phoff <= size && (size - elf_hdr->e_phoff) / sizeof (Elf64_Phdr) >= elf_hdr->e_phnum)
+    {
+        const Elf64_Phdr* phdrs = (const Elf64_Phdr*) (buf + elf_hdr->e_phoff);
+
+        for (Elf64_Half i_phdr = 0; i_phdr < elf_hdr->e_phnum && res; i_phdr++)
+            if (phdrs[i_phdr].p_type == PT_NOTE && phdrs[i_phdr].p_offset <= size && 
+                size - phdrs[i_phdr].p_offset >= phdrs[i_phdr].p_filesz)
+                res = FindBuildIdInNotes (buf + phdrs[i_phdr].p_offset, phdrs[i_phdr].p_filesz, build_id);
+    }
+
+    UnmapFile (buf, size, fd);
+    return res;
+}
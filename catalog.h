@@ -0,0 +1,56 @@
+// Catalog of donors: which image sets exist on this machine and what processes they contain.
+// Donor is found by GNU build-id of main binary and by layout of its VMAs (size and prot of each one),
+// so coredump is converted with suitable donor from the first try.
+//
+// Catalog is text file, one donor per line:
+// <build-id or -> <fingerprint> <number of VMAs> <size/prot,size/prot,...> <path to images>, VMAs are sorted by size and prot
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUILD_ID_MAX_SIZE 64
+#define BUILD_ID_HEX_SIZE (2 * BUILD_ID_MAX_SIZE + 1)
+
+typedef struct
+{
+    uint64_t size;
+    uint32_t prot;
+} LayoutItem;
+
+typedef struct
+{
+    char* path;
+    char build_id[BUILD_ID_HEX_SIZE]; // hex, empty if unknown
+    uint64_t fingerprint;             // hash of layout in order of addresses
+    LayoutItem* layout;               // sorted by size and prot when it's loaded or added, for comparing with other layouts
+    size_t n_layout;
+} CatalogEntry;
+
+typedef struct
+{
+    CatalogEntry* entries;
+    size_t n_entries, capacity;
+} Catalog;
+
+// If file doesn't exist, catalog is empty.
+Catalog* CatalogLoad (const char* filename);
+// File is replaced atomically, so readers never see half-written catalog.
+int CatalogSave (const Catalog* catalog, const char* filename);
+void CatalogFree (Catalog* catalog);
+
+// Writers hold <catalog>.lock from loading till saving, so entries of each other aren't lost. -1 on error.
+int CatalogLock (const char* filename);
+void CatalogUnlock (int lock_fd);
+
+// Entry with the same path is replaced. layout is given in order of addresses.
+int CatalogAdd (Catalog* catalog, const char* path, const char* build_id, const LayoutItem* layout, size_t n_layout);
+
+// The best donor: same build-id, then same fingerprint, then the most common VMAs. NULL if catalog is empty.
+const CatalogEntry* CatalogLookup (const Catalog* catalog, const char* build_id, const LayoutItem* layout, size_t n_layout);
+
+uint64_t GetLayoutFingerprint (const LayoutItem* layout, size_t n_layout);
+
+// Looks for NT_GNU_BUILD_ID in notes. build_id is hex string, 0 is returned if it's found.
+int FindBuildIdInNotes (const char* notes, size_t size, char* build_id);
+// Build-id of ELF file (executable or library) on disk.
+int GetFileBuildId (const char* filename, char* build_id);
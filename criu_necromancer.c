@@ -3,34 +3,138 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <sys/procfs.h>
 #include <signal.h>
 #include <compel/asm/fpu.h>
 #include <sys/mman.h>
 #include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
 // #include <sys/user.h> included in procfs.h
 #include "criu_necromancer.h"
 #include "fileworking.h"
+#include "pages.h"
+#include "jobs.h"
+#include "stats.h"
+
+// Donor's images in memory, set only in batch mode before converting and never changed after
+static const DonorTemplate* donor_template = NULL;
+
+// Threads are created for every job, more of them only waste memory
+static const size_t MAX_JOBS = 1024;
+
+// Store of pages (--store), opened before converting and closed after it
+static PageStore* page_store = NULL;
+
+// Page of kernel, which runs necromancer and criu: unit of pagemap, pages images and store. Set in main before converting,
+// coredumps and donors with other page size are refused.
+static size_t page_size = PAGESIZE;
 
 int main (int argc, char** argv)
 {
     ArgInfo args = {};
+    int exit_code = 0;
     if (ParseArguments (argc, argv, &args))
-        return 0;
+        return 1;
+
+    if (args.stats)
+        StatsEnable (1);
+
+    long kernel_page_size = sysconf (_SC_PAGESIZE);
+    if (kernel_page_size > 0)
+        page_size = (size_t) kernel_page_size;
+
+    if (args.store_path && !args.check && (page_store = PageStoreOpen (args.store_path, page_size)) == NULL)
+    {
+        ArgInfoFree (&args);
+        return 1;
+    }
+
+    int res = -1;
+    if (args.catalog_path)
+        res = CatalogCommand (&args);
+    else if (args.materialize || args.release)
+        res = StoreCommand (&args);
+    else if (args.check)
+        res = CheckCommand (&args);
+    else if (args.batch_path)
+        res = BatchConvert (&args);
+    else if (args.output_path)
+        res = OutputConvert (&args);
+    else
+    {
+        ProcessTree* tree = ProcessTreeConstructor (&args);
+
+        if (tree != NULL && ProcessTreeConvert (tree) == 0 && ProcessTreeWrite (tree) == 0)
+            res = args.lazy_pages ? ServeLazyPages (tree) : 0;
+
+        ProcessTreeDestructor (tree);
+    }
+    exit_code = res ? 1 : 0;
 
-    Elf* elf = ElfConstructor (args.elf);
-    Images* imgs = ImagesConstructor (&args);
+    if (PageStoreClose (page_store))
+    {
+        fprintf (stderr, "Error: Can't save store %s.\n", args.store_path);
+        exit_code = 1;
+    }
 
-    if (elf != NULL && imgs != NULL)
+    if (args.stats)
     {
-        GoPhdrs (elf, imgs);
-        ImagesWrite (imgs, &args);
+        FILE* stats_file = args.stats_path ? fopen (args.stats_path, "w") : stdout;
+        if (!stats_file || StatsWrite (stats_file))
+        {
+            fprintf (stderr, "Error: Can't write statistics to %s.\n", args.stats_path ? args.stats_path : "stdout");
+            exit_code = 1;
+        }
+        if (stats_file && stats_file != stdout)
+            fclose (stats_file);
     }
 
     ArgInfoFree (&args);
-    ElfDestructor (elf);
-    ImagesDestructor (imgs);
-    return 0;
+    return exit_code;
+}
+
+// Name of file without directories, coredump of batch gets output directory with this name
+static const char* GetFileName (const char* path)
+{
+    const char* name = strrchr (path, '/');
+    return name ? name + 1 : path;
+}
+
+static int CompareFileNames (const void* a, const void* b)
+{
+    return strcmp (GetFileName (*(char* const*) a), GetFileName (*(char* const*) b));
+}
+
+// Coredumps with the same name (a/core and b/core) would be converted to one directory in parallel
+static int HasSameFileNames (const ArgInfo* args)
+{
+    char** elfs = (char**) calloc (args->n_elfs + 1, sizeof (*elfs));
+    if (!elfs)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    memcpy (elfs, args->elfs, args->n_elfs * sizeof (*elfs));
+    qsort (elfs, args->n_elfs, sizeof (*elfs), CompareFileNames);
+
+    int res = 0;
+    for (size_t i_elf = 1; i_elf < args->n_elfs && !res; i_elf++)
+        if (CompareFileNames (elfs + i_elf - 1, elfs + i_elf) == 0)
+        {
+            fprintf (stderr, "Error: Coredumps %s and %s have the same name, their images would be written to one directory "
+                             "of --batch.\n", elfs[i_elf - 1], elfs[i_elf]);
+            res = 1;
+        }
+
+    free (elfs);
+    return res;
 }
 
 int ParseArguments (int argc, char** argv, ArgInfo* args) // ToDo: getopt
@@ -39,47 +143,266 @@ int ParseArguments (int argc, char** argv, ArgInfo* args) // ToDo: getopt
     assert (argv);
     assert (args);
 
+    enum {OPT_STATS = 0x100, OPT_CHECK}; // only long options
+
     int opt_found = 0;
     struct option longopts[] = {{"coredump", 1, NULL, 'c'},
                                 {"images",   1, NULL, 'i'},
+                                {"jobs",     1, NULL, 'j'},
+                                {"pid",      1, NULL, 'p'},
+                                {"batch",    1, NULL, 'b'},
+                                {"output",   1, NULL, 'o'},
+                                {"catalog",  1, NULL, 'C'},
+                                {"add-donor",1, NULL, 'a'},
+                                {"lookup",   0, NULL, 'l'},
+                                {"file-pages",0,NULL, 'f'},
+                                {"parent",   0, NULL, 'P'},
+                                {"store",    1, NULL, 'S'},
+                                {"materialize",0,NULL,'M'},
+                                {"release",  0, NULL, 'R'},
+                                {"direct",   0, NULL, 'D'},
+                                {"lazy-pages",0,NULL, 'L'},
+                                {"uring",    0, NULL, 'U'},
+                                {"stats",    2, NULL, OPT_STATS},
+                                {"check",    0, NULL, OPT_CHECK},
                                 {"help",     0, NULL, 'h'},
                                 {NULL,       0, NULL,   0}};
 
-    while ((opt_found = getopt_long (argc, argv, "c:i:h", longopts, NULL)) != -1)
+    while ((opt_found = getopt_long (argc, argv, "c:i:j:p:b:o:C:a:lfPS:MRDLUh", longopts, NULL)) != -1)
     {
         switch (opt_found)
         {
             case 'c':
-                args->elf = optarg;
+                if (AddCoredumpArgument (args, optarg))
+                {
+                    ArgInfoFree (args);
+                    return -1;
+                }
                 break;
             
             case 'i':
                 args->criu_dump_path = optarg;
                 break;
 
+            case 'j':
+            {
+                // strtoul takes "-1" as huge number, so sign is refused before it
+                char* end = NULL;
+                errno = 0;
+                args->n_jobs = (optarg[0] == '-') ? 0 : strtoul (optarg, &end, 10);
+                if (args->n_jobs == 0 || args->n_jobs > MAX_JOBS || errno || end == optarg || *end != '\0')
+                {
+                    fprintf (stderr, "Error: bad number of jobs: %s, it must be from 1 to %zu.\n", optarg, MAX_JOBS);
+                    PrintUsage();
+                    return -1;
+                }
+                break;
+            }
+
+            case 'p':
+                args->pid = atoi (optarg);
+                if (args->pid <= 0)
+                {
+                    fprintf (stderr, "Error: bad pid: %s.\n", optarg);
+                    PrintUsage();
+                    return -1;
+                }
+                break;
+
+            case 'b':
+                args->batch_path = optarg;
+                break;
+
+            case 'o':
+                args->output_path = optarg;
+                break;
+
+            case 'C':
+                args->catalog_path = optarg;
+                break;
+
+            case 'a':
+                args->add_donor_path = optarg;
+                break;
+
+            case 'l':
+                args->lookup = 1;
+                break;
+
+            case 'f':
+                args->file_pages = 1;
+                break;
+
+            case 'P':
+                args->parent = 1;
+                break;
+
+            case 'S':
+                args->store_path = optarg;
+                break;
+
+            case 'M':
+                args->materialize = 1;
+                break;
+
+            case 'R':
+                args->release = 1;
+                break;
+
+            case 'D':
+                args->direct = 1;
+                break;
+
+            case 'L':
+                args->lazy_pages = 1;
+                break;
+
+            case 'U':
+                args->uring = 1;
+                break;
+
+            case OPT_STATS:
+                args->stats = 1;
+                args->stats_path = optarg;
+                break;
+
+            case OPT_CHECK:
+                args->check = 1;
+                break;
+
             case 'h':
+                PrintUsage();
+                ArgInfoFree (args);
+                exit (0); // only usage is asked
+
             case '?':
             default:
                 PrintUsage();
+                ArgInfoFree (args);
                 return -1;
         }
     }
 
-    #define check_pointer(field, str)   if (args->field == NULL)                               \
+    #define check_pointer(field, str)   if (!args->field)                                      \
                                         {                                                      \
                                             fprintf (stderr, "Error: no " str " in input.\n"); \
                                             PrintUsage();                                      \
-                                            *args = EMPTY_ARGINFO;                             \
+                                            ArgInfoFree (args);                                \
                                             return 1;                                          \
                                         }
 
+    if (args->catalog_path)
+    {
+        if (!args->add_donor_path && !args->lookup)
+            args->add_donor_path = args->criu_dump_path;
+        if (args->lookup)
+        {
+            check_pointer (n_elfs, "coredump path")
+        }
+        else
+        {
+            check_pointer (add_donor_path, "donor to add or --lookup")
+        }
+        return 0;
+    }
+
+    if (args->materialize || args->release)
+    {
+        check_pointer (store_path, "store path")
+        check_pointer (criu_dump_path, "CRIU dump path")
+        return 0;
+    }
+
     check_pointer (criu_dump_path, "CRIU dump path");
-    check_pointer (elf, "coredump path");
+    check_pointer (n_elfs, "coredump path");
     #undef check_pointer
 
+    if (args->pid && (args->n_elfs > 1 || args->batch_path))
+    {
+        fprintf (stderr, "Error: --pid can be used only with one coredump.\n");
+        ArgInfoFree (args);
+        return 1;
+    }
+
+    if (args->output_path && args->batch_path)
+    {
+        fprintf (stderr, "Error: --output can't be used with --batch, it's output already.\n");
+        ArgInfoFree (args);
+        return 1;
+    }
+
+    if (args->lazy_pages && args->batch_path && !args->check)
+    {
+        fprintf (stderr, "Error: --lazy-pages serves one restore, it can't be used with --batch.\n");
+        ArgInfoFree (args);
+        return 1;
+    }
+
+    if (args->batch_path && HasSameFileNames (args))
+    {
+        ArgInfoFree (args);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int AddOneCoredump (ArgInfo* args, const char* path)
+{
+    char** new_elfs = (char**) realloc (args->elfs, (args->n_elfs + 1) * sizeof (*new_elfs));
+    if (!new_elfs)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    args->elfs = new_elfs;
+    args->elfs[args->n_elfs] = strdup (path);
+    if (!args->elfs[args->n_elfs])
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    args->n_elfs++;
     return 0;
 }
 
+// Coredumps are given by several -c or by directory with them
+int AddCoredumpArgument (ArgInfo* args, const char* path)
+{
+    assert (args);
+    assert (path);
+
+    struct stat path_stat = {};
+    if (strcmp (path, "-") == 0 || stat (path, &path_stat) || !S_ISDIR (path_stat.st_mode))
+        return AddOneCoredump (args, path);
+
+    struct dirent** dir_entries = NULL;
+    int n_entries = scandir (path, &dir_entries, NULL, alphasort);
+    if (n_entries < 0)
+    {
+        fprintf (stderr, "Error: Can't read directory %s.\n", path);
+        return -1;
+    }
+
+    int res = 0;
+    for (int i_entry = 0; i_entry < n_entries; i_entry++)
+    {
+        char filename[MAX_PATH_LEN] = "";
+        snprintf (filename, MAX_PATH_LEN, "%s/%s", path, dir_entries[i_entry]->d_name);
+
+        if (res == 0 && dir_entries[i_entry]->d_name[0] != '.' && 
+            stat (filename, &path_stat) == 0 && !S_ISDIR (path_stat.st_mode))
+            res = AddOneCoredump (args, filename);
+
+        free (dir_entries[i_entry]);
+    }
+
+    free (dir_entries);
+    return res;
+}
+
 // C-style overloading
 
 char* CreateImagePath  (const char* path, const char* name)
@@ -106,674 +429,3778 @@ char* CreateImagePathWithPid (const char* path, const char* name, int pid)
 
 void ArgInfoFree (ArgInfo* args)
 {
-    // ToDo: Now is simple. Maybe delete it?
     assert (args);
 
+    for (size_t i_elf = 0; i_elf < args->n_elfs; i_elf++)
+        free (args->elfs[i_elf]);
+    free (args->elfs);
+
     *args = EMPTY_ARGINFO;
     return;
 }
 
-Images* ImagesConstructor (ArgInfo* args)
+static size_t GetOuterJobs (size_t n_jobs, size_t n_processes)
+{
+    if (n_jobs == 0)
+        n_jobs = 1;
+    return (n_processes < n_jobs) ? n_processes : n_jobs;
+}
+
+ProcessTree* ProcessTreeConstructor (ArgInfo* args)
 {
     assert (args);
+    assert (args->n_elfs);
 
-    Images* imgs = (Images*) calloc (1, sizeof (*imgs)); 
-    if (imgs == NULL)                                   
-    {                                                     
-        perror ("Can't create images");
-        ArgInfoFree (args);                        
-        return NULL;                                      
+    ProcessTree* tree = (ProcessTree*) calloc (1, sizeof (*tree));
+    if (!tree)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
     }
+    tree->args = args;
 
-    #define check_retval(retval) if ((retval))                                             \
-                                    {                                                      \
-                                        fprintf (stderr, "Error: Can't create images.\n"); \
-                                        ImagesDestructor (imgs);                           \
-                                        return NULL;                                       \
-                                    }
+    #define check_correct(cond, ...) if ((cond))                         \
+                                     {                                   \
+                                         fprintf (stderr, __VA_ARGS__);  \
+                                         ProcessTreeDestructor (tree);   \
+                                         return NULL;                    \
+                                     }
 
-    check_retval (ReadOnlyOneMessage (args->criu_dump_path, "pstree", 0,
-                      (MessageUnpacker*) pstree_entry__unpack, (ProtobufCMessage**) &(imgs->pstree), MY_PSTREE_MAGIC) == -1);
-    args->criu_dump_id = imgs->pstree->pid;
+    tree->arena = ArenaConstructor();
+    check_correct (tree->arena == NULL, "Error: Can't create images.\n")
 
-    check_retval (ReadOnlyOneMessage (args->criu_dump_path, "core", args->criu_dump_id,
-                      (MessageUnpacker*) core_entry__unpack,   (ProtobufCMessage**) &(imgs->core),   MY_CORE_MAGIC)   == -1);
-    check_retval (ReadOnlyOneMessage (args->criu_dump_path, "mm",   args->criu_dump_id, 
-                      (MessageUnpacker*) mm_entry__unpack,     (ProtobufCMessage**) &(imgs->mm),     MY_MM_MAGIC)     == -1);
-    
-    // Start pagemap:
-    char* pagemap_filename = CreateImagePathWithPid (args->criu_dump_path, "pagemap", args->criu_dump_id);
-    check_retval (pagemap_filename == NULL)
-    check_retval ((imgs->pagemap = StartImageWriting (pagemap_filename, MY_PAGEMAP_MAGIC)) == NULL)
-    free (pagemap_filename);
-    
-    // In my situation criu always creates pagemap-pid.img and pages-1.img. I don't know, how could it be otherwise.
-    PagemapHead head = PAGEMAP_HEAD__INIT;
-    head.pages_id = 1;
-    WriteMessage ((MessagePacker*) pagemap_head__pack, (ProtobufCMessage*) &head, pagemap_head__get_packed_size (&head), imgs->pagemap);
+    check_correct (ReadAllMessages (args->criu_dump_path, "pstree", 0, (MessageUnpacker*) pstree_entry__unpack, tree->arena,
+                                    (ProtobufCMessage***) &tree->entries, &tree->n_entries, MY_PSTREE_MAGIC),
+                   "Error: Can't read pstree image.\n")
+    check_correct (tree->n_entries == 0, "Error: pstree image is empty.\n")
 
-    imgs->pages = fopen ("pages-1.img", "w"); // It's raw data, there is no protobuf messages.
-    check_retval (imgs->pages == NULL)
+    tree->donor_pids = (int*) calloc (tree->n_entries, sizeof (*tree->donor_pids));
+    tree->processes  = (Process*) calloc (args->n_elfs, sizeof (*tree->processes));
+    check_correct (!tree->donor_pids || !tree->processes, "Error: Can't allocate memory.\n")
 
-    #undef check_retval
-    return imgs;
+    for (size_t i_entry = 0; i_entry < tree->n_entries; i_entry++)
+        tree->donor_pids[i_entry] = tree->entries[i_entry]->pid;
+
+    // Threads are shared between processes, which are converted in parallel
+    tree->n_processes = args->n_elfs;
+    size_t n_outer = GetOuterJobs (args->n_jobs, tree->n_processes);
+    size_t n_inner = (args->n_jobs > n_outer) ? args->n_jobs / n_outer : 1;
+
+    // Only headers and notes are read here, it's enough for matching
+    for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+    {
+        Process* process = tree->processes + i_process;
+        process->elf_path = args->elfs[i_process];
+        process->n_jobs = n_inner;
+
+        uint64_t start = StatsNow();
+        process->elf = ElfConstructor (process->elf_path, n_inner);
+        check_correct (process->elf == NULL, "Error: Can't read coredump %s.\n", process->elf_path)
+        StatsPhaseEnd (PHASE_ELF, start);
+        StatsAdd (COUNTER_COREDUMPS, 1);
+        StatsAdd (COUNTER_CORE_BYTES, process->elf->is_stream ? 0 : process->elf->size);
+
+        prpsinfo_t* prpsinfo = FindPrpsinfo (process->elf);
+        check_correct (prpsinfo == NULL, "Error: There is no NT_PRPSINFO in coredump %s.\n", process->elf_path)
+        process->prpsinfo = *prpsinfo;
+    }
+
+    check_correct (MatchProcesses (tree), "Error: Can't match coredumps with donor's pstree.\n")
+
+    #undef check_correct
+    return tree;
 }
 
-void ChangeImagePid (const char* path, const char* name, int old_pid, int new_pid)
+prpsinfo_t* FindPrpsinfo (Elf* elf)
 {
-    assert (path);
-    assert (name);
-    assert (old_pid);
-    assert (new_pid);
+    assert (elf);
 
-    char* old_name = CreateImagePathWithPid (path, name, old_pid);
-    char* new_name = CreateImagePathWithPid (path, name, new_pid);
-    rename (old_name, new_name);
-    free (old_name);
-    free (new_name);
-    return;
+    Elf_Nhdr* nhdr = elf->notes.process[NOTE_PRPSINFO];
+    return (nhdr && nhdr->n_descsz >= sizeof (prpsinfo_t)) ? (prpsinfo_t*) GetNoteDesc (nhdr) : NULL;
 }
 
-void ImagesWrite (Images* imgs, ArgInfo* args)
+// Similarity of dead process and entry of donor's pstree, the most similar free entry is taken
+static int GetMatchScore (ProcessTree* tree, Process* process, PstreeEntry* entry)
 {
-    assert (imgs);
-    assert (args);
-    assert (args->criu_dump_path);
-    assert (args->criu_dump_id);
-    assert (imgs->pstree);
-    assert (imgs->core);
-    assert (imgs->mm);
-
-    WriteOnlyOneMessage (args->criu_dump_path, "pstree",               0, (MessagePacker*) pstree_entry__pack, imgs->pstree, 
-                         pstree_entry__get_packed_size (imgs->pstree), MY_PSTREE_MAGIC);
+    prpsinfo_t* info = &process->prpsinfo;
+    int score = 0;
 
-    WriteOnlyOneMessage (args->criu_dump_path, "core", imgs->pstree->pid, (MessagePacker*) core_entry__pack,   imgs->core,
-                         core_entry__get_packed_size   (imgs->core),   MY_CORE_MAGIC);
+    if (process->parent == NO_PROCESS && entry->ppid == 0)
+        score += 8;
+    if ((info->pr_sid == info->pr_pid) == (entry->sid == entry->pid))
+        score += 4;
+    if ((info->pr_pgrp == info->pr_pid) == (entry->pgid == entry->pid))
+        score += 2;
 
-    WriteOnlyOneMessage (args->criu_dump_path, "mm",   imgs->pstree->pid, (MessagePacker*) mm_entry__pack,     imgs->mm, 
-                         mm_entry__get_packed_size     (imgs->mm),     MY_MM_MAGIC);
+    if (process->parent != NO_PROCESS)
+    {
+        Process* parent = tree->processes + process->parent;
+        if ((info->pr_pgrp == parent->prpsinfo.pr_pgrp) == (entry->pgid == parent->donor->pgid))
+            score += 2;
+    }
 
-    // In my images I found 2 files, that need to be renamed: fs and ids.
-    // core, mm and pagemap are renamed yet.
-    // ToDo: find all files in documentation.
-    fclose (imgs->pagemap);
-    imgs->pagemap = NULL; // ToDo: OK???
+    size_t n_children = 0;
+    for (size_t i_entry = 0; i_entry < tree->n_entries; i_entry++)
+        if (tree->entries[i_entry]->ppid == entry->pid)
+            n_children++;
 
-    ChangeImagePid (args->criu_dump_path, "fs",      args->criu_dump_id, imgs->pstree->pid);
-    ChangeImagePid (args->criu_dump_path, "ids",     args->criu_dump_id, imgs->pstree->pid);
-    ChangeImagePid (args->criu_dump_path, "pagemap", args->criu_dump_id, imgs->pstree->pid);
+    if (n_children == process->n_children)
+        score += 1;
 
-    return;
+    return score;
 }
 
-void ImagesDestructor (Images* imgs)
+int MatchProcesses (ProcessTree* tree)
 {
-    if (!imgs)
-        return;
+    assert (tree);
 
-    pstree_entry__free_unpacked  (imgs->pstree,  NULL);
-    core_entry__free_unpacked    (imgs->core,    NULL);
-    mm_entry__free_unpacked      (imgs->mm,      NULL);
+    for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+        tree->processes[i_process].parent = NO_PROCESS;
 
-    if (imgs->pagemap) fclose (imgs->pagemap);
-    if (imgs->pages)   fclose (imgs->pages);
+    for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+    {
+        Process* process = tree->processes + i_process;
 
-    *imgs = EMPTY_IMAGES;
-    free (imgs);
-    return;
-}
+        for (size_t i_other = 0; i_other < tree->n_processes; i_other++)
+        {
+            Process* other = tree->processes + i_other;
 
-Elf* ElfConstructor (const char* filename)
-{
-    assert (filename);
-    Elf* elf_result = (Elf*) calloc (1, sizeof (*elf_result)); // calloc <==> all pointers are NULL 
+            if (i_other != i_process && other->prpsinfo.pr_pid == process->prpsinfo.pr_pid)
+            {
+                fprintf (stderr, "Error: Coredumps %s and %s are given from one process %d.\n", 
+                                 process->elf_path, other->elf_path, process->prpsinfo.pr_pid);
+                return -1;
+            }
 
-    #define check_pointer(name) if (elf_result->name == NULL)   \
-                                {                               \
-                                    ElfDestructor (elf_result); \
-                                    return NULL;                \
-                                }
+            if (other->prpsinfo.pr_pid == process->prpsinfo.pr_ppid)
+            {
+                process->parent = i_other;
+                other->n_children++;
+            }
+        }
+    }
 
-    elf_result->buf = ReadFile (filename);
-    check_pointer (buf);    
+    char* used = (char*) calloc (tree->n_entries, sizeof (*used));
+    if (!used)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
 
-    elf_result->elf_hdr = CheckElfHdr (elf_result->buf);
-    check_pointer (elf_hdr);
+    // Parents are matched before children, children are looked for among children of matched parent
+    size_t n_matched = 0, n_matched_before = SIZE_MAX;
+    while (n_matched < tree->n_processes && n_matched != n_matched_before)
+    {
+        n_matched_before = n_matched;
 
-    elf_result->phdr_table = CheckPhdrs (elf_result);
-    check_pointer (phdr_table);
+        for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+        {
+            Process* process = tree->processes + i_process;
+            if (process->donor || (process->parent != NO_PROCESS && !tree->processes[process->parent].donor))
+                continue;
+
+            int best_score = -1;
+            size_t best_entry = 0;
+            for (size_t i_entry = 0; i_entry < tree->n_entries; i_entry++)
+            {
+                if (used[i_entry])
+                    continue;
+                if (process->parent != NO_PROCESS && tree->entries[i_entry]->ppid != tree->processes[process->parent].donor->pid)
+                    continue;
+
+                int score = GetMatchScore (tree, process, tree->entries[i_entry]);
+                if (score > best_score)
+                {
+                    best_score = score;
+                    best_entry = i_entry;
+                }
+            }
 
-    #undef check_pointer
-    return elf_result;
+            if (best_score < 0)
+            {
+                fprintf (stderr, "Error: There is no process in donor's pstree for coredump %s (pid %d).\n",
+                                 process->elf_path, process->prpsinfo.pr_pid);
+                free (used);
+                return -1;
+            }
+
+            used[best_entry] = 1;
+            process->donor = tree->entries[best_entry];
+            n_matched++;
+        }
+    }
+
+    for (size_t i_entry = 0; i_entry < tree->n_entries; i_entry++)
+        if (!used[i_entry])
+            fprintf (stderr, "Warning: There is no coredump for process %d from donor's pstree, its images are kept.\n",
+                             tree->entries[i_entry]->pid);
+
+    free (used);
+    return 0;
 }
 
-void ElfDestructor (Elf* elf)
+static int ConvertProcessJob (void* ctx, size_t i_task)
 {
-    if (elf)
+    ProcessTree* tree = (ProcessTree*) ctx;
+    Process* process = tree->processes + i_task;
+
+    uint64_t start = StatsNow();
+    process->imgs = ImagesConstructor (tree->args, process->donor, process->n_jobs);
+    if (!process->imgs)
+        return -1;
+    StatsPhaseEnd (PHASE_IMAGES, start);
+
+    return GoPhdrs (process->elf, process->imgs);
+}
+
+int ProcessTreeConvert (ProcessTree* tree)
+{
+    assert (tree);
+
+    // All donor's images of process are read in its constructor, before any image with new pid is written
+    if (RunJobs (GetOuterJobs (tree->args->n_jobs, tree->n_processes), tree->n_processes, ConvertProcessJob, tree))
     {
-        free (elf->buf);
-        free (elf);
+        fprintf (stderr, "Error: Can't convert coredumps.\n");
+        return -1;
     }
 
-    return;
+    if (tree->args->pid)
+        ChangeProcessPid (tree->processes[0].imgs, tree->args->pid);
+
+    return 0;
 }
 
-Elf_Ehdr* CheckElfHdr (const char* buf)
+typedef struct
 {
-    assert (buf);
-    Elf_Ehdr* elf_hdr = (Elf_Ehdr*) buf;
+    ArgInfo* args;
+    const DonorTemplate* donor;
+    size_t n_jobs; // for one coredump
+    int n_failed;  // coredumps, which aren't converted
+} BatchContext;
 
-    #define check(condition, error_type) if (!(condition))                                 \
-                                         {                                                 \
-                                             fprintf (stderr, "Error: " error_type ".\n"); \
-                                             return NULL;                                  \
-                                         }
+static int BatchConvertJob (void* ctx, size_t i_task)
+{
+    BatchContext* batch = (BatchContext*) ctx;
+    char* elf_path = batch->args->elfs[i_task];
 
-    // ToDo: or check (strncmp (elf_hdr->e_ident, ELFMAG) == 0)?
-    check (elf_hdr->e_ident[0] == ELFMAG0, "Bad magic number byte 0");
+    // Every coredump gets directory with name of its file, names are unique (checked by ParseArguments)
+    const char* elf_name = GetFileName (elf_path);
+
+    char out_path[MAX_PATH_LEN] = "";
+    snprintf (out_path, MAX_PATH_LEN, "%s/%s", batch->args->batch_path, elf_name);
+
+    if (DonorTemplateClone (batch->donor, out_path))
+    {
+        __atomic_fetch_add (&batch->n_failed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    ArgInfo core_args = {.elfs = &elf_path, .n_elfs = 1, .criu_dump_path = out_path, .n_jobs = batch->n_jobs,
+                          .file_pages = batch->args->file_pages, .parent = batch->args->parent, .direct = batch->args->direct,
+                          .uring = batch->args->uring};
+    ProcessTree* tree = ProcessTreeConstructor (&core_args);
+    int res = -1;
+
+    if (tree != NULL && ProcessTreeConvert (tree) == 0)
+        res = ProcessTreeWrite (tree);
+
+    ProcessTreeDestructor (tree);
+    if (res)
+    {
+        fprintf (stderr, "Error: Coredump %s isn't converted.\n", elf_path);
+        __atomic_fetch_add (&batch->n_failed, 1, __ATOMIC_RELAXED);
+    }
+    else
+        printf ("%s -> %s\n", elf_path, out_path);
+
+    return 0; // other coredumps are converted anyway
+}
+
+// Only these images are read by necromancer, others are only cloned
+static const char* const READ_IMAGES[] = {"pstree", "core-", "mm-", "pagemap-", "files"};
+static const size_t N_READ_IMAGES = sizeof (READ_IMAGES) / sizeof (*READ_IMAGES);
+
+// Output directory is created. It must differ from donor's one, else clones of images replace donor's images.
+static int CreateOutputDirectory (const char* donor_path, const char* out_path)
+{
+    char donor_real[PATH_MAX] = "", out_real[PATH_MAX] = "";
+    if (mkdir (out_path, 0777) && errno != EEXIST)
+    {
+        fprintf (stderr, "Error: Can't create directory %s : %s.\n", out_path, strerror (errno));
+        return -1;
+    }
+
+    if (!realpath (donor_path, donor_real) || !realpath (out_path, out_real) || strcmp (donor_real, out_real) == 0)
+    {
+        fprintf (stderr, "Error: Output directory must differ from donor's directory.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int BatchConvert (ArgInfo* args)
+{
+    assert (args);
+    assert (args->batch_path);
+
+    if (CreateOutputDirectory (args->criu_dump_path, args->batch_path))
+        return -1;
+
+    for (size_t i_elf = 0; i_elf < args->n_elfs; i_elf++)
+        if (strcmp (args->elfs[i_elf], "-") == 0)
+        {
+            fprintf (stderr, "Error: stdin can't be used in batch mode.\n");
+            return -1;
+        }
+
+    DonorTemplate* donor = DonorTemplateConstructor (args->criu_dump_path, READ_IMAGES, N_READ_IMAGES);
+    if (!donor)
+        return -1;
+
+    BatchContext batch = {.args = args, .donor = donor, .n_jobs = 1};
+    size_t n_outer = GetOuterJobs (args->n_jobs, args->n_elfs);
+    if (args->n_jobs > n_outer)
+        batch.n_jobs = args->n_jobs / n_outer;
+
+    donor_template = donor;
+    int res = RunJobs (n_outer, args->n_elfs, BatchConvertJob, &batch);
+    donor_template = NULL;
+
+    DonorTemplateDestructor (donor);
+    if (batch.n_failed)
+        fprintf (stderr, "Error: %d of %zu coredumps aren't converted.\n", batch.n_failed, args->n_elfs);
+    return (res || batch.n_failed) ? -1 : 0;
+}
+
+// Like batch with one output: donor's images are read from memory, new images are written to output directory
+// and other files are cloned there. Donor's directory isn't changed, so it can be used again.
+int OutputConvert (ArgInfo* args)
+{
+    assert (args);
+    assert (args->output_path);
+
+    if (CreateOutputDirectory (args->criu_dump_path, args->output_path))
+        return -1;
+
+    DonorTemplate* donor = DonorTemplateConstructor (args->criu_dump_path, READ_IMAGES, N_READ_IMAGES);
+    if (!donor || DonorTemplateClone (donor, args->output_path))
+    {
+        DonorTemplateDestructor (donor);
+        return -1;
+    }
+
+    const char* donor_path = args->criu_dump_path;
+    args->criu_dump_path = args->output_path;
+    donor_template = donor;
+
+    ProcessTree* tree = ProcessTreeConstructor (args);
+    int res = -1;
+
+    if (tree != NULL && ProcessTreeConvert (tree) == 0)
+        res = ProcessTreeWrite (tree);
+    if (res == 0 && args->lazy_pages)
+        res = ServeLazyPages (tree);
+
+    ProcessTreeDestructor (tree);
+    donor_template = NULL;
+    args->criu_dump_path = donor_path;
+
+    DonorTemplateDestructor (donor);
+    return res;
+}
+
+// Pages of lazy segments are given to criu restore from mappings of coredumps, which are kept until processes exit
+int ServeLazyPages (ProcessTree* tree)
+{
+    assert (tree);
+
+    LazyProcess* processes = (LazyProcess*) calloc (tree->n_processes, sizeof (*processes));
+    if (!processes)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    int res = 0;
+    for (size_t i_process = 0; i_process < tree->n_processes && res == 0; i_process++)
+    {
+        Process* process = tree->processes + i_process;
+        const PagesPlan* plan = &process->imgs->plan;
+        LazyProcess* lazy = processes + i_process;
+
+        lazy->pid = process->imgs->pstree->pid;
+        lazy->ranges = (LazyRange*) calloc (plan->n_segments + 1, sizeof (*lazy->ranges));
+        if (!lazy->ranges)
+        {
+            perror ("Can't allocate memory");
+            res = -1;
+            break;
+        }
+
+        // Segments are added in order of PT_LOADs, kernel writes them in order of addresses
+        for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
+        {
+            Elf_Phdr* phdr = plan->segments[i_segment].phdr;
+            if (plan->segments[i_segment].is_lazy)
+                lazy->ranges[lazy->n_ranges++] = (LazyRange) {.start = phdr->p_vaddr, .end = phdr->p_vaddr + phdr->p_filesz,
+                                                              .data = process->elf->buf + phdr->p_offset};
+        }
+    }
+
+    char socket_path[MAX_PATH_LEN] = "";
+    snprintf (socket_path, MAX_PATH_LEN, "%s/" LAZY_PAGES_SOCKET, tree->args->criu_dump_path);
+    if (res == 0)
+        res = LazyPagesServe (socket_path, processes, tree->n_processes, page_size);
+
+    for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+        free (processes[i_process].ranges);
+    free (processes);
+    return res;
+}
+
+// Result of --check for one coredump
+typedef struct
+{
+    int res;            // of PlanPhdrs (-2 for page size), -1 if donor's images aren't read, -3 if it isn't checked at all
+    int donor_pid;
+    size_t donor_threads, donor_vmas, vmas_matched;
+    size_t pages_max;   // in segments, which are written
+    size_t pages_anon;  // of them: anonymous, zero pages are skipped there
+    size_t pages_lazy;
+    size_t n_samples, n_zero_samples;
+    size_t pagemap_entries; // estimate: runs of non-zero pages are counted by samples
+} CheckResult;
+
+typedef struct
+{
+    ProcessTree* tree;
+    CheckResult* results;
+} CheckContext;
+
+// Pages of anonymous segments are read at CHECK_SAMPLES places spread evenly over them, stream isn't read
+static void SampleZeroPages (const Elf* elf, const PagesPlan* plan, CheckResult* result)
+{
+    size_t step = (result->pages_anon > CHECK_SAMPLES) ? result->pages_anon / CHECK_SAMPLES : 1;
+    size_t sample = step / 2;
+
+    // first is the number of the first page of segment among all anonymous pages
+    for (size_t i_segment = 0, first = 0; i_segment < plan->n_segments; i_segment++)
+    {
+        const SegmentPlan* segment = plan->segments + i_segment;
+        if (!segment->is_anon || segment->is_lazy)
+            continue;
+
+        size_t n_pages = segment->phdr->p_filesz / page_size, n_runs = 0;
+        int in_run = 0, is_sampled = 0;
+
+        for (; !elf->is_stream && sample < first + n_pages; sample += step)
+        {
+            int is_zero = IsZeroPage (elf->buf + segment->phdr->p_offset + (sample - first) * page_size, page_size);
+            result->n_samples++;
+            result->n_zero_samples += is_zero;
+            n_runs += (!is_zero && !in_run);
+            in_run = !is_zero;
+            is_sampled = 1;
+        }
+
+        // Segment between samples has one run at least
+        result->pagemap_entries += is_sampled ? n_runs : 1;
+        first += n_pages;
+    }
+
+    return;
+}
+
+static int CheckProcessJob (void* ctx, size_t i_task)
+{
+    CheckContext* check = (CheckContext*) ctx;
+    Process* process = check->tree->processes + i_task;
+    CheckResult* result = check->results + i_task;
+
+    result->res = -1;
+    result->donor_pid = process->donor->pid;
+    result->donor_threads = process->donor->n_threads;
+
+    process->imgs = ImagesConstructor (check->tree->args, process->donor, process->n_jobs);
+    if (!process->imgs)
+        return 0; // it's result of checking
+
+    Images* imgs = process->imgs;
+    result->donor_vmas = imgs->mm->n_vmas;
+    result->res = PlanPhdrs (process->elf, imgs);
+    if (result->res < 0)
+        return 0;
+
+    for (size_t i_vma = 0; i_vma < imgs->mm->n_vmas; i_vma++)
+        result->vmas_matched += (imgs->donor_vmas[i_vma] != NULL);
+
+    // Lazy segment and segment, which isn't scanned, have one pagemap entry
+    for (size_t i_segment = 0; i_segment < imgs->plan.n_segments; i_segment++)
+    {
+        const SegmentPlan* segment = imgs->plan.segments + i_segment;
+        size_t n_pages = segment->phdr->p_filesz / page_size;
+
+        if (segment->is_lazy)
+            result->pages_lazy += n_pages;
+        else
+            result->pages_max += n_pages;
+
+        if (segment->is_anon && !segment->is_lazy)
+            result->pages_anon += n_pages;
+        else
+            result->pagemap_entries++;
+    }
+
+    SampleZeroPages (process->elf, &imgs->plan, result);
+    return 0;
+}
+
+static void PrintJsonString (FILE* file, const char* str)
+{
+    fputc ('"', file);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            fprintf (file, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20)
+            fprintf (file, "\\u%04x", *str);
+        else
+            fputc (*str, file);
+    }
+    fputc ('"', file);
+    return;
+}
+
+// One process tree: one line of JSON on stdout
+static int CheckTree (ArgInfo* args)
+{
+    ProcessTree* tree = ProcessTreeConstructor (args);
+    if (!tree)
+    {
+        printf ("{\"compatible\": false, \"processes\": []}\n");
+        return -1;
+    }
+
+    CheckContext check = {.tree = tree, .results = (CheckResult*) calloc (tree->n_processes, sizeof (*check.results))};
+    if (!check.results)
+    {
+        perror ("Can't allocate memory");
+        ProcessTreeDestructor (tree);
+        return -1;
+    }
+
+    // Jobs aren't started after failure, so process is incompatible until its job is done
+    for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+        check.results[i_process] = (CheckResult) {.res = -3, .donor_pid = tree->processes[i_process].donor->pid};
+
+    int compatible = 1;
+    if (RunJobs (GetOuterJobs (args->n_jobs, tree->n_processes), tree->n_processes, CheckProcessJob, &check))
+    {
+        fprintf (stderr, "Error: Can't check coredumps.\n");
+        compatible = 0;
+    }
+
+    for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+        compatible &= (check.results[i_process].res == 0);
+
+    printf ("{\"compatible\": %s, \"processes\": [", compatible ? "true" : "false");
+    for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+    {
+        const Process* process = tree->processes + i_process;
+        const CheckResult* result = check.results + i_process;
+
+        size_t n_loads = 0;
+        for (Elf_Half i_phdr = 0; i_phdr < process->elf->phnum; i_phdr++)
+            n_loads += (process->elf->phdr_table[i_phdr].p_type == PT_LOAD);
+
+        // Zero pages are skipped in anonymous segments only
+        double zero_ratio = result->n_samples ? (double) result->n_zero_samples / result->n_samples : 0.0;
+        size_t pages_est = result->pages_max - result->pages_anon + (size_t) (result->pages_anon * (1.0 - zero_ratio) + 0.5);
+
+        printf ("%s{\"coredump\": ", i_process ? ", " : "");
+        PrintJsonString (stdout, process->elf_path);
+        printf (", \"compatible\": %s, \"error\": %s, \"pid\": %d, \"donor_pid\": %d, \"threads\": %zu, \"donor_threads\": %zu, "
+                "\"vmas\": %zu, \"donor_vmas\": %zu, \"vmas_matched\": %zu, \"pages_max\": %zu, \"pages_lazy\": %zu, "
+                "\"samples\": %zu, \"zero_ratio\": %.3f, \"pagemap_entries_est\": %zu, \"pages_bytes_est\": %zu}",
+                result->res == 0 ? "true" : "false",
+                result->res == 0 ? "null" : result->res == 1 ? "\"registers of threads\"" :
+                                     result->res == -2 ? "\"page size\"" : result->res == -3 ? "\"not checked\"" : "\"images or VMAs\"",
+                process->prpsinfo.pr_pid, result->donor_pid, process->elf->notes.n_threads, result->donor_threads,
+                n_loads, result->donor_vmas, result->vmas_matched, result->pages_max, result->pages_lazy,
+                result->n_samples, zero_ratio, result->pagemap_entries, pages_est * page_size);
+    }
+    printf ("]}\n");
+    fflush (stdout);
+
+    free (check.results);
+    ProcessTreeDestructor (tree);
+    return compatible ? 0 : -1;
+}
+
+// --check: donor is checked against coredumps as converting does it, but page data is only sampled and nothing is written.
+// With --batch every coredump is checked separately.
+int CheckCommand (ArgInfo* args)
+{
+    assert (args);
+    assert (args->check);
+
+    if (!args->batch_path)
+        return CheckTree (args);
+
+    int res = 0;
+    for (size_t i_elf = 0; i_elf < args->n_elfs; i_elf++)
+    {
+        ArgInfo core_args = {.elfs = args->elfs + i_elf, .n_elfs = 1, .criu_dump_path = args->criu_dump_path, .n_jobs = args->n_jobs,
+                             .file_pages = args->file_pages, .lazy_pages = args->lazy_pages, .check = 1};
+        res |= CheckTree (&core_args);
+    }
+
+    return res;
+}
+
+int CatalogCommand (ArgInfo* args)
+{
+    assert (args);
+    assert (args->catalog_path);
+
+    // Adding is load-modify-save, other adders wait for the end of it
+    int lock_fd = -1;
+    if (args->add_donor_path && (lock_fd = CatalogLock (args->catalog_path)) == -1)
+        return -1;
+
+    Catalog* catalog = CatalogLoad (args->catalog_path);
+    if (!catalog)
+    {
+        CatalogUnlock (lock_fd);
+        return -1;
+    }
+
+    LayoutItem* layout = NULL;
+    size_t n_layout = 0;
+    char build_id[BUILD_ID_HEX_SIZE] = "";
+    int res = 0;
+
+    if (args->add_donor_path)
+    {
+        char donor_real[PATH_MAX] = "";
+        res = -1;
+
+        if (!realpath (args->add_donor_path, donor_real))
+            fprintf (stderr, "Error: Can't find donor's directory %s.\n", args->add_donor_path);
+        else if (GetDonorLayout (donor_real, &layout, &n_layout, build_id) == 0 &&
+                 CatalogAdd (catalog, donor_real, build_id, layout, n_layout) == 0 &&
+                 CatalogSave (catalog, args->catalog_path) == 0)
+        {
+            printf ("%s is added to catalog: %zu VMAs, build-id %s\n", donor_real, n_layout, build_id[0] ? build_id : "unknown");
+            res = 0;
+        }
+
+        free (layout);
+        layout = NULL;
+    }
+    CatalogUnlock (lock_fd);
+
+    for (size_t i_elf = 0; args->lookup && i_elf < args->n_elfs; i_elf++)
+    {
+        // Only headers, notes and few pages of main binary are read
+        Elf* elf = ElfConstructor (args->elfs[i_elf], 1);
+        build_id[0] = '\0';
+
+        if (!elf || GetCoreLayout (elf, &layout, &n_layout, build_id))
+        {
+            fprintf (stderr, "Error: Can't read layout of coredump %s.\n", args->elfs[i_elf]);
+            res = -1;
+        }
+        else
+        {
+            const CatalogEntry* donor = CatalogLookup (catalog, build_id, layout, n_layout);
+            if (!donor)
+            {
+                fprintf (stderr, "Error: There is no donor for %s in catalog.\n", args->elfs[i_elf]);
+                res = -1;
+            }
+            else
+            {
+                if (build_id[0] && strcmp (build_id, donor->build_id) != 0)
+                    fprintf (stderr, "Warning: Donor for %s has other build-id.\n", args->elfs[i_elf]);
+                printf ("%s %s\n", args->elfs[i_elf], donor->path);
+            }
+        }
+
+        free (layout);
+        layout = NULL;
+        ElfDestructor (elf);
+    }
+
+    CatalogFree (catalog);
+    return res;
+}
+
+static int IsManifestEntry (const struct dirent* entry)
+{
+    size_t len = strlen (entry->d_name), suffix_len = strlen (MANIFEST_SUFFIX);
+    return len > suffix_len && strncmp (entry->d_name, "pages-", 6) == 0 && strcmp (entry->d_name + len - suffix_len, MANIFEST_SUFFIX) == 0;
+}
+
+// Every manifest of images directory: pages-<id>.img is rebuilt from store or references of manifest are released
+int StoreCommand (ArgInfo* args)
+{
+    assert (args);
+    assert (args->criu_dump_path);
+    assert (page_store);
+
+    struct dirent** dir_entries = NULL;
+    int n_entries = scandir (args->criu_dump_path, &dir_entries, IsManifestEntry, alphasort);
+    if (n_entries < 0)
+    {
+        fprintf (stderr, "Error: Can't read directory %s.\n", args->criu_dump_path);
+        return -1;
+    }
+
+    int res = 0;
+    for (int i_entry = 0; i_entry < n_entries; i_entry++)
+    {
+        char manifest_filename[MAX_PATH_LEN] = "";
+        snprintf (manifest_filename, MAX_PATH_LEN, "%s/%s", args->criu_dump_path, dir_entries[i_entry]->d_name);
+        free (dir_entries[i_entry]);
+
+        // Manifest is removed only if all its pages are released
+        if (args->release)
+        {
+            if (PageStoreRelease (page_store, manifest_filename))
+            {
+                fprintf (stderr, "Error: Can't release %s.\n", manifest_filename);
+                res = -1;
+            }
+            continue;
+        }
+
+        size_t n_keys = 0;
+        uint64_t* keys = ManifestRead (manifest_filename, &n_keys, page_size);
+        if (!keys)
+        {
+            res = -1;
+            continue;
+        }
+
+        // pages-<id>.manifest -> pages-<id>.img
+        char pages_filename[MAX_PATH_LEN] = "";
+        snprintf (pages_filename, MAX_PATH_LEN, "%.*s.img", (int) (strlen (manifest_filename) - strlen (MANIFEST_SUFFIX)), manifest_filename);
+
+        int pages_fd = RecreateFile (pages_filename);
+        if (pages_fd == -1 || PageStoreCopy (page_store, keys, n_keys, pages_fd, 0))
+        {
+            fprintf (stderr, "Error: Can't materialize %s.\n", pages_filename);
+            res = -1;
+        }
+        if (pages_fd != -1)
+            close (pages_fd);
+
+        free (keys);
+    }
+
+    free (dir_entries);
+    return res;
+}
+
+// Layout of root process of donor's tree
+int GetDonorLayout (const char* path, LayoutItem** layout, size_t* n_layout, char* build_id)
+{
+    assert (path);
+    assert (layout);
+    assert (n_layout);
+    assert (build_id);
+
+    Arena* arena = ArenaConstructor();
+    PstreeEntry** entries = NULL;
+    FileEntry** files = NULL;
+    size_t n_entries = 0, n_files = 0;
+    MmEntry* mm = NULL;
+    int res = -1;
+
+    if (!arena || ReadAllMessages (path, "pstree", 0, (MessageUnpacker*) pstree_entry__unpack, arena,
+                                   (ProtobufCMessage***) &entries, &n_entries, MY_PSTREE_MAGIC) || n_entries == 0 ||
+        ReadOnlyOneMessage (path, "mm", entries[0]->pid, (MessageUnpacker*) mm_entry__unpack, arena,
+                            (ProtobufCMessage**) &mm, MY_MM_MAGIC))
+    {
+        fprintf (stderr, "Error: Can't read donor's images in %s.\n", path);
+        goto finish;
+    }
+
+    *layout = (LayoutItem*) calloc (mm->n_vmas + 1, sizeof (**layout));
+    if (!*layout)
+    {
+        perror ("Can't allocate memory");
+        goto finish;
+    }
+
+    for (size_t i_vma = 0; i_vma < mm->n_vmas; i_vma++)
+        (*layout)[i_vma] = (LayoutItem) {mm->vmas[i_vma]->end - mm->vmas[i_vma]->start, mm->vmas[i_vma]->prot};
+    *n_layout = mm->n_vmas;
+    res = 0;
+
+    // criu saves build-id of files (one byte in uint32), if it can. Otherwise binary is read, if it's still here.
+    build_id[0] = '\0';
+    if (ReadAllMessages (path, "files", 0, (MessageUnpacker*) file_entry__unpack, arena,
+                         (ProtobufCMessage***) &files, &n_files, MY_FILES_MAGIC))
+        goto finish;
+
+    for (size_t i_file = 0; i_file < n_files; i_file++)
+    {
+        RegFileEntry* reg = files[i_file]->reg;
+        if (files[i_file]->id != mm->exe_file_id || !reg)
+            continue;
+
+        for (size_t i_byte = 0; i_byte < reg->n_build_id && i_byte < BUILD_ID_MAX_SIZE; i_byte++)
+            sprintf (build_id + 2 * i_byte, "%02x", reg->build_id[i_byte] & 0xFF);
+
+        if (!build_id[0] && reg->name)
+            GetFileBuildId (reg->name, build_id);
+        break;
+    }
+
+finish:
+    free (files);
+    free (entries);
+    ArenaDestructor (arena);
+    return res;
+}
+
+int GetCoreLayout (Elf* elf, LayoutItem** layout, size_t* n_layout, char* build_id)
+{
+    assert (elf);
+    assert (layout);
+    assert (n_layout);
+    assert (build_id);
+
+    *layout = (LayoutItem*) calloc (elf->phnum + 1, sizeof (**layout));
+    if (!*layout)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    *n_layout = 0;
+    for (Elf_Half i_phdr = 0; i_phdr < elf->phnum; i_phdr++)
+        if (elf->phdr_table[i_phdr].p_type == PT_LOAD)
+            (*layout)[(*n_layout)++] = (LayoutItem) {elf->phdr_table[i_phdr].p_memsz, GetVmaProtByPhdr (elf->phdr_table[i_phdr].p_flags)};
+
+    if (GetCoreBuildId (elf, build_id))
+        build_id[0] = '\0';
+    return 0;
+}
+
+// Pointer to memory of dead process, NULL if these bytes aren't in coredump
+const char* GetCoreMemory (Elf* elf, uint64_t vaddr, size_t size)
+{
+    assert (elf);
+
+    // Stream has only headers and notes in buffer
+    if (elf->is_stream)
+        return NULL;
+
+    for (Elf_Half i_phdr = 0; i_phdr < elf->phnum; i_phdr++)
+    {
+        Elf_Phdr* phdr = elf->phdr_table + i_phdr;
+
+        if (phdr->p_type == PT_LOAD && vaddr >= phdr->p_vaddr && vaddr - phdr->p_vaddr <= phdr->p_filesz &&
+            phdr->p_filesz - (vaddr - phdr->p_vaddr) >= size)
+            return elf->buf + phdr->p_offset + (vaddr - phdr->p_vaddr);
+    }
+
+    return NULL;
+}
+
+// Build-id of main binary: from its notes in memory (kernel dumps first page of ELF files), or from file in NT_FILE.
+int GetCoreBuildId (Elf* elf, char* build_id)
+{
+    assert (elf);
+    assert (build_id);
+
+    Elf_Nhdr* auxv_note = elf->notes.process[NOTE_AUXV];
+    if (!auxv_note)
+        return -1;
+
+    Elf_auxv_t* auxv = (Elf_auxv_t*) GetNoteDesc (auxv_note);
+    uint64_t at_phdr = 0, at_phnum = 0;
+
+    for (size_t i_aux = 0; i_aux < auxv_note->n_descsz / sizeof (*auxv) && auxv[i_aux].a_type != AT_NULL; i_aux++)
+    {
+        if (auxv[i_aux].a_type == AT_PHDR)
+            at_phdr = auxv[i_aux].a_un.a_val;
+        if (auxv[i_aux].a_type == AT_PHNUM)
+            at_phnum = auxv[i_aux].a_un.a_val;
+    }
+
+    const Elf_Phdr* phdrs = (const Elf_Phdr*) GetCoreMemory (elf, at_phdr, at_phnum * sizeof (Elf_Phdr));
+    if (phdrs)
+    {
+        uint64_t load_bias = 0; // non-PIE binaries haven't PT_PHDR and bias
+        for (size_t i_phdr = 0; i_phdr < at_phnum; i_phdr++)
+            if (phdrs[i_phdr].p_type == PT_PHDR)
+                load_bias = at_phdr - phdrs[i_phdr].p_vaddr;
+
+        for (size_t i_phdr = 0; i_phdr < at_phnum; i_phdr++)
+        {
+            if (phdrs[i_phdr].p_type != PT_NOTE)
+                continue;
+
+            const char* notes = GetCoreMemory (elf, phdrs[i_phdr].p_vaddr + load_bias, phdrs[i_phdr].p_filesz);
+            if (notes && FindBuildIdInNotes (notes, phdrs[i_phdr].p_filesz, build_id) == 0)
+                return 0;
+        }
+    }
+
+    long i_file = FileTableFind (&elf->notes.files, at_phdr);
+    return (i_file == -1) ? -1 : GetFileBuildId (elf->notes.files.names[i_file], build_id);
+}
+
+static int GetNewPid (ProcessTree* tree, int donor_pid)
+{
+    for (size_t i_entry = 0; i_entry < tree->n_entries; i_entry++)
+        if (tree->donor_pids[i_entry] == donor_pid)
+            return (int) tree->entries[i_entry]->pid;
+
+    return donor_pid;
+}
+
+static int WriteProcessJob (void* ctx, size_t i_task)
+{
+    ProcessTree* tree = (ProcessTree*) ctx;
+    uint64_t start = StatsNow();
+    int res = ImagesWrite (tree->processes[i_task].imgs, tree->args);
+    StatsPhaseEnd (PHASE_WRITE, start);
+    return res;
+}
+
+int ProcessTreeWrite (ProcessTree* tree)
+{
+    assert (tree);
+    const char* path = tree->args->criu_dump_path;
+
+    for (size_t i_entry = 0; i_entry < tree->n_entries; i_entry++)
+        for (size_t i_other = 0; i_other < i_entry; i_other++)
+            if (tree->entries[i_entry]->pid == tree->entries[i_other]->pid)
+            {
+                fprintf (stderr, "Error: Two processes have pid %d after converting, images aren't written.\n",
+                                 tree->entries[i_entry]->pid);
+                return -1;
+            }
+
+    // Relations are given from donor, so ppid is changed for processes without coredumps too
+    for (size_t i_entry = 0; i_entry < tree->n_entries; i_entry++)
+    {
+        PstreeEntry* entry = tree->entries[i_entry];
+        entry->ppid = GetNewPid (tree, entry->ppid);
+
+        int has_coredump = 0;
+        for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+            has_coredump |= (tree->processes[i_process].donor == entry);
+
+        // Group and session of dead process are taken from coredump
+        if (!has_coredump)
+        {
+            entry->pgid = GetNewPid (tree, entry->pgid);
+            entry->sid  = GetNewPid (tree, entry->sid);
+        }
+    }
+
+    if (RunJobs (GetOuterJobs (tree->args->n_jobs, tree->n_processes), tree->n_processes, WriteProcessJob, tree))
+    {
+        fprintf (stderr, "Error: Can't write images of processes.\n");
+        return -1;
+    }
+
+    // In my images I found 2 files, that need to be renamed: fs and ids. core and mm are written with new pid.
+    // New pid of one process can be old pid of another, so images are renamed through temporary names.
+    // ToDo: find all files in documentation.
+    static const char* const RENAMED_IMAGES[] = {"fs", "ids", "pagemap"};
+    const size_t N_RENAMED_IMAGES = sizeof (RENAMED_IMAGES) / sizeof (*RENAMED_IMAGES);
+    // Tree with half of renamed images can't be restored, so pstree isn't written after failure.
+    char tmp_name[MAX_PATH_LEN] = "";
+    int res = 0;
+
+    for (size_t i_name = 0; i_name < N_RENAMED_IMAGES && !res; i_name++)
+    {
+        snprintf (tmp_name, MAX_PATH_LEN, "%s.necromancer", RENAMED_IMAGES[i_name]);
+
+        for (size_t i_process = 0; i_process < tree->n_processes && !res; i_process++)
+        {
+            Images* imgs = tree->processes[i_process].imgs;
+            if (imgs->donor_pid != (int) imgs->pstree->pid)
+                res = MoveImage (path, RENAMED_IMAGES[i_name], imgs->donor_pid, tmp_name, imgs->donor_pid);
+        }
+
+        for (size_t i_process = 0; i_process < tree->n_processes && !res; i_process++)
+        {
+            Images* imgs = tree->processes[i_process].imgs;
+            if (imgs->donor_pid != (int) imgs->pstree->pid)
+                res = MoveImage (path, tmp_name, imgs->donor_pid, RENAMED_IMAGES[i_name], imgs->pstree->pid);
+        }
+    }
+
+    if (res)
+    {
+        fprintf (stderr, "Error: Images aren't renamed to new pids, pstree isn't written.\n");
+        return -1;
+    }
+
+    char* pstree_filename = CreateImagePath (path, "pstree");
+    ImageWriter* pstree_writer = pstree_filename ? ImageWriterOpen (pstree_filename, MY_PSTREE_MAGIC) : NULL;
+    free (pstree_filename);
+    if (!pstree_writer)
+        return -1;
+
+    for (size_t i_entry = 0; i_entry < tree->n_entries; i_entry++)
+        ImageWriterMessage (pstree_writer, (MessagePacker*) pstree_entry__pack, tree->entries[i_entry],
+                            pstree_entry__get_packed_size (tree->entries[i_entry]));
+
+    if (ImageWriterClose (pstree_writer))
+    {
+        fprintf (stderr, "Error: Can't write pstree image.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void ProcessTreeDestructor (ProcessTree* tree)
+{
+    if (!tree)
+        return;
+
+    for (size_t i_process = 0; i_process < tree->n_processes; i_process++)
+    {
+        ImagesDestructor (tree->processes[i_process].imgs);
+        ElfDestructor (tree->processes[i_process].elf);
+    }
+
+    free (tree->processes);
+    free (tree->donor_pids);
+    free (tree->entries);
+    ArenaDestructor (tree->arena);
+    free (tree);
+    return;
+}
+
+// Path of new pages-<id>.img, with --parent it's temporary until donor's pages are moved
+static void GetNewPagesPath (char* buffer, const Images* imgs)
+{
+    snprintf (buffer, MAX_PATH_LEN, imgs->donor_pagemap ? "%s/pages-%u.img.necromancer" : "%s/pages-%u.img",
+              imgs->images_path, imgs->pages_id);
+    return;
+}
+
+Images* ImagesConstructor (ArgInfo* args, PstreeEntry* pstree, size_t n_jobs)
+{
+    assert (args);
+    assert (pstree);
+
+    Images* imgs = (Images*) calloc (1, sizeof (*imgs)); 
+    if (imgs == NULL)                                   
+    {                                                     
+        perror ("Can't create images");
+        return NULL;                                      
+    }
+    imgs->pages_fd = imgs->pages_direct_fd = -1;
+    imgs->plan.n_jobs = n_jobs;
+    imgs->plan.file_pages = args->file_pages;
+    imgs->plan.lazy = args->lazy_pages;
+    imgs->plan.uring = args->uring;
+    imgs->pstree = pstree;
+    imgs->donor_pid = pstree->pid;
+    imgs->images_path = args->criu_dump_path;
+
+    imgs->arena = ArenaConstructor();
+    if (imgs->arena == NULL)
+    {
+        ImagesDestructor (imgs);
+        return NULL;
+    }
+
+    #define check_retval(retval) if ((retval))                                             \
+                                    {                                                      \
+                                        fprintf (stderr, "Error: Can't create images.\n"); \
+                                        ImagesDestructor (imgs);                           \
+                                        return NULL;                                       \
+                                    }
+
+    check_retval (ReadOnlyOneMessage (args->criu_dump_path, "core", imgs->donor_pid, (MessageUnpacker*) core_entry__unpack,
+                                      imgs->arena, (ProtobufCMessage**) &(imgs->core), MY_CORE_MAGIC) == -1);
+    check_retval (ReadOnlyOneMessage (args->criu_dump_path, "mm",   imgs->donor_pid, (MessageUnpacker*) mm_entry__unpack,
+                                      imgs->arena, (ProtobufCMessage**) &(imgs->mm),   MY_MM_MAGIC)   == -1);
+    
+    check_retval (CreateThreadTemplate (imgs, args));
+
+    // Names of mapped files are needed for matching of VMAs, without them files are restored as anonymous memory
+    if (ReadAllMessages (args->criu_dump_path, "files", 0, (MessageUnpacker*) file_entry__unpack, imgs->arena,
+                         (ProtobufCMessage***) &imgs->files, &imgs->n_files, MY_FILES_MAGIC))
+        fprintf (stderr, "Warning: Can't read files image, mappings of files will be anonymous.\n");
+
+    // Every process has its own pages-<id>.img, id is taken from head of donor's pagemap, so pages of other processes are untouched.
+    PagemapHead* donor_head = NULL;
+    if (args->parent && !args->check)
+    {
+        check_retval (ReadPagemap (args->criu_dump_path, imgs->donor_pid, imgs->arena, &donor_head,
+                                   &imgs->donor_pagemap, &imgs->n_donor_pagemap));
+
+        if (PrepareParentDirectory (args->criu_dump_path, donor_head->pages_id))
+        {
+            fprintf (stderr, "Warning: Images of process %d are written without parent.\n", imgs->donor_pid);
+            free (imgs->donor_pagemap);
+            imgs->donor_pagemap = NULL;
+            imgs->n_donor_pagemap = 0;
+        }
+    }
+    else
+        check_retval (ReadOnlyOneMessage (args->criu_dump_path, "pagemap", imgs->donor_pid, (MessageUnpacker*) pagemap_head__unpack,
+                                          imgs->arena, (ProtobufCMessage**) &donor_head, MY_PAGEMAP_MAGIC) == -1);
+    imgs->pages_id = donor_head->pages_id;
+
+    // --check: images are only read
+    if (args->check)
+        return imgs;
+
+    // Start pagemap:
+    char* pagemap_filename = CreateImagePathWithPid (args->criu_dump_path, "pagemap", imgs->donor_pid);
+    check_retval (pagemap_filename == NULL)
+    check_retval ((imgs->pagemap = ImageWriterOpen (pagemap_filename, MY_PAGEMAP_MAGIC)) == NULL)
+    free (pagemap_filename);
+    
+    PagemapHead head = PAGEMAP_HEAD__INIT;
+    head.pages_id = imgs->pages_id;
+    ImageWriterMessage (imgs->pagemap, (MessagePacker*) pagemap_head__pack, &head, pagemap_head__get_packed_size (&head));
+
+    // It's raw data, there is no protobuf messages. With store it's written by materializing only.
+    // With --parent donor's pages are still needed, new ones are written beside them and replace them in ImagesWrite.
+    char pages_filename[MAX_PATH_LEN] = "";
+    GetNewPagesPath (pages_filename, imgs);
+    if (page_store)
+        unlink (pages_filename);
+    else
+        imgs->pages_fd = RecreateFile (pages_filename);
+    if (args->direct && imgs->pages_fd != -1)
+        imgs->pages_direct_fd = OpenDirect (pages_filename);
+    check_retval (!page_store && imgs->pages_fd == -1)
+
+    #undef check_retval
+    return imgs;
+}
+
+int MoveImage (const char* path, const char* old_name, int old_pid, const char* new_name, int new_pid)
+{
+    assert (path);
+    assert (old_name);
+    assert (new_name);
+    assert (old_pid);
+    assert (new_pid);
+
+    char* old_filename = CreateImagePathWithPid (path, old_name, old_pid);
+    char* new_filename = CreateImagePathWithPid (path, new_name, new_pid);
+    int res = -1;
+
+    if (!old_filename || !new_filename)
+        ;
+    else if (rename (old_filename, new_filename))
+        fprintf (stderr, "Error: Can't rename %s to %s : %s.\n", old_filename, new_filename, strerror (errno));
+    else
+        res = 0;
+
+    free (old_filename);
+    free (new_filename);
+    return res;
+}
+
+int ChangeImagePid (const char* path, const char* name, int old_pid, int new_pid)
+{
+    return MoveImage (path, name, old_pid, name, new_pid);
+}
+
+static int WriteThreadCoreJob (void* ctx, size_t i_task)
+{
+    Images* imgs = (Images*) ctx;
+    CoreEntry* core = imgs->thread_cores[i_task] ? imgs->thread_cores[i_task] : imgs->core;
+
+    // Main thread could get new pid from args
+    uint32_t tid = (core == imgs->core) ? imgs->pstree->pid : imgs->notes->threads[i_task].tid;
+    return WriteOnlyOneMessage (imgs->images_path, "core", tid, (MessagePacker*) core_entry__pack, core,
+                                core_entry__get_packed_size (core), MY_CORE_MAGIC);
+}
+
+// --parent: donor's pages go to parent only when new images are complete, otherwise donor's images keep them
+static void ReplaceDonorPages (Images* imgs, const char* path, int is_failed)
+{
+    char new_filename[MAX_PATH_LEN] = "";
+    GetNewPagesPath (new_filename, imgs);
+    char* filename = CreateImagePathWithPid (path, "pages", imgs->pages_id);
+
+    if (is_failed || !filename || MoveDonorPagesToParent (path, imgs->pages_id))
+    {
+        fprintf (stderr, "Error: Images of process %d aren't complete, donor's pages are kept.\n", imgs->pstree->pid);
+        unlink (new_filename);
+    }
+    else if (!page_store && rename (new_filename, filename))
+        fprintf (stderr, "Error: Can't rename %s : %s.\n", new_filename, strerror (errno));
+
+    free (filename);
+    return;
+}
+
+// pstree is written by ProcessTreeWrite, images with old pid are renamed there too
+int ImagesWrite (Images* imgs, ArgInfo* args)
+{
+    assert (imgs);
+    assert (args);
+    assert (args->criu_dump_path);
+    assert (imgs->pstree);
+    assert (imgs->core);
+    assert (imgs->mm);
+
+    int res = 0;
+    if (!imgs->thread_cores)
+        res = WriteOnlyOneMessage (args->criu_dump_path, "core", imgs->pstree->pid, (MessagePacker*) core_entry__pack, imgs->core,
+                                   core_entry__get_packed_size (imgs->core), MY_CORE_MAGIC);
+    else
+    {
+        imgs->images_path = args->criu_dump_path;
+        if ((res = RunJobs (imgs->plan.n_jobs ? imgs->plan.n_jobs : 1, imgs->notes->n_threads, WriteThreadCoreJob, imgs)))
+            fprintf (stderr, "Error: Can't write cores of threads.\n");
+    }
+
+    if (WriteOnlyOneMessage (args->criu_dump_path, "mm",   imgs->pstree->pid, (MessagePacker*) mm_entry__pack,     imgs->mm, 
+                             mm_entry__get_packed_size     (imgs->mm),     MY_MM_MAGIC))
+        res = -1;
+
+    if (ImageWriterClose (imgs->pagemap))
+    {
+        fprintf (stderr, "Error: Can't write pagemap image.\n");
+        res = -1;
+    }
+    imgs->pagemap = NULL; // ToDo: OK???
+
+    // Manifest of failed conversion isn't written, its pages are released
+    if (page_store && res == 0 && WriteManifest (imgs, args->criu_dump_path))
+    {
+        fprintf (stderr, "Error: Can't write manifest of pages image.\n");
+        res = -1;
+    }
+    imgs->is_manifest_written = (page_store && res == 0);
+
+    // Parent's pagemap is named by the final pid, it isn't renamed by ProcessTreeWrite
+    if (imgs->plan.parent && ParentPagesWrite (imgs->plan.parent, args->criu_dump_path, imgs->pstree->pid, imgs->pages_id))
+    {
+        fprintf (stderr, "Error: Can't write pagemap of parent images.\n");
+        res = -1;
+    }
+
+    if (imgs->donor_pagemap)
+        ReplaceDonorPages (imgs, args->criu_dump_path, res || imgs->pages_failed);
+    return res ? -1 : 0;
+}
+
+void ChangeProcessPid (Images* imgs, int pid)
+{
+    assert (imgs);
+    assert (imgs->pstree);
+
+    for (size_t i_thread = 0; i_thread < imgs->pstree->n_threads; i_thread++)
+        if (imgs->pstree->threads[i_thread] == imgs->pstree->pid)
+            imgs->pstree->threads[i_thread] = pid;
+
+    // Leader of group or session is leader after changing too
+    if (imgs->pstree->pgid == imgs->pstree->pid)
+        imgs->pstree->pgid = pid;
+    if (imgs->pstree->sid == imgs->pstree->pid)
+        imgs->pstree->sid = pid;
+
+    imgs->pstree->pid = pid;
+    return;
+}
+
+void ImagesDestructor (Images* imgs)
+{
+    if (!imgs)
+        return;
+
+    // pstree, core and mm are freed with arena
+    ArenaDestructor (imgs->arena);
+
+    ImageWriterClose (imgs->pagemap);
+    if (imgs->pages_fd != -1) close (imgs->pages_fd);
+    if (imgs->pages_direct_fd != -1) close (imgs->pages_direct_fd);
+
+    // --parent: images weren't written, so new pages are left in temporary file
+    if (imgs->donor_pagemap && imgs->images_path)
+    {
+        char new_filename[MAX_PATH_LEN] = "";
+        GetNewPagesPath (new_filename, imgs);
+        unlink (new_filename);
+    }
+    PagesPlanFree (&imgs->plan);
+    free (imgs->files);
+    free (imgs->donor_pagemap);
+
+    // Pages of images without manifest are never materialized or released by -R, they would be leaked in store
+    size_t n_keys = imgs->pages_size / page_size;
+    if (page_store && imgs->store_keys && !imgs->is_manifest_written &&
+        PageStoreReleaseKeys (page_store, imgs->store_keys, (n_keys < imgs->store_keys_capacity) ? n_keys : imgs->store_keys_capacity))
+        fprintf (stderr, "Error: Pages of process %d aren't released in store.\n", imgs->donor_pid);
+    free (imgs->store_keys);
+
+    *imgs = EMPTY_IMAGES;
+    free (imgs);
+    return;
+}
+
+Elf* ElfConstructor (const char* filename, size_t n_jobs)
+{
+    assert (filename);
+    Elf* elf_result = (Elf*) calloc (1, sizeof (*elf_result)); // calloc <==> all pointers are NULL 
+    elf_result->fd = -1;
+
+    #define check_pointer(name) if (elf_result->name == NULL)   \
+                                {                               \
+                                    ElfDestructor (elf_result); \
+                                    return NULL;                \
+                                }
+
+    if (strcmp (filename, "-") == 0)
+    {
+        free (elf_result);
+        return ElfStreamConstructor (STDIN_FILENO, n_jobs);
+    }
+
+    elf_result->buf = MapFile (filename, &elf_result->size, &elf_result->fd);
+    if (elf_result->buf == NULL && elf_result->fd != -1)
+    {
+        // It isn't regular file (FIFO from core_pattern, for example), reading it as stream
+        int fd = elf_result->fd;
+        free (elf_result);
+        return ElfStreamConstructor (fd, n_jobs);
+    }
+    check_pointer (buf);    
+
+    if (DetectCodec (elf_result->buf, elf_result->size) != CODEC_NONE)
+    {
+        // Compressed file can be read only by decompressor
+        int fd = elf_result->fd;
+        UnmapFile (elf_result->buf, elf_result->size, -1);
+        free (elf_result);
+        return ElfStreamConstructor (fd, n_jobs);
+    }
+
+    elf_result->elf_hdr = CheckElfHdr (elf_result->buf, elf_result->size);
+    check_pointer (elf_hdr);
+
+    elf_result->phdr_table = CheckPhdrs (elf_result);
+    check_pointer (phdr_table);
+
+    if (NoteIndexBuild (elf_result))
+    {
+        ElfDestructor (elf_result);
+        return NULL;
+    }
+
+    #undef check_pointer
+    return elf_result;
+}
+
+Elf* ElfStreamConstructor (int fd, size_t n_jobs)
+{
+    Elf* elf_result = (Elf*) calloc (1, sizeof (*elf_result));
+    if (!elf_result)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
+    }
+
+    elf_result->fd = fd;
+    elf_result->is_stream = 1;
+
+    #define check_correct(cond, ...) if ((cond))                         \
+                                     {                                   \
+                                         fprintf (stderr, __VA_ARGS__);  \
+                                         ElfDestructor (elf_result);     \
+                                         return NULL;                    \
+                                     }
+    
+    check_correct (ElfStreamReadUpTo (elf_result, CODEC_MAGIC_SIZE), "Error: Can't read coredump.\n")
+    Codec codec = DetectCodec (elf_result->buf, elf_result->size);
+
+    if (codec != CODEC_NONE)
+    {
+        // Magic bytes are given to decompressor, if they can't be read again
+        size_t prefix_size = (lseek (fd, 0, SEEK_SET) == 0) ? 0 : elf_result->size;
+        elf_result->decompressor = StartDecompression (fd, codec, elf_result->buf, prefix_size, n_jobs, &elf_result->fd);
+        check_correct (elf_result->decompressor == NULL, "Error: Can't decompress coredump.\n")
+        elf_result->size = elf_result->stream_pos = 0;
+    }
+
+    // Reading only headers: ELF header, phdrs and notes. Kernel writes them before page data.
+    check_correct (ElfStreamReadUpTo (elf_result, sizeof (Elf_Ehdr)), "Error: Can't read ELF header.\n")
+    Elf_Ehdr* elf_hdr = (Elf_Ehdr*) elf_result->buf;
+    check_correct (elf_hdr->e_phentsize != sizeof (Elf_Phdr), "Error: Bad size of program header.\n")
+
+    size_t headers_end = elf_hdr->e_phoff + (size_t) elf_hdr->e_phnum * sizeof (Elf_Phdr);
+    check_correct (ElfStreamReadUpTo (elf_result, headers_end), "Error: Can't read program headers.\n")
+
+    elf_result->elf_hdr = CheckElfHdr (elf_result->buf, elf_result->size);
+    check_correct (elf_result->elf_hdr == NULL, "Error: Bad ELF header.\n")
+
+    Elf_Phdr* phdrs = (Elf_Phdr*) (elf_result->buf + elf_result->elf_hdr->e_phoff);
+    size_t notes_end = 0, data_start = SIZE_MAX;
+
+    for (Elf_Half i_phdr = 0; i_phdr < elf_result->elf_hdr->e_phnum; i_phdr++)
+    {
+        if (phdrs[i_phdr].p_type == PT_NOTE && phdrs[i_phdr].p_offset + phdrs[i_phdr].p_filesz > notes_end)
+            notes_end = phdrs[i_phdr].p_offset + phdrs[i_phdr].p_filesz;
+        if (phdrs[i_phdr].p_type == PT_LOAD && phdrs[i_phdr].p_filesz && phdrs[i_phdr].p_offset < data_start)
+            data_start = phdrs[i_phdr].p_offset;
+    }
+
+    check_correct (notes_end > data_start, "Error: Notes are placed after page data, coredump can't be read as stream.\n")
+    check_correct (ElfStreamReadUpTo (elf_result, notes_end), "Error: Can't read notes.\n")
+
+    // buf was reallocated, pointers are given again
+    elf_result->elf_hdr = (Elf_Ehdr*) elf_result->buf;
+    elf_result->phdr_table = CheckPhdrs (elf_result);
+    check_correct (elf_result->phdr_table == NULL, "Error: Bad program headers.\n")
+    check_correct (NoteIndexBuild (elf_result), "Error: Bad notes.\n")
+
+    #undef check_correct
+    return elf_result;
+}
+
+int ElfStreamReadUpTo (Elf* elf, size_t new_size)
+{
+    assert (elf);
+    assert (elf->is_stream);
+
+    if (new_size <= elf->size)
+        return 0;
+
+    if (new_size > MAX_STREAM_HEADERS_SIZE)
+    {
+        fprintf (stderr, "Error: Too big headers in coredump.\n");
+        return -1;
+    }
+
+    char* new_buf = (char*) realloc (elf->buf, new_size);
+    if (!new_buf)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    elf->buf = new_buf;
+    if (ReadFull (elf->fd, elf->buf + elf->size, new_size - elf->size))
+        return -1;
+
+    elf->size = elf->stream_pos = new_size;
+    return 0;
+}
+
+void ElfDestructor (Elf* elf)
+{
+    if (elf)
+    {
+        NoteIndexFree (&elf->notes);
+        if (elf->is_stream)
+        {
+            free (elf->buf);
+            if (elf->fd != STDIN_FILENO)
+                close (elf->fd);
+            if (FinishDecompression (elf->decompressor))
+                fprintf (stderr, "Error: Decompression of coredump failed.\n");
+        }
+        else
+            UnmapFile (elf->buf, elf->size, elf->fd);
+
+        free (elf);
+    }
+
+    return;
+}
+
+Elf_Ehdr* CheckElfHdr (const char* buf, size_t size)
+{
+    assert (buf);
+    Elf_Ehdr* elf_hdr = (Elf_Ehdr*) buf;
+
+    #define check(condition, error_type) if (!(condition))                                 \
+                                         {                                                 \
+                                             fprintf (stderr, "Error: " error_type ".\n"); \
+                                             return NULL;                                  \
+                                         }
+
+    check (size >= sizeof (*elf_hdr), "File is too small for ELF header");
+
+    // ToDo: or check (strncmp (elf_hdr->e_ident, ELFMAG) == 0)?
+    check (elf_hdr->e_ident[0] == ELFMAG0, "Bad magic number byte 0");
     check (elf_hdr->e_ident[1] == ELFMAG1, "Bad magic number byte 1");
     check (elf_hdr->e_ident[2] == ELFMAG2, "Bad magic number byte 2");
     check (elf_hdr->e_ident[3] == ELFMAG3, "Bad magic number byte 3");
     check (elf_hdr->e_ident[4] == ELFCLASS32 || elf_hdr->e_ident[4] == ELFCLASS64, "Bad object class");
     check (elf_hdr->e_ident[6] == EV_CURRENT, "Bad file version in e_ident")
 
-    check (elf_hdr->e_type == ET_CORE, "This program need core elf file"); // WARNING: only for my task
-    check (elf_hdr->e_machine != EM_NONE, "Bad machine");
-    check (elf_hdr->e_version == EV_CURRENT, "Bad file version in e_version");
+    check (elf_hdr->e_type == ET_CORE, "This program need core elf file"); // WARNING: only for my task
+    check (elf_hdr->e_machine != EM_NONE, "Bad machine");
+    check (elf_hdr->e_version == EV_CURRENT, "Bad file version in e_version");
+    check (elf_hdr->e_phentsize == sizeof (Elf_Phdr), "Bad size of program header");
+    check (elf_hdr->e_phoff <= size && (size - elf_hdr->e_phoff) / sizeof (Elf_Phdr) >= elf_hdr->e_phnum,
+           "Program headers table is out of file");
+
+    #undef check
+    return elf_hdr;
+}
+
+Elf_Phdr* CheckPhdrs (Elf* elf)
+{
+    assert (elf);
+    assert (elf->buf);
+    assert (elf->elf_hdr);
+
+    elf->phnum = elf->elf_hdr->e_phnum;
+    elf->phdr_table = (Elf_Phdr*) (elf->buf + elf->elf_hdr->e_phoff);
+
+    for (Elf_Half i_phdr = 0; i_phdr < elf->phnum; i_phdr++)
+    {
+        Elf_Phdr* phdr = elf->phdr_table + i_phdr;
+
+        if (phdr->p_type == PT_LOAD && phdr->p_filesz > phdr->p_memsz)
+        {
+            fprintf (stderr, "Error: Bad program header number %d:\n"
+                             "p_memsz  = 0x%lX\n" 
+                             "p_filesz = 0x%lX\n"
+                             "p_memsz < p_filesz\n", 
+                             i_phdr, phdr->p_memsz, phdr->p_filesz);
+            elf->phdr_table = NULL;
+            elf->phnum = 0;
+            break;
+        }
+
+        // Data is read from mapping, so access out of file is SIGBUS, not error.
+        // Stream has only notes in buffer, page data is checked during reading.
+        if ((phdr->p_type == PT_NOTE || (phdr->p_type == PT_LOAD && !elf->is_stream)) && 
+            (phdr->p_offset > elf->size || elf->size - phdr->p_offset < phdr->p_filesz))
+        {
+            fprintf (stderr, "Error: Program header number %d is out of file. Is coredump truncated?\n", i_phdr);
+            elf->phdr_table = NULL;
+            elf->phnum = 0;
+            break;
+        }
+
+        if (phdr->p_type == PT_NOTE && !elf->is_stream)
+            AdviseMapping (elf->buf, phdr->p_offset, phdr->p_filesz, MADV_WILLNEED);
+    }
+
+    return elf->phdr_table;
+}
+
+// Value of auxv as array of pairs {type, value}, 0 if it's absent
+static uint64_t FindAuxv (const uint64_t* auxv, size_t n_words, uint64_t type)
+{
+    for (size_t i_word = 0; auxv && i_word + 1 < n_words && auxv[i_word] != AT_NULL; i_word += 2)
+        if (auxv[i_word] == type)
+            return auxv[i_word + 1];
+
+    return 0;
+}
+
+// Page size of coredump is given by NT_FILE (or AT_PAGESZ), donor's one by its saved auxv: pages can't be recut,
+// so both of them must be page size of this kernel. Donor's auxv is read before GoAuxv replaces it.
+static int CheckPageSize (const Elf* elf, const Images* imgs)
+{
+    const NoteIndex* notes = &elf->notes;
+    uint64_t core_page_size = notes->files.page_size;
+    if (!core_page_size && notes->process[NOTE_AUXV])
+        core_page_size = FindAuxv ((const uint64_t*) GetNoteDesc (notes->process[NOTE_AUXV]),
+                                   notes->process[NOTE_AUXV]->n_descsz / sizeof (uint64_t), AT_PAGESZ);
+
+    uint64_t donor_page_size = FindAuxv (imgs->mm->mm_saved_auxv, imgs->mm->n_mm_saved_auxv, AT_PAGESZ);
+
+    if (core_page_size && core_page_size != page_size)
+    {
+        fprintf (stderr, "Error: Coredump has pages of %" PRIu64 " bytes, but pages of this kernel are %zu bytes.\n", core_page_size, page_size);
+        return -1;
+    }
+    if (donor_page_size && donor_page_size != page_size)
+    {
+        fprintf (stderr, "Error: Donor has pages of %" PRIu64 " bytes, but pages of this kernel are %zu bytes.\n", donor_page_size, page_size);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Notes, VMAs and registers are converted, PT_LOADs are collected to plan, but page data isn't read.
+// Returns -1, if pages can't be written, -2, if page size of coredump or donor differs, 1, if only registers of threads aren't converted.
+int PlanPhdrs (Elf* elf, Images* imgs)
+{
+    assert (elf);
+    size_t vma_counter = 0;
+    int res = 0;
+    uint64_t start = StatsNow();
+
+    if (CheckPageSize (elf, imgs))
+        return -2;
+
+    GoNotes (elf, imgs);
+    if (MatchVmas (elf, imgs))
+    {
+        fprintf (stderr, "Error: Can't match VMAs of donor and coredump.\n");
+        return -1;
+    }
+
+    if (ConvertThreads (imgs))
+    {
+        fprintf (stderr, "Error: Can't convert registers of threads.\n");
+        res = 1;
+    }
+
+    StatsPhaseEnd (PHASE_NOTES, start);
+    start = StatsNow();
+
+    // Lazy pages are given from mapping of coredump, stream isn't kept after converting
+    if (imgs->plan.lazy && elf->is_stream)
+    {
+        fprintf (stderr, "Warning: Coredump is read as stream, all its pages are written to images without --lazy-pages.\n");
+        imgs->plan.lazy = 0;
+    }
+
+    for (size_t i_phdr = 0; i_phdr < elf->phnum; i_phdr++)
+    {
+        switch (elf->phdr_table[i_phdr].p_type)
+        {
+            case PT_NOTE:
+                break; // notes are indexed in ElfConstructor and converted in GoNotes
+
+            case PT_LOAD:
+                if (GoLoadPhdr (elf, elf->phdr_table + i_phdr, imgs, vma_counter))
+                    return -1;
+                vma_counter++;
+                break;
+
+            case PT_NULL:
+                break; // ?
+
+            default:
+                fprintf (stderr, "Warning: I don't know, how to parse program header No %lu.\n", i_phdr);
+                break;
+        }
+    }
+
+    StatsPhaseEnd (PHASE_PAGES, start);
+    return res;
+}
+
+// Images of process aren't written after failure: registers of threads are needed as well as pages
+int GoPhdrs (Elf* elf, Images* imgs)
+{
+    assert (elf);
+
+    if (PlanPhdrs (elf, imgs))
+    {
+        imgs->pages_failed = 1;
+        return -1;
+    }
+
+    uint64_t start = StatsNow();
+    if (imgs->donor_pagemap && (imgs->plan.parent = ParentPagesConstructor (imgs)) == NULL)
+        fprintf (stderr, "Warning: Pages are written without parent images.\n");
+
+    if (PagesPlanExecute (&imgs->plan, elf, imgs))
+    {
+        fprintf (stderr, "Error: Can't write pages of coredump.\n");
+        imgs->pages_failed = 1;
+    }
+
+    StatsPhaseEnd (PHASE_PAGES, start);
+    return imgs->pages_failed ? -1 : 0;
+}
+
+ThreadNotes* AddThread (NoteIndex* notes, Elf_Nhdr* prstatus)
+{
+    assert (notes);
+    assert (prstatus);
+
+    if (prstatus->n_descsz < sizeof (prstatus_t))
+    {
+        fprintf (stderr, "Warning: NT_PRSTATUS is too small, thread is skipped.\n");
+        return NULL;
+    }
+
+    if (notes->n_threads == notes->threads_capacity)
+    {
+        size_t new_capacity = notes->threads_capacity ? 2 * notes->threads_capacity : 16;
+        ThreadNotes* new_threads = (ThreadNotes*) realloc (notes->threads, new_capacity * sizeof (*new_threads));
+        if (!new_threads)
+        {
+            perror ("Can't allocate memory");
+            return NULL;
+        }
+
+        notes->threads = new_threads;
+        notes->threads_capacity = new_capacity;
+    }
+
+    ThreadNotes* thread = notes->threads + notes->n_threads++;
+
+    *thread = (ThreadNotes) {.prstatus = prstatus};
+    thread->tid = ((prstatus_t*) GetNoteDesc (prstatus))->pr_pid;
+    return thread;
+}
+
+int CreateThreadTemplate (Images* imgs, ArgInfo* args)
+{
+    assert (imgs);
+    assert (args);
+
+    // The best template is core of donor's thread, that isn't main
+    CoreEntry* template = NULL;
+    if (imgs->pstree->n_threads > 1)
+    {
+        if (ReadOnlyOneMessage (args->criu_dump_path, "core", imgs->pstree->threads[1], (MessageUnpacker*) core_entry__unpack,
+                                imgs->arena, (ProtobufCMessage**) &template, MY_CORE_MAGIC) == -1)
+            fprintf (stderr, "Warning: Can't read core of donor's thread, main thread is used as template.\n");
+        else
+            imgs->template_is_thread = 1;
+    }
+
+    if (!imgs->template_is_thread)
+        template = imgs->core;
+
+    imgs->thread_template_size = core_entry__get_packed_size (template);
+    imgs->thread_template = (uint8_t*) ArenaAlloc (imgs->arena, imgs->thread_template_size + 1);
+    if (!imgs->thread_template)
+        return -1;
+
+    core_entry__pack (template, imgs->thread_template);
+    return 0;
+}
+
+static int ConvertThreadJob (void* ctx, size_t i_task)
+{
+    Images* imgs = (Images*) ctx;
+    const ThreadNotes* thread = imgs->notes->threads + i_task;
+    CoreEntry* core = imgs->core;
+
+    if (thread->tid != imgs->pstree->pid)
+    {
+        core = core_entry__unpack (&imgs->arena->allocator, imgs->thread_template_size, imgs->thread_template);
+        if (!core)
+        {
+            fprintf (stderr, "Error: Can't create core of thread %u.\n", thread->tid);
+            return -1;
+        }
+
+        if (!imgs->template_is_thread)
+        {
+            // criu keeps task-wide parts only in core of main thread
+            core->tc  = NULL;
+            core->ids = NULL;
+        }
+
+        CredsEntry* main_creds = imgs->core->thread_core ? imgs->core->thread_core->creds : NULL;
+        if (main_creds && core->thread_core && core->thread_core->creds)
+        {
+            core->thread_core->creds->uid = main_creds->uid;
+            core->thread_core->creds->gid = main_creds->gid;
+        }
+    }
+
+    imgs->thread_cores[i_task] = core;
+    GoPrstatus (thread->prstatus, imgs, core);
+    if (thread->fpregset)
+        GoFpregset (thread->fpregset, imgs, core);
+    if (thread->xstate)
+        GoX86_State (thread->xstate, imgs, core);
+
+    return 0;
+}
+
+int ConvertThreads (Images* imgs)
+{
+    assert (imgs);
+    assert (imgs->pstree);
+    assert (imgs->notes);
+
+    const ThreadNotes* threads = imgs->notes->threads;
+    size_t n_threads = imgs->notes->n_threads;
+
+    if (n_threads == 0)
+    {
+        fprintf (stderr, "Warning: There is no NT_PRSTATUS in coredump, registers aren't changed.\n");
+        if (imgs->pstree->n_threads > 0)
+        {
+            imgs->pstree->n_threads = 1;
+            imgs->pstree->threads[0] = imgs->pstree->pid;
+        }
+        return 0;
+    }
+
+    uint32_t* tids = (uint32_t*) ArenaAlloc (imgs->arena, n_threads * sizeof (*tids));
+    imgs->thread_cores = (CoreEntry**) ArenaAlloc (imgs->arena, n_threads * sizeof (*imgs->thread_cores));
+    if (!tids || !imgs->thread_cores)
+        return -1;
+
+    // criu wants main thread (tid == pid) at first place
+    size_t n_tids = 0;
+    for (size_t i_thread = 0; i_thread < n_threads; i_thread++)
+        if (threads[i_thread].tid == imgs->pstree->pid)
+            tids[n_tids++] = threads[i_thread].tid;
+
+    if (n_tids == 0)
+    {
+        fprintf (stderr, "Warning: There is no main thread in coredump, the first thread is used as main.\n");
+        imgs->pstree->pid = threads[0].tid;
+    }
+
+    for (size_t i_thread = 0; i_thread < n_threads; i_thread++)
+        if (threads[i_thread].tid != imgs->pstree->pid || n_tids == 0)
+            tids[n_tids++] = threads[i_thread].tid;
+
+    imgs->pstree->threads = tids;
+    imgs->pstree->n_threads = n_tids;
+
+    return RunJobs (imgs->plan.n_jobs ? imgs->plan.n_jobs : 1, n_threads, ConvertThreadJob, imgs);
+}
+
+int NoteIndexBuild (Elf* elf)
+{
+    assert (elf);
+    NoteIndex* notes = &elf->notes;
+
+    for (Elf_Half i_phdr = 0; i_phdr < elf->phnum; i_phdr++)
+    {
+        Elf_Phdr* phdr = elf->phdr_table + i_phdr;
+        if (phdr->p_type != PT_NOTE)
+            continue;
+
+        for (size_t note_pos = 0; note_pos + sizeof (Elf_Nhdr) <= phdr->p_filesz; )
+        {
+            Elf_Nhdr* nhdr = (Elf_Nhdr*) (elf->buf + phdr->p_offset + note_pos);
+            if (note_pos + GetNoteSize (nhdr) > phdr->p_filesz)
+            {
+                fprintf (stderr, "Warning: Note header with type %u is out of PT_NOTE.\n", nhdr->n_type);
+                break;
+            }
+            note_pos += GetNoteSize (nhdr);
+
+            ProcessNote process_note = N_PROCESS_NOTES;
+            switch (nhdr->n_type)
+            {
+                case NT_PRPSINFO: process_note = NOTE_PRPSINFO; break;
+                case NT_SIGINFO:  process_note = NOTE_SIGINFO;  break;
+                case NT_AUXV:     process_note = NOTE_AUXV;     break;
+                case NT_FILE:     process_note = NOTE_FILE;     break;
+
+                // Notes of threads are converted after all, in parallel
+                case NT_PRSTATUS:
+                    AddThread (notes, nhdr);
+                    continue;
+
+                case NT_FPREGSET:
+                case NT_X86_XSTATE:
+                    if (notes->n_threads == 0)
+                        fprintf (stderr, "Warning: note header with type %u is placed before NT_PRSTATUS.\n", nhdr->n_type);
+                    else if (nhdr->n_type == NT_FPREGSET)
+                        notes->threads[notes->n_threads - 1].fpregset = nhdr;
+                    else
+                        notes->threads[notes->n_threads - 1].xstate = nhdr;
+                    continue;
+
+                default:
+                    // ToDo: Give more debug info
+                    fprintf (stderr, "Warning: I don't know, how to parse note header with type %u.\n"
+                                     "Is it gdb note header?\n", 
+                            nhdr->n_type);
+                    continue;
+            }
+
+            // Process-wide notes are written by kernel only once
+            if (notes->process[process_note])
+                fprintf (stderr, "Warning: Second note header with type %u is skipped.\n", nhdr->n_type);
+            else
+                notes->process[process_note] = nhdr;
+        }
+    }
+
+    if (notes->process[NOTE_FILE] && FileTableBuild (&notes->files, notes->process[NOTE_FILE]))
+        return -1;
+
+    return 0;
+}
+
+void NoteIndexFree (NoteIndex* notes)
+{
+    assert (notes);
+
+    free (notes->threads);
+    free (notes->files.start); // one allocation for all arrays
+    *notes = (NoteIndex) {};
+    return;
+}
+
+int FileTableBuild (FileTable* files, Elf_Nhdr* nhdr)
+{
+    assert (files);
+    assert (nhdr);
+
+    // Header of note is read only after checking of its size
+    file_t* file = (file_t*) GetNoteDesc (nhdr);
+    if (nhdr->n_descsz < sizeof (*file) || file->count < 0 ||
+        (size_t) file->count > (nhdr->n_descsz - sizeof (*file)) / sizeof (file->array[0]))
+    {
+        fprintf (stderr, "Error: Bad NT_FILE note.\n");
+        return -1;
+    }
+
+    size_t count = (size_t) file->count;
+    const char* names = (const char*) file->array + count * sizeof (file->array[0]);
+    const char* names_end = (const char*) file + nhdr->n_descsz;
+
+    void* arrays = calloc (count + 1, 3 * sizeof (uint64_t) + sizeof (char*));
+    if (!arrays)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    files->start = (uint64_t*) arrays;
+    files->end   = files->start + count;
+    files->pgoff = files->end + count;
+    files->names = (const char**) (files->pgoff + count);
+
+    for (size_t i_file = 0; i_file < count; i_file++)
+    {
+        files->start[i_file] = file->array[i_file].start;
+        files->end[i_file]   = file->array[i_file].end;
+        files->pgoff[i_file] = file->array[i_file].file_ofs * file->pagesize;
+
+        const char* name_end = memchr (names, '\0', names_end - names);
+        files->names[i_file] = name_end ? names : "";
+        names = name_end ? name_end + 1 : names_end;
+    }
+
+    files->count = count;
+    files->page_size = (size_t) file->pagesize;
+    return 0;
+}
+
+// Index of mapping with addr, -1 if it isn't mapping of file
+long FileTableFind (const FileTable* files, uint64_t addr)
+{
+    assert (files);
+
+    size_t left = 0, right = files->count;
+    while (left < right)
+    {
+        size_t middle = left + (right - left) / 2;
+
+        if (addr < files->start[middle])
+            right = middle;
+        else if (addr >= files->end[middle])
+            left = middle + 1;
+        else
+            return (long) middle;
+    }
+
+    return -1;
+}
+
+void GoNotes (Elf* elf, Images* imgs)
+{
+    assert (elf);
+    assert (imgs);
+
+    Elf_Nhdr** process_notes = elf->notes.process;
+    imgs->notes = &elf->notes;
+
+    if (process_notes[NOTE_PRPSINFO])
+        GoPrpsinfo (process_notes[NOTE_PRPSINFO], imgs);
+    if (process_notes[NOTE_SIGINFO])
+        GoSiginfo (process_notes[NOTE_SIGINFO], imgs);
+    if (process_notes[NOTE_AUXV])
+        GoAuxv (process_notes[NOTE_AUXV], imgs);
+    if (process_notes[NOTE_FILE])
+        GoFile (process_notes[NOTE_FILE], imgs);
+
+    return;
+}
+
+/*
+    For note functions:
+    Note = {Nhdr, name, desc}
+
+    Name and desc have align = 4 or 8
+*/
+
+// ToDo: Check name?
+// Note for offset: align of name = 4 or 8
+#define NHDR_START(type, name, is_array)  \
+            assert (nhdr);                                                                                     \
+            assert (imgs);                                                                                     \
+            assert (nhdr->n_type == type);                                                                     \
+                                                                                                               \
+            if (nhdr->n_descsz != sizeof (name##_t) && !is_array)                                              \
+                fprintf (stderr, "Error: Bad n_descsz in %s:\n"                                                \
+                                 "Expected: sizeof (" #name ") = %lu\n"                                        \
+                                 "Detected: %u\n", __func__, sizeof (name##_t), nhdr->n_descsz);               \
+                                                                                                               \
+            size_t offset = sizeof (*nhdr) + GetAlignedSimple (nhdr->n_namesz);                                \
+            name##_t* name = (name##_t*) (((void*) nhdr) + offset)
+
+// align of desc = 4
+#define NHDR_RETURN return offset + GetAlignedSimple (nhdr->n_descsz)
+
+size_t GoPrpsinfo (Elf_Nhdr* nhdr, Images* imgs)
+{
+    NHDR_START (NT_PRPSINFO, prpsinfo, 0);
+
+    #define TASK_ALIVE 0x1
+    #define TASK_DEAD  0x2
+    #define TASK_STOPPED 0x3
+
+    /* switch (prpsinfo->pr_state)
+    {
+        case 0:
+            imgs->core->tc->task_state = TASK_ALIVE;
+            break;
+        case 4:
+            imgs->core->tc->task_state = TASK_DEAD;
+            break;
+        case 3:
+            imgs->core->tc->task_state = TASK_STOPPED;
+            break;
+        default:
+            fprintf (stderr, "Warning: I don't know, what I must do with prpsinfo->pr_state = 0x%X\n",
+                             (uint32_t) (prpsinfo->pr_state));
+            break;
+    }
+ */
+    imgs->core->thread_core->sched_prio = prpsinfo->pr_nice; // sched_prio not in thread_core?
+    imgs->core->tc->flags = prpsinfo->pr_flag;
+    imgs->core->thread_core->creds->uid = prpsinfo->pr_uid;
+    imgs->core->thread_core->creds->gid = prpsinfo->pr_gid;
+    imgs->pstree->pid  = prpsinfo->pr_pid;
+    // ppid is set in ProcessTreeWrite: it's pid of parent in tree or 0, as criu writes for root.
+    imgs->pstree->pgid = prpsinfo->pr_pgrp;
+    imgs->pstree->sid  = prpsinfo->pr_sid;
+
+    // Threads are given from NT_PRSTATUS in ConvertThreads
+
+    // prpsinfo->pr_psargs; // psarg - comand line's arguments. 
+    // They are contained in stack, working with psarg, as I think, useless.
+
+    // It's useless (because exec_names are equal) and dangerous (because pr_fname[16])
+    // free (imgs->core->tc->comm); 
+    // imgs->core->tc->comm = strdup (prpsinfo->pr_fname);
+
+    #undef TASK_ALIVE
+    #undef TASK_DEAD
+    #undef TASK_STOPPED
+    NHDR_RETURN;
+}
+
+// pr_reg is user_regs_struct of x86_64, its fields are listed in GoPrstatus
+static const size_t PR_REG_SP = 19;
+
+// Stack pointer of thread from its NT_PRSTATUS
+static uint64_t GetPrstatusSp (Elf_Nhdr* prstatus)
+{
+    return ((prstatus_t*) GetNoteDesc (prstatus))->pr_reg[PR_REG_SP];
+}
+
+size_t GoPrstatus (Elf_Nhdr* nhdr, Images* imgs, CoreEntry* core)
+{
+    NHDR_START (NT_PRSTATUS, prstatus, 0);
+    assert (core);
+
+    // ToDo: Other platforms?
+    UserX86RegsEntry* regs = core->thread_info->gpregs;
+
+    // pr_reg <==> user_regs_struct, but haven't this type
+    regs->r15 = prstatus->pr_reg[0];
+    regs->r14 = prstatus->pr_reg[1];
+    regs->r13 = prstatus->pr_reg[2];
+    regs->r12 = prstatus->pr_reg[3];
+    regs->bp  = prstatus->pr_reg[4];
+    regs->bx  = prstatus->pr_reg[5];
+    regs->r11 = prstatus->pr_reg[6];
+    regs->r10 = prstatus->pr_reg[7];
+    regs->r9  = prstatus->pr_reg[8];
+    regs->r8  = prstatus->pr_reg[9];
+    regs->ax  = prstatus->pr_reg[10];
+    regs->cx  = prstatus->pr_reg[11];
+    regs->dx  = prstatus->pr_reg[12];
+    regs->si  = prstatus->pr_reg[13];
+    regs->di  = prstatus->pr_reg[14];
+    regs->orig_ax = prstatus->pr_reg[15];
+    regs->ip  = prstatus->pr_reg[16];
+    regs->cs  = prstatus->pr_reg[17];
+    regs->flags = prstatus->pr_reg[18];
+    regs->sp  = prstatus->pr_reg[PR_REG_SP];
+    regs->ss  = prstatus->pr_reg[20];
+    regs->fs_base = prstatus->pr_reg[21];
+    regs->gs_base = prstatus->pr_reg[22];
+    regs->ds  = prstatus->pr_reg[23];
+    regs->es  = prstatus->pr_reg[24];
+    regs->fs  = prstatus->pr_reg[25];
+    regs->gs  = prstatus->pr_reg[26];
+
+    NHDR_RETURN;    
+}
+
+size_t GoFpregset (Elf_Nhdr* nhdr, Images* imgs, CoreEntry* core)
+{
+    NHDR_START (NT_FPREGSET, elf_fpregset, 0);
+    assert (core);
+
+    UserX86FpregsEntry* regs = core->thread_info->fpregs;
+    regs->cwd = elf_fpregset->cwd;
+    regs->swd = elf_fpregset->swd;
+    regs->twd = elf_fpregset->ftw;
+    regs->fop = elf_fpregset->fop;
+    regs->rip = elf_fpregset->rip;
+    regs->rdp = elf_fpregset->rdp;
+    regs->mxcsr = elf_fpregset->mxcsr;
+    regs->mxcsr_mask = elf_fpregset->mxcr_mask;
+    
+    if (sizeof (elf_fpregset->st_space) / sizeof (elf_fpregset->st_space[0]) != regs->n_st_space)
+        fprintf (stderr, "Warning: st_space in coredump isn't equal st_space in criu images.\n"
+                         "n_st_space [criu] = %zu\n"
+                         "sizeof (st_space) [coredump] = %zu\n", regs->n_st_space, sizeof (elf_fpregset->st_space));
+    memcpy (regs->st_space,  elf_fpregset->st_space,  regs->n_st_space);
+
+    if (sizeof (elf_fpregset->xmm_space) / sizeof (elf_fpregset->xmm_space[0]) != regs->n_xmm_space)
+        fprintf (stderr, "Warning: xmm_space in coredump isn't equal xmm_space in criu images.\n"
+                         "n_xmm_space [criu] = %zu\n"
+                         "sizeof (xmm_space) [coredump] = %zu\n", regs->n_xmm_space, sizeof (elf_fpregset->xmm_space));
+    memcpy (regs->xmm_space, elf_fpregset->xmm_space, sizeof (elf_fpregset->xmm_space));
+    
+    NHDR_RETURN;
+}
+
+size_t GoX86_State (Elf_Nhdr* nhdr, Images* imgs, CoreEntry* core)
+{
+    NHDR_START (NT_X86_XSTATE, xsave, 0);
+    assert (core);
+    UserX86FpregsEntry* regs = core->thread_info->fpregs;
+
+    if (regs->xsave == NULL)
+    {
+        fprintf (stderr, "Warning: UserX86XsaveEntry doesn't exist yet. Creating it...\n");
+        regs->xsave = (UserX86XsaveEntry*) ArenaAlloc (imgs->arena, sizeof (*(regs->xsave)));
+        if (regs->xsave == NULL)
+            return 0;
+        user_x86_xsave_entry__init (regs->xsave);
+    }
+
+    // regs->xsave->xstate_bv = xsave->xsave_hdr.xstate_bv;
+    // It isn't copied: note lives until images are written, packer only reads it.
+    regs->xsave->ymmh_space = (uint32_t*) &(xsave->ymmh);
+    regs->xsave->n_ymmh_space = sizeof (xsave->ymmh) / sizeof (regs->xsave->ymmh_space[0]);
+
+    // ToDo: Do I need do something another here?
+
+    NHDR_RETURN;
+}
+
+size_t GoSiginfo (Elf_Nhdr* nhdr, Images* imgs)
+{
+    NHDR_START (NT_SIGINFO, siginfo, 0);
+    NHDR_RETURN;
+    static size_t new_pos = 0;
+    SignalQueueEntry* signals_s = imgs->core->tc->signals_s;
+
+    // ToDo: new_pos < n_signals after working program?
+    if (new_pos >= signals_s->n_signals)
+    {
+        // fprintf (stderr, "Error: amount of siginfo_t structs >= n_signals. Maybe fix it in this program?\n");
+        // NHDR_RETURN;
+
+        // ToDo: I'm not sure, but it can work
+        SiginfoEntry** new_signals = (SiginfoEntry**) ArenaAlloc (imgs->arena, (signals_s->n_signals + 1) * sizeof (*new_signals));
+        if (new_signals == NULL)
+            NHDR_RETURN;
+        memcpy (new_signals, signals_s->signals, signals_s->n_signals * sizeof (*new_signals));
+        signals_s->signals = new_signals;
+        signals_s->n_signals++; // always imgs->core->tc->signals_s->n_signals + 1 > new_pos
+
+        signals_s->signals[new_pos] = (SiginfoEntry*) ArenaAlloc (imgs->arena, sizeof (*signals_s->signals[new_pos]));
+        if (signals_s->signals[new_pos] == NULL)
+            NHDR_RETURN;
+        siginfo_entry__init (signals_s->signals[new_pos]);
+    }
+    
+    // Pointer to note in coredump, it isn't copied
+    signals_s->signals[new_pos]->siginfo.len = sizeof (*siginfo);
+    signals_s->signals[new_pos]->siginfo.data = (uint8_t*) siginfo;
+
+    /*
+    I found it in criu/cr-restore.c
+        static int signal_to_mem(SiginfoEntry *se)
+        {
+            siginfo_t *info, *t;
+
+            info = (siginfo_t *)se->siginfo.data;
+            t = rst_mem_alloc(sizeof(siginfo_t), RM_PRIVATE);
+            if (!t)
+                return -1;
+
+            memcpy(t, info, sizeof(*info));
+
+            return 0;
+        }
+    */
+
+    new_pos++;
+    NHDR_RETURN;
+}
+
+size_t GoAuxv (Elf_Nhdr* nhdr, Images* imgs)
+{
+    NHDR_START (NT_AUXV, Elf_auxv, 1);
+
+    if (nhdr->n_descsz % (2 * sizeof (*imgs->mm->mm_saved_auxv))) // ToDo: It's ok?
+        fprintf (stderr, "Warning: In my opinion, auxv in coredump is broken.\n");
+
+    // Pointer to note in coredump, it isn't copied
+    imgs->mm->mm_saved_auxv = (uint64_t*) Elf_auxv;
+    imgs->mm->n_mm_saved_auxv = nhdr->n_descsz / sizeof (*imgs->mm->mm_saved_auxv);
+
+    NHDR_RETURN;
+}
+
+size_t GoFile (Elf_Nhdr* nhdr, Images* imgs) // ToDo: not working function
+{
+    NHDR_START (NT_FILE, file, 1);
+    (void) file;
+    VmaEntry** vmas = imgs->mm->vmas;
+
+    for (size_t i_vma = 0, i_file = 0; i_vma < imgs->mm->n_vmas; i_vma++)
+    {
+        if (vmas[i_vma]->shmid == 0) // isn't file
+            continue;
+
+        // This printf shows full match between NT_FILE nhdr and vma with shmid != 0.
+        // But now I don't know how to use it because PT_LOAD phdrs contains all necessary information.
+        // printf ("shmid = %ld filename = %s [coredump] = %lX [criu] = %lX\n", 
+        //                                 vmas[i_vma]->shmid,
+        //                                 imgs->notes->files.names[i_file],
+        //                                 imgs->notes->files.end[i_file] - imgs->notes->files.start[i_file],
+        //                                 vmas[i_vma]->end - vmas[i_vma]->start);
+
+        i_file++;
+    }
+
+    /*  ToDo: this is incorrect function. Rewrite it.
+    if (imgs->mm->n_vmas != (size_t) file->count)
+    {
+        fprintf (stderr, "Error (FIXME): n_vmas != count in NT_FILE.\n");
+        return 0;
+    }
+
+    // ToDo: names? See coredump.py:583
+    // ToDo: Maybe do this more carefully?
+    for (int i_vma = 0; i_vma < file->count; i_vma++)
+    {
+        imgs->mm->vmas[i_vma]->start = file->array[i_vma].start;
+        imgs->mm->vmas[i_vma]->end   = file->array[i_vma].end;
+        imgs->mm->vmas[i_vma]->pgoff = file->array[i_vma].file_ofs * file->pagesize;     
+    }
+    */
+
+    NHDR_RETURN;
+}
+
+#undef NHDR_START
+#undef NHDR_RETURN
+
+static int CompareVmaIndexes (const void* a, const void* b)
+{
+    size_t index_a = ((const VmaKey*) a)->index;
+    size_t index_b = ((const VmaKey*) b)->index;
+    return (index_a > index_b) - (index_a < index_b);
+}
+
+static int CompareVmaKeysWithoutStart (const VmaKey* key_a, const VmaKey* key_b)
+{
+    if (key_a->vma_class != key_b->vma_class)
+        return (key_a->vma_class < key_b->vma_class) ? -1 : 1;
+
+    if (key_a->vma_class == VMA_CLASS_FILE)
+    {
+        int cmp = strcmp (key_a->name, key_b->name);
+        if (cmp)
+            return cmp;
+        if (key_a->pgoff != key_b->pgoff)
+            return (key_a->pgoff < key_b->pgoff) ? -1 : 1;
+    }
+
+    if (key_a->prot != key_b->prot)
+        return (key_a->prot < key_b->prot) ? -1 : 1;
+
+    // Anonymous VMA of other size is other allocation, it isn't paired by rank
+    if (key_a->vma_class == VMA_CLASS_ANON)
+        return (key_a->size > key_b->size) - (key_a->size < key_b->size);
+    return 0;
+}
+
+static int CompareVmaKeys (const void* a, const void* b)
+{
+    const VmaKey* key_a = (const VmaKey*) a;
+    const VmaKey* key_b = (const VmaKey*) b;
+
+    int cmp = CompareVmaKeysWithoutStart (key_a, key_b);
+    return cmp ? cmp : (key_a->start > key_b->start) - (key_a->start < key_b->start);
+}
+
+static int CompareFileEntriesById (const void* a, const void* b)
+{
+    uint32_t id_a = (*(FileEntry* const*) a)->id;
+    uint32_t id_b = (*(FileEntry* const*) b)->id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+static VmaClass GetDonorVmaClass (const VmaEntry* vma)
+{
+    if (vma->status & VMA_AREA_AIORING)
+        return VMA_CLASS_AIORING;
+    if (vma->status & VMA_AREA_SYSVIPC)
+        return VMA_CLASS_SYSVIPC;
+    if (vma->status & VMA_AREA_SOCKET)
+        return VMA_CLASS_SOCKET;
+    if (vma->status & VMA_AREA_VSYSCALL)
+        return VMA_CLASS_VSYSCALL;
+    if (vma->status & VMA_AREA_VVAR)
+        return VMA_CLASS_VVAR;
+    if (vma->status & VMA_AREA_VDSO)
+        return VMA_CLASS_VDSO;
+    if (vma->status & VMA_AREA_HEAP)
+        return VMA_CLASS_HEAP;
+    if ((vma->status & VMA_AREA_STACK) || (vma->flags & MAP_GROWSDOWN))
+        return VMA_CLASS_STACK;
+    if (vma->status & (VMA_FILE_PRIVATE | VMA_FILE_SHARED))
+        return VMA_CLASS_FILE;
+    if (vma->status & VMA_ANON_SHARED)
+        return VMA_CLASS_ANON_SHARED;
+
+    return VMA_CLASS_ANON;
+}
+
+// Donor's VMA with addr, NULL if there is no such one. criu dumps VMAs in order of addresses.
+static const VmaEntry* FindDonorVma (const MmEntry* mm, uint64_t addr)
+{
+    size_t left = 0, right = mm->n_vmas;
+    while (left < right)
+    {
+        size_t middle = left + (right - left) / 2;
+
+        if (addr < mm->vmas[middle]->start)
+            right = middle;
+        else if (addr >= mm->vmas[middle]->end)
+            left = middle + 1;
+        else
+            return mm->vmas[middle];
+    }
+
+    return NULL;
+}
+
+static void GetDonorVmaKeys (Images* imgs, VmaKey* keys)
+{
+    MmEntry* mm = imgs->mm;
+
+    // shmid of file mapping is id of file in files.img
+    if (imgs->n_files)
+        qsort (imgs->files, imgs->n_files, sizeof (*imgs->files), CompareFileEntriesById);
+
+    for (size_t i_vma = 0; i_vma < mm->n_vmas; i_vma++)
+    {
+        VmaEntry* vma = mm->vmas[i_vma];
+        keys[i_vma] = (VmaKey) {.vma_class = GetDonorVmaClass (vma), .pgoff = vma->pgoff, .prot = vma->prot,
+                                .start = vma->start, .size = vma->end - vma->start, .index = i_vma};
+
+        if (keys[i_vma].vma_class != VMA_CLASS_FILE)
+            continue;
+
+        FileEntry key_entry = {.id = (uint32_t) vma->shmid};
+        FileEntry* key_ptr = &key_entry;
+        FileEntry** file = imgs->n_files ? (FileEntry**) bsearch (&key_ptr, imgs->files, imgs->n_files, sizeof (*imgs->files),
+                                                                  CompareFileEntriesById) : NULL;
+
+        keys[i_vma].name = (file && (*file)->reg && (*file)->reg->name) ? (*file)->reg->name : "";
+    }
+
+    return;
+}
+
+// Classes of PT_LOADs are given from auxv, NT_FILE and registers: there are no flags of VMA in coredump
+static void GetCoreVmaKeys (Elf* elf, Elf_Phdr** loads, size_t n_loads, VmaKey* keys)
+{
+    const NoteIndex* notes = &elf->notes;
+    uint64_t vdso = 0, execfn = 0, at_phdr = 0;
+
+    if (notes->process[NOTE_AUXV])
+    {
+        Elf_auxv_t* auxv = (Elf_auxv_t*) GetNoteDesc (notes->process[NOTE_AUXV]);
+        size_t n_auxv = notes->process[NOTE_AUXV]->n_descsz / sizeof (*auxv);
+
+        for (size_t i_aux = 0; i_aux < n_auxv && auxv[i_aux].a_type != AT_NULL; i_aux++)
+        {
+            if (auxv[i_aux].a_type == AT_SYSINFO_EHDR)
+                vdso = auxv[i_aux].a_un.a_val;
+            if (auxv[i_aux].a_type == AT_EXECFN)
+                execfn = auxv[i_aux].a_un.a_val; // it's placed on stack of main thread
+            if (auxv[i_aux].a_type == AT_PHDR)
+                at_phdr = auxv[i_aux].a_un.a_val;
+        }
+    }
+
+    if (!execfn && notes->n_threads)
+        execfn = GetPrstatusSp (notes->threads[0].prstatus);
+
+    // brk area is placed after the main binary, but not right after it (there is bss)
+    uint64_t exe_end = 0;
+    long i_exe = FileTableFind (&notes->files, at_phdr);
+    for (size_t i_file = 0; i_exe != -1 && i_file < notes->files.count; i_file++)
+        if (strcmp (notes->files.names[i_file], notes->files.names[i_exe]) == 0 && notes->files.end[i_file] > exe_end)
+            exe_end = notes->files.end[i_file];
+
+    int heap_found = 0;
+    size_t i_vdso = n_loads;
+
+    for (size_t i_load = 0; i_load < n_loads; i_load++)
+    {
+        Elf_Phdr* phdr = loads[i_load];
+        VmaKey* key = keys + i_load;
+        *key = (VmaKey) {.vma_class = VMA_CLASS_ANON, .prot = GetVmaProtByPhdr (phdr->p_flags),
+                         .start = phdr->p_vaddr, .size = phdr->p_memsz, .index = i_load};
+
+        long i_file = FileTableFind (&notes->files, phdr->p_vaddr);
+
+        if (phdr->p_vaddr == VSYSCALL_ADDR)
+            key->vma_class = VMA_CLASS_VSYSCALL;
+        else if (vdso && phdr->p_vaddr == vdso)
+        {
+            key->vma_class = VMA_CLASS_VDSO;
+            i_vdso = i_load;
+        }
+        else if (i_file != -1)
+        {
+            key->vma_class = VMA_CLASS_FILE;
+            key->name  = notes->files.names[i_file];
+            key->pgoff = notes->files.pgoff[i_file] + (phdr->p_vaddr - notes->files.start[i_file]);
+        }
+        else if (execfn >= phdr->p_vaddr && execfn - phdr->p_vaddr < phdr->p_memsz)
+            key->vma_class = VMA_CLASS_STACK;
+        else if (!heap_found && exe_end && phdr->p_vaddr > exe_end && key->prot == (PROT_READ | PROT_WRITE))
+        {
+            key->vma_class = VMA_CLASS_HEAP;
+            heap_found = 1;
+        }
+    }
+
+    // vvar isn't dumped and is placed right before vdso
+    for (size_t i_load = i_vdso; i_load > 0 && i_load < n_loads; i_load--)
+    {
+        Elf_Phdr* prev = loads[i_load - 1];
+        if (prev->p_filesz != 0 || prev->p_vaddr + prev->p_memsz != loads[i_load]->p_vaddr)
+            break;
+        keys[i_load - 1].vma_class = VMA_CLASS_VVAR;
+    }
+
+    return;
+}
+
+int MatchVmas (Elf* elf, Images* imgs)
+{
+    assert (elf);
+    assert (imgs);
+    assert (imgs->mm);
+
+    MmEntry* mm = imgs->mm;
+    size_t n_loads = 0;
+    for (Elf_Half i_phdr = 0; i_phdr < elf->phnum; i_phdr++)
+        n_loads += (elf->phdr_table[i_phdr].p_type == PT_LOAD);
+
+    Elf_Phdr** loads    = (Elf_Phdr**) calloc (n_loads + 1, sizeof (*loads));
+    VmaKey* core_keys   = (VmaKey*) calloc (n_loads + 1, sizeof (*core_keys));
+    VmaKey* donor_keys  = (VmaKey*) calloc (mm->n_vmas + 1, sizeof (*donor_keys));
+    VmaRole* roles      = (VmaRole*) calloc (mm->n_vmas + 1, sizeof (*roles));
+    size_t* matched     = (size_t*) calloc (n_loads + 1, sizeof (*matched));
+    VmaEntry** new_vmas = (VmaEntry**) ArenaAlloc (imgs->arena, (n_loads + 1) * sizeof (*new_vmas));
+    VmaEntry** donor_vmas = (VmaEntry**) ArenaAlloc (imgs->arena, (n_loads + 1) * sizeof (*donor_vmas));
+    int res = -1;
+
+    if (!loads || !core_keys || !donor_keys || !roles || !matched || !new_vmas || !donor_vmas)
+    {
+        perror ("Can't allocate memory");
+        goto finish;
+    }
+
+    for (Elf_Half i_phdr = 0, i_load = 0; i_phdr < elf->phnum; i_phdr++)
+        if (elf->phdr_table[i_phdr].p_type == PT_LOAD)
+            loads[i_load++] = elf->phdr_table + i_phdr;
+
+    GetCoreVmaKeys (elf, loads, n_loads, core_keys);
+    GetDonorVmaKeys (imgs, donor_keys);
+    for (size_t i_vma = 0; i_vma < mm->n_vmas; i_vma++)
+        roles[i_vma] = GetVmaRole (mm, mm->vmas[i_vma]);
+
+    // Equal keys are paired in order of addresses: O(n log n) for sorting and O(n) for merging
+    qsort (core_keys,  n_loads,     sizeof (*core_keys),  CompareVmaKeys);
+    qsort (donor_keys, mm->n_vmas, sizeof (*donor_keys), CompareVmaKeys);
+
+    for (size_t i_load = 0; i_load < n_loads; i_load++)
+        matched[i_load] = NO_VMA;
+
+    size_t n_matched = 0;
+    for (size_t i_core = 0, i_donor = 0; i_core < n_loads && i_donor < mm->n_vmas; )
+    {
+        int cmp = CompareVmaKeysWithoutStart (core_keys + i_core, donor_keys + i_donor);
+        if (cmp == 0)
+        {
+            matched[core_keys[i_core].index] = donor_keys[i_donor].index;
+            n_matched++;
+            i_core++;
+            i_donor++;
+        }
+        else if (cmp < 0)
+            i_core++;
+        else
+            i_donor++;
+    }
+
+    // Keys are needed in order of PT_LOADs again
+    qsort (core_keys, n_loads, sizeof (*core_keys), CompareVmaIndexes);
+
+    for (size_t i_load = 0; i_load < n_loads; i_load++)
+    {
+        Elf_Phdr* phdr = loads[i_load];
+        VmaEntry* vma = (VmaEntry*) ArenaAlloc (imgs->arena, sizeof (*vma));
+        if (!vma)
+            goto finish;
+
+        if (matched[i_load] != NO_VMA)
+        {
+            VmaEntry* donor_vma = mm->vmas[matched[i_load]];
+            *vma = *donor_vma;
+            donor_vmas[i_load] = donor_vma;
+            MmChangeIfNeeded (mm, donor_vma, roles[matched[i_load]], phdr);
+
+            if (core_keys[i_load].vma_class == VMA_CLASS_FILE)
+                vma->pgoff = core_keys[i_load].pgoff;
+        }
+        else
+        {
+            // Memory without pair in donor is restored as private anonymous memory with data from coredump
+            VmaEntry anon_vma = VMA_ENTRY__INIT;
+            *vma = anon_vma;
+            vma->prot   = core_keys[i_load].prot;
+            vma->flags  = MAP_PRIVATE | MAP_ANONYMOUS;
+            vma->status = VMA_AREA_REGULAR | VMA_ANON_PRIVATE;
+            vma->fd     = -1;
+
+            if (core_keys[i_load].vma_class == VMA_CLASS_STACK)
+            {
+                vma->flags  |= MAP_GROWSDOWN;
+                vma->status |= VMA_AREA_STACK;
+            }
+
+            // Heap of allocator, which changed rights of its memory, keeps advice about huge pages of donor's VMA at the same place
+            const VmaEntry* place_vma = FindDonorVma (mm, phdr->p_vaddr);
+            if (place_vma && place_vma->has_madv && GetDonorVmaClass (place_vma) == core_keys[i_load].vma_class &&
+                (core_keys[i_load].vma_class == VMA_CLASS_ANON || core_keys[i_load].vma_class == VMA_CLASS_HEAP))
+            {
+                vma->has_madv = 1;
+                vma->madv = place_vma->madv & ((1ULL << MADV_HUGEPAGE) | (1ULL << MADV_NOHUGEPAGE));
+            }
+        }
+
+        vma->start = phdr->p_vaddr;
+        vma->end   = phdr->p_vaddr + phdr->p_memsz;
+        new_vmas[i_load] = vma;
+    }
+
+    if (n_matched != n_loads || n_matched != mm->n_vmas)
+        fprintf (stderr, "Warning: %zu PT_LOAD segments have no pair in donor and are restored as anonymous memory, "
+                         "%zu donor's VMAs are dropped.\n", n_loads - n_matched, mm->n_vmas - n_matched);
+
+    mm->vmas = new_vmas;
+    mm->n_vmas = n_loads;
+    imgs->donor_vmas = donor_vmas;
+    res = 0;
+
+finish:
+    free (loads);
+    free (core_keys);
+    free (donor_keys);
+    free (roles);
+    free (matched);
+    return res;
+}
+
+// As criu's vma_entry_can_be_lazy: restorer registers such VMA in userfaultfd. Stacks of threads are dumped by criu
+// not lazily (is_stack), because kernel touches them in sigreturn of restorer.
+static int IsLazyVma (const Images* imgs, const VmaEntry* vma)
+{
+    if (!(vma->status & VMA_ANON_PRIVATE) || (vma->status & (VMA_AREA_STACK | VMA_AREA_VDSO | VMA_AREA_VVAR | VMA_AREA_VSYSCALL)) ||
+        !(vma->flags & MAP_ANONYMOUS) || (vma->flags & (MAP_LOCKED | MAP_HUGETLB | MAP_GROWSDOWN)))
+        return 0;
+
+    for (size_t i_thread = 0; imgs->notes && i_thread < imgs->notes->n_threads; i_thread++)
+    {
+        uint64_t sp = GetPrstatusSp (imgs->notes->threads[i_thread].prstatus);
+        if (sp >= vma->start && sp < vma->end)
+            return 0;
+    }
+
+    return 1;
+}
+
+// Huge page is restored whole, if pagemap has all its pages: criu fills it by one write and THP isn't split by
+// zero holes. Size of hugetlb page is in flags of VMA as for mmap, THP is asked by MADV_HUGEPAGE (allocators do it for heaps).
+static size_t GetHugePages (const VmaEntry* vma)
+{
+    size_t huge_page_size = 0;
+    if (vma->flags & MAP_HUGETLB)
+    {
+        size_t shift = (vma->flags >> MAP_HUGE_SHIFT) & MAP_HUGE_MASK;
+        huge_page_size = shift ? (size_t) 1 << shift : HUGE_PAGE_SIZE;
+    }
+    else if ((vma->status & VMA_ANON_PRIVATE) && vma->has_madv && (vma->madv & (1ULL << MADV_HUGEPAGE)))
+        huge_page_size = HUGE_PAGE_SIZE;
+
+    return (huge_page_size > page_size) ? huge_page_size / page_size : 0;
+}
+
+int GoLoadPhdr (Elf* elf, Elf_Phdr* phdr, Images* imgs, size_t vma_counter) 
+{
+    assert (elf);
+    assert (phdr);
+    assert (imgs);
+
+#define check_correct(cond, ...) if ((cond))                        \
+                                 {                                  \
+                                     fprintf (stderr, __VA_ARGS__); \
+                                     return -1;                     \
+                                 }
+
+
+    check_correct (vma_counter >= imgs->mm->n_vmas, "Error: criu dump has less vmas than needed.\n")
+    check_correct (phdr->p_filesz % page_size, "Error: PT_LOAD phdr size isn't aligned.\n")
+
+    // VMAs are rebuilt by MatchVmas in order of PT_LOADs
+    VmaEntry* vma = imgs->mm->vmas[vma_counter];
+    check_correct (phdr->p_vaddr != vma->start || phdr->p_memsz != vma->end - vma->start,
+                   "Error: vma and following phdr have different sizes. vma_counter = %zu\n", vma_counter)
+
+    // Guard pages and vvar aren't dumped by kernel, criu doesn't need their pages too
+    if (phdr->p_filesz == 0 && (vma->prot == PROT_NONE || (vma->status & VMA_AREA_VVAR)))
+        return 0;
+
+    check_correct (phdr->p_memsz > phdr->p_filesz, "Error: In some program header memsz > filesz."
+                                                   "It means, that coredump isn't full and generated images is incorrect.\n")
+
+    // ToDo: criu writes: "Trying to restore page for non-private VMA", but this vma has flags: VMA_AREA_VSYSCALL | VMA_ANON_PRIVATE
+    // Maybe check !(vma->flags && VMA_AREA_REGULAR) ???
+    if (vma->status & VMA_AREA_VSYSCALL)
+        return 0;
+
+    // Page of private file mapping, which wasn't written by process, is taken by criu from file
+    const char* file_name = NULL;
+    uint64_t file_offset = 0;
+    long i_file = -1;
+    if (imgs->plan.file_pages && (vma->status & VMA_FILE_PRIVATE) && imgs->notes &&
+        (i_file = FileTableFind (&imgs->notes->files, phdr->p_vaddr)) != -1)
+    {
+        file_name   = imgs->notes->files.names[i_file];
+        file_offset = imgs->notes->files.pgoff[i_file] + (phdr->p_vaddr - imgs->notes->files.start[i_file]);
+    }
+
+    // Zero page in file mapping isn't the same as missing page: criu will take it from file.
+    // Pages, that aren't in pagemap, will be restored by criu as fresh anonymous (zero) memory.
+    check_correct (PagesPlanAdd (&imgs->plan, phdr, vma->status & VMA_ANON_PRIVATE, imgs->plan.lazy && IsLazyVma (imgs, vma),
+                                 GetHugePages (vma), file_name, file_offset), 
+                   "Error: Can't add PT_LOAD segment to plan.\n")
+
+    #undef check_correct
+    return 0;
+}
+
+int PagesPlanAdd (PagesPlan* plan, Elf_Phdr* phdr, int is_anon, int is_lazy, size_t huge_pages, const char* file_name, uint64_t file_offset)
+{
+    assert (plan);
+    assert (phdr);
+
+    if (plan->n_segments == plan->capacity)
+    {
+        size_t new_capacity = plan->capacity ? 2 * plan->capacity : 64;
+        SegmentPlan* new_segments = (SegmentPlan*) realloc (plan->segments, new_capacity * sizeof (*new_segments));
+        if (!new_segments)
+        {
+            perror ("Can't allocate memory");
+            return -1;
+        }
+
+        plan->segments = new_segments;
+        plan->capacity = new_capacity;
+    }
+
+    plan->segments[plan->n_segments++] = (SegmentPlan) {.phdr = phdr, .is_anon = is_anon, .is_lazy = is_lazy, .huge_pages = huge_pages,
+                                                        .file_name = file_name, .file_offset = file_offset, .file_fd = -1};
+    return 0;
+}
+
+typedef struct
+{
+    size_t i_segment, first_page, end_page;
+    PagesRun* runs;
+    size_t n_runs;
+} ScanChunk;
+
+typedef struct
+{
+    off_t src, dst;
+    size_t len;
+    int is_scanned; // data was counted as read by scanning
+} CopyPiece;
+
+typedef struct
+{
+    Elf* elf;
+    Images* imgs;
+    ScanChunk* chunks;
+    size_t n_chunks;
+    CopyPiece* pieces;
+    size_t n_pieces;
+    size_t n_counted; // first pieces, which are counted in stats already: copying is repeated after failure of io_uring
+} PlanContext;
+
+// Page of coredump at vaddr is equal to page of parent images at the same address
+static int IsParentPage (const ParentPages* parent, uint64_t vaddr, const char* page)
+{
+    if (!parent)
+        return 0;
+
+    // The last run, which starts before vaddr
+    size_t left = 0, right = parent->n_runs;
+    while (left < right)
+    {
+        size_t middle = left + (right - left) / 2;
+        if (parent->runs[middle].vaddr <= vaddr)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+
+    if (left == 0)
+        return 0;
+
+    const ParentRun* run = parent->runs + left - 1;
+    if (vaddr >= run->vaddr + run->n_pages * page_size)
+        return 0;
+
+    size_t offset = run->pages_offset + (vaddr - run->vaddr);
+    return offset + page_size <= parent->pages_size && IsSamePage (page, parent->pages + offset, page_size);
+}
+
+// Run of pages, which are needed in images: non-zero pages of anonymous memory, pages changed in file mapping
+// or all pages, if segment is scanned only for parent.
+static int FindNeededRun (const SegmentPlan* segment, const Elf* elf, size_t from_page, size_t end_page,
+                          size_t* run_start, size_t* run_end)
+{
+    Elf_Phdr* phdr = segment->phdr;
+
+    if (segment->is_anon)
+        return FindNonZeroRun (elf->buf, elf->fd, phdr->p_offset, page_size, from_page, end_page, run_start, run_end);
+    if (segment->file_buf)
+        return FindChangedRun (elf->buf, phdr->p_offset, segment->file_buf, segment->file_size, segment->file_offset,
+                               page_size, from_page, end_page, run_start, run_end);
+
+    if (from_page >= end_page)
+        return 1;
+
+    *run_start = from_page;
+    *run_end   = end_page;
+    return 0;
+}
+
+static int ScanChunkJob (void* ctx, size_t i_task)
+{
+    PlanContext* plan_ctx = (PlanContext*) ctx;
+    ScanChunk* chunk = plan_ctx->chunks + i_task;
+    Elf* elf = plan_ctx->elf;
+    SegmentPlan* segment = plan_ctx->imgs->plan.segments + chunk->i_segment;
+    const ParentPages* parent = plan_ctx->imgs->plan.parent;
+    Elf_Phdr* phdr = segment->phdr;
+
+    #define is_parent(page) IsParentPage (parent, phdr->p_vaddr + (page) * page_size, elf->buf + phdr->p_offset + (page) * page_size)
+
+    size_t run_start = 0, run_end = chunk->first_page, capacity = 0;
+    while (FindNeededRun (segment, elf, run_end, chunk->end_page, &run_start, &run_end) == 0)
+    {
+        // Run is cut to parts, which are in parent, and parts with new data
+        for (size_t page = run_start; page < run_end; )
+        {
+            int in_parent = is_parent (page);
+            size_t part_end = parent ? page + 1 : run_end;
+            while (part_end < run_end && is_parent (part_end) == in_parent)
+                part_end++;
+
+            if (chunk->n_runs == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 16;
+                PagesRun* new_runs = (PagesRun*) realloc (chunk->runs, capacity * sizeof (*new_runs));
+                if (!new_runs)
+                {
+                    perror ("Can't allocate memory");
+                    return -1;
+                }
+                chunk->runs = new_runs;
+            }
+
+            chunk->runs[chunk->n_runs++] = (PagesRun) {.first_page = page, .n_pages = part_end - page, .in_parent = in_parent};
+            page = part_end;
+        }
+    }
+    #undef is_parent
+
+    AdviseMapping (elf->buf, phdr->p_offset + chunk->first_page * page_size,
+                   (chunk->end_page - chunk->first_page) * page_size, MADV_DONTNEED);
+
+    StatsAdd (COUNTER_CORE_READ, (chunk->end_page - chunk->first_page) * page_size);
+    StatsProgress();
+    return 0;
+}
+
+// Keys for pages [0, n_pages) of pages image. Threads write keys to their places, so array is grown before them.
+static int ReserveStoreKeys (Images* imgs, size_t n_pages)
+{
+    if (n_pages <= imgs->store_keys_capacity)
+        return 0;
+
+    size_t new_capacity = (2 * imgs->store_keys_capacity > n_pages) ? 2 * imgs->store_keys_capacity : n_pages;
+    uint64_t* new_keys = (uint64_t*) realloc (imgs->store_keys, new_capacity * sizeof (*new_keys));
+    if (!new_keys)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    // Pages of failed conversion can be left without keys
+    memset (new_keys + imgs->store_keys_capacity, 0, (new_capacity - imgs->store_keys_capacity) * sizeof (*new_keys));
+    imgs->store_keys = new_keys;
+    imgs->store_keys_capacity = new_capacity;
+    return 0;
+}
+
+// Data of pages image from pages_offset: to pages-<id>.img or to store
+static int WritePagesData (Images* imgs, const char* data, size_t len, size_t pages_offset)
+{
+    // Filesystem with block bigger than page refuses O_DIRECT, page cache is used then
+    if (imgs->pages_direct_fd != -1 && WriteDirect (imgs->pages_direct_fd, data, len, pages_offset) == 0)
+        return 0;
+
+    if (!page_store)
+        return (pwrite (imgs->pages_fd, data, len, pages_offset) == (ssize_t) len) ? 0 : -1;
+
+    for (size_t done = 0; done < len; done += page_size)
+        if (PageStoreAdd (page_store, data + done, imgs->store_keys + (pages_offset + done) / page_size))
+            return -1;
+
+    return 0;
+}
+
+int WriteManifest (Images* imgs, const char* path)
+{
+    assert (imgs);
+    assert (path);
+
+    char manifest_filename[MAX_PATH_LEN] = "";
+    snprintf (manifest_filename, MAX_PATH_LEN, "%s/pages-%u" MANIFEST_SUFFIX, path, imgs->pages_id);
+    return ManifestWrite (manifest_filename, imgs->store_keys, imgs->pages_size / page_size, page_size);
+}
+
+static int CopyPieceJob (void* ctx, size_t i_task)
+{
+    PlanContext* plan_ctx = (PlanContext*) ctx;
+    CopyPiece* piece = plan_ctx->pieces + i_task;
+
+    // In-kernel copying goes through page cache, O_DIRECT is written from mapping of coredump
+    if ((page_store || plan_ctx->imgs->pages_direct_fd != -1)
+            ? WritePagesData (plan_ctx->imgs, plan_ctx->elf->buf + piece->src, piece->len, piece->dst)
+            : CopyFileRange (plan_ctx->elf->fd, piece->src, plan_ctx->imgs->pages_fd, piece->dst, piece->len))
+        return -1;
+
+    // Each range is read once, don't keep it in page cache.
+    posix_fadvise (plan_ctx->elf->fd, piece->src, piece->len, POSIX_FADV_DONTNEED);
+
+    if (i_task < plan_ctx->n_counted)
+        return 0;
+
+    StatsAdd (COUNTER_PAGES_WRITTEN, piece->len);
+    if (!piece->is_scanned)
+    {
+        StatsAdd (COUNTER_CORE_READ, piece->len);
+        StatsProgress();
+    }
+    return 0;
+}
+
+// Anonymous segments are scanned for zero pages, mapped files are compared with file, all pages are compared with parent.
+// Lazy segments aren't read at all.
+static int IsScannedSegment (const PagesPlan* plan, const SegmentPlan* segment)
+{
+    return !segment->is_lazy && (segment->is_anon || segment->file_buf || plan->parent);
+}
+
+// Files of --file-pages are mapped once for all chunks. Segment without file is copied wholly.
+static void PlanMapFiles (PagesPlan* plan)
+{
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
+    {
+        SegmentPlan* segment = plan->segments + i_segment;
+        if (!segment->file_name || segment->is_anon)
+            continue;
+
+        segment->file_buf = MapFile (segment->file_name, &segment->file_size, &segment->file_fd);
+        if (!segment->file_buf)
+        {
+            fprintf (stderr, "Warning: All pages of mapping of %s are written.\n", segment->file_name);
+            UnmapFile (NULL, 0, segment->file_fd);
+            segment->file_fd = -1;
+        }
+    }
+
+    return;
+}
+
+// Creates list of chunks for scanning. Runs of other segments are known without it.
+static int PlanScanChunks (PlanContext* plan_ctx)
+{
+    PagesPlan* plan = &plan_ctx->imgs->plan;
+    size_t n_chunks = 0;
+
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
+        if (IsScannedSegment (plan, plan->segments + i_segment))
+            n_chunks += GetAligned (plan->segments[i_segment].phdr->p_filesz / page_size, SCAN_CHUNK_PAGES) / SCAN_CHUNK_PAGES;
+
+    plan_ctx->chunks = (ScanChunk*) calloc (n_chunks + 1, sizeof (*plan_ctx->chunks));
+    if (!plan_ctx->chunks)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
+    {
+        SegmentPlan* segment = plan->segments + i_segment;
+        size_t n_pages = segment->phdr->p_filesz / page_size;
+
+        if (!IsScannedSegment (plan, segment))
+        {
+            segment->runs = (PagesRun*) calloc (1, sizeof (*segment->runs));
+            if (!segment->runs)
+            {
+                perror ("Can't allocate memory");
+                return -1;
+            }
+
+            segment->runs[0] = (PagesRun) {.first_page = 0, .n_pages = n_pages};
+            segment->n_runs = 1;
+            continue;
+        }
+
+        for (size_t first_page = 0; first_page < n_pages; first_page += SCAN_CHUNK_PAGES)
+        {
+            ScanChunk* chunk = plan_ctx->chunks + plan_ctx->n_chunks++;
+            chunk->i_segment  = i_segment;
+            chunk->first_page = first_page;
+            chunk->end_page   = (n_pages - first_page > SCAN_CHUNK_PAGES) ? first_page + SCAN_CHUNK_PAGES : n_pages;
+        }
+    }
+
+    return 0;
+}
+
+// Runs of new data are widened to borders of huge pages, zero pages inside them are written too.
+// Parent's pages, which get into widened run, are written as new data. Runs are rewritten in place: there are no more of them.
+static void AlignRunsToHugePages (SegmentPlan* segment)
+{
+    size_t huge = segment->huge_pages;
+    if (huge <= 1)
+        return;
+
+    size_t n_pages = segment->phdr->p_filesz / page_size;
+    size_t shift = (segment->phdr->p_vaddr / page_size) % huge; // segment can start inside of huge page
+    size_t n_runs = 0;
+
+    for (size_t i_run = 0; i_run < segment->n_runs; i_run++)
+    {
+        PagesRun run = segment->runs[i_run];
+        size_t run_end = run.first_page + run.n_pages;
+
+        if (!run.in_parent)
+        {
+            size_t first = (run.first_page + shift) / huge * huge;
+            run.first_page = (first > shift) ? first - shift : 0;
+            run_end = GetAligned (run_end + shift, huge) - shift;
+            run_end = (run_end < n_pages) ? run_end : n_pages;
+        }
+
+        // Widened run is joined with previous runs of the same kind or cuts runs of parent
+        while (n_runs)
+        {
+            PagesRun* last = segment->runs + n_runs - 1;
+            size_t last_end = last->first_page + last->n_pages;
+            if (last_end < run.first_page || (last_end == run.first_page && last->in_parent != run.in_parent))
+                break;
+
+            if (last->in_parent == run.in_parent)
+            {
+                run_end = (last_end > run_end) ? last_end : run_end;
+                run.first_page = last->first_page;
+                n_runs--;
+            }
+            else if (run.in_parent)
+            {
+                run.first_page = (last_end < run_end) ? last_end : run_end;
+                break;
+            }
+            else if (last->first_page >= run.first_page)
+                n_runs--;
+            else
+            {
+                last->n_pages = run.first_page - last->first_page;
+                break;
+            }
+        }
+
+        run.n_pages = run_end - run.first_page;
+        if (run.n_pages)
+            segment->runs[n_runs++] = run;
+    }
+
+    segment->n_runs = n_runs;
+    return;
+}
+
+// Joins runs found in chunks of each segment and gives them places in pages-1.img.
+static int PlanMergeRuns (PlanContext* plan_ctx)
+{
+    PagesPlan* plan = &plan_ctx->imgs->plan;
+    ScanChunk* chunk = plan_ctx->chunks;
+    ScanChunk* chunks_end = plan_ctx->chunks + plan_ctx->n_chunks;
+    size_t pages_offset = plan_ctx->imgs->pages_size;
+
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
+    {
+        SegmentPlan* segment = plan->segments + i_segment;
+
+        if (IsScannedSegment (plan, segment))
+        {
+            size_t n_runs = 0;
+            for (ScanChunk* now = chunk; now < chunks_end && now->i_segment == i_segment; now++)
+                n_runs += now->n_runs;
+
+            segment->runs = (PagesRun*) calloc (n_runs + 1, sizeof (*segment->runs));
+            if (!segment->runs)
+            {
+                perror ("Can't allocate memory");
+                return -1;
+            }
+
+            for (; chunk < chunks_end && chunk->i_segment == i_segment; chunk++)
+                for (size_t i_run = 0; i_run < chunk->n_runs; i_run++)
+                {
+                    PagesRun* last = segment->n_runs ? segment->runs + segment->n_runs - 1 : NULL;
+                    if (last && last->first_page + last->n_pages == chunk->runs[i_run].first_page &&
+                        last->in_parent == chunk->runs[i_run].in_parent)
+                        last->n_pages += chunk->runs[i_run].n_pages; // run is cut by border of chunks
+                    else
+                        segment->runs[segment->n_runs++] = chunk->runs[i_run];
+                }
+
+            AlignRunsToHugePages (segment);
+        }
+
+        for (size_t i_run = 0; i_run < segment->n_runs; i_run++)
+        {
+            if (segment->runs[i_run].in_parent || segment->is_lazy)
+                continue;
+
+            segment->runs[i_run].pages_offset = pages_offset;
+            pages_offset += segment->runs[i_run].n_pages * page_size;
+        }
+    }
+
+    return 0;
+}
+
+static int PlanWritePagemap (PlanContext* plan_ctx)
+{
+    PagesPlan* plan = &plan_ctx->imgs->plan;
+
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
+    {
+        SegmentPlan* segment = plan->segments + i_segment;
+
+        // Lazy pages are only marked, as criu dump --lazy-pages does without page server
+        for (size_t i_run = 0; i_run < segment->n_runs; i_run++)
+            if (WritePagemapEntry (plan_ctx->imgs, segment->phdr->p_vaddr + segment->runs[i_run].first_page * page_size, segment->runs[i_run].n_pages,
+                                   segment->is_lazy ? PE_LAZY : segment->runs[i_run].in_parent ? PE_PARENT : PE_PRESENT))
+                return -1;
+    }
 
-    #undef check
-    return elf_hdr;
+    return 0;
 }
 
-Elf_Phdr* CheckPhdrs (Elf* elf)
+// Big runs are cut to pieces, so threads have work of almost equal size.
+static int PlanCopyPieces (PlanContext* plan_ctx)
 {
-    assert (elf);
-    assert (elf->buf);
-    assert (elf->elf_hdr);
+    PagesPlan* plan = &plan_ctx->imgs->plan;
+    size_t n_pieces = 0;
 
-    elf->phnum = elf->elf_hdr->e_phnum;
-    elf->phdr_table = (Elf_Phdr*) (elf->buf + elf->elf_hdr->e_phoff);
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
+        for (size_t i_run = 0; i_run < plan->segments[i_segment].n_runs; i_run++)
+            if (!plan->segments[i_segment].runs[i_run].in_parent && !plan->segments[i_segment].is_lazy)
+                n_pieces += GetAligned (plan->segments[i_segment].runs[i_run].n_pages * page_size, COPY_CHUNK_SIZE) / COPY_CHUNK_SIZE;
+
+    plan_ctx->pieces = (CopyPiece*) calloc (n_pieces + 1, sizeof (*plan_ctx->pieces));
+    if (!plan_ctx->pieces)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
 
-    for (Elf_Half i_phdr; i_phdr < elf->phnum; i_phdr++)
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
     {
-        if (elf->phdr_table[i_phdr].p_type == PT_LOAD  && elf->phdr_table[i_phdr].p_filesz > elf->phdr_table[i_phdr].p_memsz)
+        SegmentPlan* segment = plan->segments + i_segment;
+
+        for (size_t i_run = 0; i_run < segment->n_runs; i_run++)
         {
-            fprintf (stderr, "Error: Bad program header number %d:\n"
-                             "p_memsz  = 0x%lX\n" 
-                             "p_filesz = 0x%lX\n"
-                             "p_memsz < p_filesz\n", 
-                             i_phdr, elf->phdr_table[i_phdr].p_memsz, elf->phdr_table[i_phdr].p_filesz);
-            elf->phdr_table = NULL;
-            elf->phnum = 0;
-            break;
+            PagesRun* run = segment->runs + i_run;
+            size_t run_size = (run->in_parent || segment->is_lazy) ? 0 : run->n_pages * page_size;
+
+            for (size_t done = 0; done < run_size; done += COPY_CHUNK_SIZE)
+            {
+                CopyPiece* piece = plan_ctx->pieces + plan_ctx->n_pieces++;
+                piece->src = segment->phdr->p_offset + run->first_page * page_size + done;
+                piece->dst = run->pages_offset + done;
+                piece->len = (run_size - done > COPY_CHUNK_SIZE) ? COPY_CHUNK_SIZE : run_size - done;
+                piece->is_scanned = IsScannedSegment (plan, segment);
+            }
         }
     }
 
-    return elf->phdr_table;
+    if (page_store && plan_ctx->n_pieces)
+    {
+        CopyPiece* last = plan_ctx->pieces + plan_ctx->n_pieces - 1;
+        return ReserveStoreKeys (plan_ctx->imgs, (last->dst + last->len) / page_size);
+    }
+
+    return 0;
 }
 
-void GoPhdrs (Elf* elf, Images* imgs)
+// With --direct pages image gets all its blocks at once, its size is known from pieces
+static int PlanPreallocate (PlanContext* plan_ctx)
 {
-    assert (elf);
-    size_t vma_counter = 0;
+    Images* imgs = plan_ctx->imgs;
+    if (imgs->pages_direct_fd == -1 || plan_ctx->n_pieces == 0)
+        return 0;
 
-    for (size_t i_phdr = 0; i_phdr < elf->phnum; i_phdr++)
-    {
-        switch (elf->phdr_table[i_phdr].p_type)
-        {
-            case PT_NOTE:
-                GoNhdrs (elf->buf + elf->phdr_table[i_phdr].p_offset, elf->phdr_table[i_phdr].p_filesz, imgs);
-                break;
+    CopyPiece* last = plan_ctx->pieces + plan_ctx->n_pieces - 1;
+    PreallocateFile (imgs->pages_fd, imgs->pages_size, last->dst + last->len - imgs->pages_size); // failure isn't fatal
+    return 0;
+}
 
-            case PT_LOAD:
-                if (GoLoadPhdr (elf, elf->phdr_table + i_phdr, imgs, vma_counter))
-                {
-                    return; // ToDo: Ban writing?
-                }
-                vma_counter++;
-                break;
+// With --uring one thread keeps URING_DEPTH reads and writes in flight, if io_uring is unavailable or fails,
+// pieces are copied synchronously by threads. Pagemap is written before copying, so order of completions doesn't matter.
+static int CopyPlanPieces (PlanContext* plan_ctx, size_t n_jobs)
+{
+    Images* imgs = plan_ctx->imgs;
+    if (!imgs->plan.uring || page_store || plan_ctx->n_pieces == 0)
+        return RunJobs (n_jobs, plan_ctx->n_pieces, CopyPieceJob, plan_ctx);
 
-            case PT_NULL:
-                break; // ?
+    Uring* ring = UringOpen (URING_DEPTH, URING_CHUNK_SIZE);
+    int fd_out = (imgs->pages_direct_fd != -1) ? imgs->pages_direct_fd : imgs->pages_fd;
+    int res = ring ? 0 : -1;
 
-            default:
-                fprintf (stderr, "Warning: I don't know, how to parse program header No %lu.\n", i_phdr);
-                break;
+    for (size_t i_piece = 0; i_piece < plan_ctx->n_pieces && res == 0; i_piece++)
+    {
+        CopyPiece* piece = plan_ctx->pieces + i_piece;
+        if ((res = UringCopy (ring, plan_ctx->elf->fd, piece->src, fd_out, piece->dst, piece->len)))
+            break;
+
+        // Piece is counted, when it's queued: progress is shown by the same steps as with threads
+        StatsAdd (COUNTER_PAGES_WRITTEN, piece->len);
+        if (!piece->is_scanned)
+        {
+            StatsAdd (COUNTER_CORE_READ, piece->len);
+            StatsProgress();
         }
+        plan_ctx->n_counted = i_piece + 1;
     }
+
+    if (ring && UringWait (ring))
+        res = -1;
+    UringClose (ring);
+
+    posix_fadvise (plan_ctx->elf->fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (res == 0)
+        return 0;
+
+    fprintf (stderr, "Warning: Pages aren't copied by io_uring, they are copied synchronously.\n");
+    return RunJobs (n_jobs, plan_ctx->n_pieces, CopyPieceJob, plan_ctx);
 }
 
-void GoNhdrs (void* nhdrs, Elf_Xword p_filesz, Images* imgs)
+int WritePagemapEntry (Images* imgs, uint64_t vaddr, size_t nr_pages, uint32_t flags)
 {
-    assert (nhdrs);
     assert (imgs);
-    size_t align = 0, common_align = 0;
 
-    while (common_align < p_filesz)
+    StatsAdd (COUNTER_PAGEMAP_ENTRIES, 1);
+    return ImageWriterPagemapEntry (imgs->pagemap, vaddr, nr_pages, flags);
+}
+
+// Pages of segment, which aren't in runs, are skipped by scanning
+static void CountPlanPages (const PagesPlan* plan)
+{
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
     {
-        Elf_Nhdr* nhdr_now = (Elf_Nhdr*)  nhdrs;
+        const SegmentPlan* segment = plan->segments + i_segment;
+        size_t n_needed = 0;
 
-        switch (nhdr_now->n_type)
+        for (size_t i_run = 0; i_run < segment->n_runs; i_run++)
         {
-            // ToDo: auto align and return err status
+            StatsAdd (segment->is_lazy ? COUNTER_PAGES_LAZY : segment->runs[i_run].in_parent ? COUNTER_PAGES_PARENT : COUNTER_PAGES_EMITTED,
+                      segment->runs[i_run].n_pages);
+            n_needed += segment->runs[i_run].n_pages;
+        }
 
-            case NT_PRPSINFO:
-                align = GoPrpsinfo (nhdr_now, imgs);
-                break;
-            
-            case NT_PRSTATUS:
-                align = GoPrstatus (nhdr_now, imgs);
-                break;
+        StatsAdd (segment->is_anon ? COUNTER_PAGES_ZERO : COUNTER_PAGES_FILE, segment->phdr->p_filesz / page_size - n_needed);
+    }
 
-            case NT_FPREGSET:
-                align = GoFpregset (nhdr_now, imgs);
-                break;
+    return;
+}
 
-            case NT_X86_XSTATE:
-                align = GoX86_State (nhdr_now, imgs);
-                break;
+int PagesPlanExecute (PagesPlan* plan, Elf* elf, Images* imgs)
+{
+    assert (plan);
+    assert (elf);
+    assert (imgs);
+    assert (plan == &imgs->plan);
 
-            case NT_SIGINFO:
-                align = GoSiginfo (nhdr_now, imgs);
-                break;
+    PlanMapFiles (plan);
 
-            case NT_AUXV:
-                align = GoAuxv (nhdr_now, imgs);
-                break;
+    if (elf->is_stream)
+        return PagesPlanExecuteStream (plan, elf, imgs);
 
-            case NT_FILE:
-                align = GoFile (nhdr_now, imgs);
-                break;
+    PlanContext plan_ctx = {.elf = elf, .imgs = imgs};
+    size_t n_jobs = plan->n_jobs ? plan->n_jobs : 1;
+    int res = -1;
 
-            default:
-                // ToDo: Give more debug info
-                fprintf (stderr, "Warning: I don't know, how to parse note header with type %u.\n"
-                                 "Is it gdb note header?\n", 
-                        (nhdr_now)->n_type);
-                align = sizeof (*nhdr_now) + GetAlignedSimple (nhdr_now->n_descsz) + GetAlignedSimple (nhdr_now->n_namesz);
-                break;
-        }
+    // Core is read once from the beginning to the end
+    posix_fadvise (elf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-        if (!align)
-            return;
-        nhdrs += align;
-        common_align += align;
+    if (PlanScanChunks (&plan_ctx) == 0                                                  &&
+        RunJobs (n_jobs, plan_ctx.n_chunks, ScanChunkJob, &plan_ctx) == 0                &&
+        PlanMergeRuns (&plan_ctx) == 0 && PlanWritePagemap (&plan_ctx) == 0              &&
+        PlanCopyPieces (&plan_ctx) == 0 && PlanPreallocate (&plan_ctx) == 0              &&
+        CopyPlanPieces (&plan_ctx, n_jobs) == 0)
+    {
+        for (size_t i_piece = 0; i_piece < plan_ctx.n_pieces; i_piece++)
+            imgs->pages_size += plan_ctx.pieces[i_piece].len;
+        CountPlanPages (plan);
+        res = 0;
     }
-    
-    return;
+
+    for (size_t i_chunk = 0; i_chunk < plan_ctx.n_chunks; i_chunk++)
+        free (plan_ctx.chunks[i_chunk].runs);
+    free (plan_ctx.chunks);
+    free (plan_ctx.pieces);
+    return res;
 }
 
-/*
-    For note functions:
-    Note = {Nhdr, name, desc}
+// Huge page in part of stream, its pages are skipped or written together
+typedef struct
+{
+    size_t start, end; // in buf
+    int is_skipped;
+} HugeSpan;
 
-    Name and desc have align = 4 or 8
-*/
+// Page isn't needed: zero page of anonymous memory or page of file mapping equal to file. In segment with huge pages
+// it's so, only if all pages of its huge page are such (huge page, which is cut by border of part, is checked in part).
+static int IsSkippedStreamPage (const SegmentPlan* segment, const char* buf, size_t part, size_t done, size_t page, HugeSpan* huge)
+{
+    #define is_skipped(page) (segment->is_anon  ? IsZeroPage (buf + (page), page_size) :                         \
+                              segment->file_buf ? IsFilePage (buf + (page), segment->file_buf, segment->file_size, \
+                                                              segment->file_offset + done + (page), page_size) : 0)
 
-// ToDo: Check name?
-// Note for offset: align of name = 4 or 8
-#define NHDR_START(type, name, is_array)  \
-            assert (nhdr);                                                                                     \
-            assert (imgs);                                                                                     \
-            assert (nhdr->n_type == type);                                                                     \
-                                                                                                               \
-            if (nhdr->n_descsz != sizeof (name##_t) && !is_array)                                              \
-                fprintf (stderr, "Error: Bad n_descsz in %s:\n"                                                \
-                                 "Expected: sizeof (" #name ") = %lu\n"                                        \
-                                 "Detected: %u\n", __func__, sizeof (name##_t), nhdr->n_descsz);               \
-                                                                                                               \
-            size_t offset = sizeof (*nhdr) + GetAlignedSimple (nhdr->n_namesz);                                \
-            name##_t* name = (name##_t*) (((void*) nhdr) + offset)
+    if (segment->huge_pages <= 1)
+        return is_skipped (page);
 
-// align of desc = 4
-#define NHDR_RETURN return offset + GetAlignedSimple (nhdr->n_descsz)
+    if (page < huge->start || page >= huge->end)
+    {
+        size_t huge_page_size = segment->huge_pages * page_size;
+        size_t in_huge = (segment->phdr->p_vaddr + done + page) % huge_page_size;
+
+        huge->start = (page > in_huge) ? page - in_huge : 0;
+        huge->end   = (part - page > huge_page_size - in_huge) ? page + huge_page_size - in_huge : part;
+        huge->is_skipped = 1;
+        for (size_t offset = huge->start; offset < huge->end && huge->is_skipped; offset += page_size)
+            huge->is_skipped = is_skipped (offset);
+    }
 
-size_t GoPrpsinfo (Elf_Nhdr* nhdr, Images* imgs)
-{
-    NHDR_START (NT_PRPSINFO, prpsinfo, 0);
+    #undef is_skipped
+    return huge->is_skipped;
+}
 
-    #define TASK_ALIVE 0x1
-    #define TASK_DEAD  0x2
-    #define TASK_STOPPED 0x3
+/*
+    Stream can't be read by threads or twice, so segments are processed one by one
+    in order of offsets. Pagemap entry is written when its run of non-zero pages is finished.
+*/
+int PagesPlanExecuteStream (PagesPlan* plan, Elf* elf, Images* imgs)
+{
+    assert (plan);
+    assert (elf);
+    assert (imgs);
 
-    /* switch (prpsinfo->pr_state)
+    // Aligned for O_DIRECT
+    char* buf = NULL;
+    if (posix_memalign ((void**) &buf, DIRECT_ALIGN, STREAM_CHUNK_SIZE))
     {
-        case 0:
-            imgs->core->tc->task_state = TASK_ALIVE;
-            break;
-        case 4:
-            imgs->core->tc->task_state = TASK_DEAD;
-            break;
-        case 3:
-            imgs->core->tc->task_state = TASK_STOPPED;
-            break;
-        default:
-            fprintf (stderr, "Warning: I don't know, what I must do with prpsinfo->pr_state = 0x%X\n",
-                             (uint32_t) (prpsinfo->pr_state));
-            break;
+        perror ("Can't allocate memory");
+        return -1;
     }
- */
-    imgs->core->thread_core->sched_prio = prpsinfo->pr_nice; // sched_prio not in thread_core?
-    imgs->core->tc->flags = prpsinfo->pr_flag;
-    imgs->core->thread_core->creds->uid = prpsinfo->pr_uid;
-    imgs->core->thread_core->creds->gid = prpsinfo->pr_gid;
-    imgs->pstree->pid  = prpsinfo->pr_pid;
-    imgs->pstree->ppid = 0; // error if prpsinfo->pr_ppid, criu in dumping writes 0 here.
-    imgs->pstree->pgid = prpsinfo->pr_pgrp;
-    imgs->pstree->sid  = prpsinfo->pr_sid;
 
-    // ToDo: This code was created only for one-thread program
-    if (imgs->pstree->n_threads == 1)
-        imgs->pstree->threads[0] = prpsinfo->pr_pid;
-    else
+    // Size of pages image isn't known before reading, so blocks are reserved for all segments and extra ones are freed at the end
+    size_t max_pages_size = imgs->pages_size;
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
+        max_pages_size += plan->segments[i_segment].phdr->p_filesz;
+    if (imgs->pages_direct_fd != -1)
+        PreallocateFile (imgs->pages_fd, imgs->pages_size, max_pages_size - imgs->pages_size); // failure isn't fatal
+
+    #define check_correct(cond, ...) if ((cond))                        \
+                                     {                                  \
+                                         fprintf (stderr, __VA_ARGS__); \
+                                         free (buf);                    \
+                                         return -1;                     \
+                                     }
+
+    // Run of non-zero pages, which isn't written to pagemap yet
+    uint64_t run_vaddr = 0;
+    size_t run_pages = 0;
+    uint32_t run_flags = PE_PRESENT;
+
+    #define flush_run() if (run_pages)                                                                              \
+                        {                                                                                           \
+                            check_correct (WritePagemapEntry (imgs, run_vaddr, run_pages, run_flags),              \
+                                           "Error: Can't write pagemap.\n")                                        \
+                            run_pages = 0;                                                                          \
+                        }
+
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
     {
-        fprintf (stderr, "Warning: number of threads in programs isn't equal.\n");
-        imgs->pstree->n_threads = 1; // I think that this action didn't affect to free()
-        imgs->pstree->threads[0] = prpsinfo->pr_pid; // but if threads == NULL?
-    }
+        SegmentPlan* segment = plan->segments + i_segment;
+        Elf_Phdr* phdr = segment->phdr;
+        check_correct (phdr->p_offset < elf->stream_pos, "Error: PT_LOAD segments aren't sorted by offset, "
+                                                         "coredump can't be read as stream.\n")
 
-    // prpsinfo->pr_psargs; // psarg - comand line's arguments. 
-    // They are contained in stack, working with psarg, as I think, useless.
+        // Skipped data: alignment and segments, that aren't needed in images
+        check_correct (SkipBytes (elf->fd, phdr->p_offset - elf->stream_pos), "Error: Can't read coredump.\n")
+        elf->stream_pos = phdr->p_offset;
 
-    // It's useless (because exec_names are equal) and dangerous (because pr_fname[16])
-    // free (imgs->core->tc->comm); 
-    // imgs->core->tc->comm = strdup (prpsinfo->pr_fname);
+        // Store needs data of pages, so they are read to buffer. Splice can't write with O_DIRECT.
+        if (!IsScannedSegment (plan, segment) && !page_store && imgs->pages_direct_fd == -1)
+        {
+            flush_run();
+            check_correct (WritePagemapEntry (imgs, phdr->p_vaddr, phdr->p_filesz / page_size, PE_PRESENT), "Error: Can't write pagemap.\n")
+            check_correct (SpliceToFile (elf->fd, imgs->pages_fd, imgs->pages_size, phdr->p_filesz), 
+                           "Error: Can't copy PT_LOAD segment to pages image.\n")
+
+            imgs->pages_size += phdr->p_filesz;
+            elf->stream_pos  += phdr->p_filesz;
+            StatsAdd (COUNTER_CORE_READ, phdr->p_filesz);
+            StatsAdd (COUNTER_PAGES_WRITTEN, phdr->p_filesz);
+            StatsAdd (COUNTER_PAGES_EMITTED, phdr->p_filesz / page_size);
+            StatsProgress();
+            continue;
+        }
 
-    #undef TASK_ALIVE
-    #undef TASK_DEAD
-    #undef TASK_STOPPED
-    NHDR_RETURN;
-}
+        for (size_t done = 0; done < phdr->p_filesz; )
+        {
+            size_t part = (phdr->p_filesz - done > STREAM_CHUNK_SIZE) ? STREAM_CHUNK_SIZE : phdr->p_filesz - done;
+            check_correct (ReadFull (elf->fd, buf, part), "Error: Can't read coredump.\n")
+            elf->stream_pos += part;
+            StatsAdd (COUNTER_CORE_READ, part);
+            StatsProgress();
+
+            HugeSpan huge = {};
+            #define is_skipped(page) IsSkippedStreamPage (segment, buf, part, done, page, &huge)
+            #define is_parent(page) IsParentPage (plan->parent, phdr->p_vaddr + done + (page), buf + (page))
+
+            for (size_t page = 0; page < part; )
+            {
+                if (is_skipped (page))
+                {
+                    flush_run();
+                    StatsAdd (segment->is_anon ? COUNTER_PAGES_ZERO : COUNTER_PAGES_FILE, 1);
+                    page += page_size;
+                    continue;
+                }
 
-size_t GoPrstatus (Elf_Nhdr* nhdr, Images* imgs)
-{
-    NHDR_START (NT_PRSTATUS, prstatus, 0);
+                int in_parent = is_parent (page);
+                size_t page_end = page + page_size;
+                while (page_end < part && !is_skipped (page_end) && is_parent (page_end) == in_parent)
+                    page_end += page_size;
 
-    // ToDo: Other platforms?
-    UserX86RegsEntry* regs = imgs->core->thread_info->gpregs;
+                // Pages of parent are only marked in pagemap
+                if (!in_parent)
+                {
+                    check_correct ((page_store && ReserveStoreKeys (imgs, (imgs->pages_size + page_end - page) / page_size)) ||
+                                   WritePagesData (imgs, buf + page, page_end - page, imgs->pages_size),
+                                   "Error: Can't write pages image: %s.\n", strerror (errno))
+                    imgs->pages_size += page_end - page;
+                    StatsAdd (COUNTER_PAGES_WRITTEN, page_end - page);
+                }
+                StatsAdd (in_parent ? COUNTER_PAGES_PARENT : COUNTER_PAGES_EMITTED, (page_end - page) / page_size);
 
-    // pr_reg <==> user_regs_struct, but haven't this type
-    regs->r15 = prstatus->pr_reg[0];
-    regs->r14 = prstatus->pr_reg[1];
-    regs->r13 = prstatus->pr_reg[2];
-    regs->r12 = prstatus->pr_reg[3];
-    regs->bp  = prstatus->pr_reg[4];
-    regs->bx  = prstatus->pr_reg[5];
-    regs->r11 = prstatus->pr_reg[6];
-    regs->r10 = prstatus->pr_reg[7];
-    regs->r9  = prstatus->pr_reg[8];
-    regs->r8  = prstatus->pr_reg[9];
-    regs->ax  = prstatus->pr_reg[10];
-    regs->cx  = prstatus->pr_reg[11];
-    regs->dx  = prstatus->pr_reg[12];
-    regs->si  = prstatus->pr_reg[13];
-    regs->di  = prstatus->pr_reg[14];
-    regs->orig_ax = prstatus->pr_reg[15];
-    regs->ip  = prstatus->pr_reg[16];
-    regs->cs  = prstatus->pr_reg[17];
-    regs->flags = prstatus->pr_reg[18];
-    regs->sp  = prstatus->pr_reg[19];
-    regs->ss  = prstatus->pr_reg[20];
-    regs->fs_base = prstatus->pr_reg[21];
-    regs->gs_base = prstatus->pr_reg[22];
-    regs->ds  = prstatus->pr_reg[23];
-    regs->es  = prstatus->pr_reg[24];
-    regs->fs  = prstatus->pr_reg[25];
-    regs->gs  = prstatus->pr_reg[26];
+                uint64_t vaddr = phdr->p_vaddr + done + page;
+                uint32_t flags = in_parent ? PE_PARENT : PE_PRESENT;
+                if (run_pages && (run_vaddr + run_pages * page_size != vaddr || run_flags != flags))
+                    flush_run();
+                if (!run_pages)
+                {
+                    run_vaddr = vaddr;
+                    run_flags = flags;
+                }
+                run_pages += (page_end - page) / page_size;
 
-    NHDR_RETURN;    
-}
+                page = page_end;
+            }
+            #undef is_parent
+            #undef is_skipped
 
-size_t GoFpregset (Elf_Nhdr* nhdr, Images* imgs)
-{
-    NHDR_START (NT_FPREGSET, elf_fpregset, 0);
+            done += part;
+        }
+    }
 
-    UserX86FpregsEntry* regs = imgs->core->thread_info->fpregs;
-    regs->cwd = elf_fpregset->cwd;
-    regs->swd = elf_fpregset->swd;
-    regs->twd = elf_fpregset->ftw;
-    regs->fop = elf_fpregset->fop;
-    regs->rip = elf_fpregset->rip;
-    regs->rdp = elf_fpregset->rdp;
-    regs->mxcsr = elf_fpregset->mxcsr;
-    regs->mxcsr_mask = elf_fpregset->mxcr_mask;
-    
-    if (sizeof (elf_fpregset->st_space) / sizeof (elf_fpregset->st_space[0]) != regs->n_st_space)
-        fprintf (stderr, "Warning: st_space in coredump isn't equal st_space in criu images.\n"
-                         "n_st_space [criu] = %zu\n"
-                         "sizeof (st_space) [coredump] = %zu\n", regs->n_st_space, sizeof (elf_fpregset->st_space));
-    memcpy (regs->st_space,  elf_fpregset->st_space,  regs->n_st_space);
+    flush_run();
+    check_correct (imgs->pages_direct_fd != -1 && ftruncate (imgs->pages_fd, imgs->pages_size),
+                   "Error: Can't truncate pages image: %s.\n", strerror (errno))
 
-    if (sizeof (elf_fpregset->xmm_space) / sizeof (elf_fpregset->xmm_space[0]) != regs->n_xmm_space)
-        fprintf (stderr, "Warning: xmm_space in coredump isn't equal xmm_space in criu images.\n"
-                         "n_xmm_space [criu] = %zu\n"
-                         "sizeof (xmm_space) [coredump] = %zu\n", regs->n_xmm_space, sizeof (elf_fpregset->xmm_space));
-    memcpy (regs->xmm_space, elf_fpregset->xmm_space, sizeof (elf_fpregset->xmm_space));
-    
-    NHDR_RETURN;
+    #undef flush_run
+    #undef check_correct
+    free (buf);
+    return 0;
 }
 
-size_t GoX86_State (Elf_Nhdr* nhdr, Images* imgs)
+void PagesPlanFree (PagesPlan* plan)
 {
-    NHDR_START (NT_X86_XSTATE, xsave, 0);
-    UserX86FpregsEntry* regs = imgs->core->thread_info->fpregs;
+    if (!plan)
+        return;
 
-    if (regs->xsave == NULL)
+    for (size_t i_segment = 0; i_segment < plan->n_segments; i_segment++)
     {
-        fprintf (stderr, "Warning: UserX86XsaveEntry doesn't exist yet. Creating it...\n");
-        regs->xsave = (UserX86XsaveEntry*) calloc (1, sizeof (*(regs->xsave)));
-        user_x86_xsave_entry__init (regs->xsave);
+        free (plan->segments[i_segment].runs);
+        UnmapFile (plan->segments[i_segment].file_buf, plan->segments[i_segment].file_size, plan->segments[i_segment].file_fd);
     }
-
-    // regs->xsave->xstate_bv = xsave->xsave_hdr.xstate_bv;
-    free (regs->xsave->ymmh_space);
-    regs->xsave->ymmh_space = (uint32_t*) calloc (1, sizeof (xsave->ymmh));
-    memcpy (regs->xsave->ymmh_space, &(xsave->ymmh), sizeof (xsave->ymmh));
-    regs->xsave->n_ymmh_space = sizeof (xsave->ymmh) / sizeof (regs->xsave->ymmh_space[0]);
-
-    // ToDo: Do I need do something another here?
-
-    NHDR_RETURN;
+    free (plan->segments);
+    ParentPagesDestructor (plan->parent);
+
+    size_t n_jobs = plan->n_jobs;
+    int file_pages = plan->file_pages;
+    int lazy = plan->lazy;
+    int uring = plan->uring;
+    *plan = (PagesPlan) {.n_jobs = n_jobs, .file_pages = file_pages, .lazy = lazy, .uring = uring};
+    return;
 }
 
-size_t GoSiginfo (Elf_Nhdr* nhdr, Images* imgs)
+// Parent directory is checked before converting, so donor's pages can be moved there after it
+int PrepareParentDirectory (const char* path, uint32_t pages_id)
 {
-    NHDR_START (NT_SIGINFO, siginfo, 0);
-    NHDR_RETURN;
-    static size_t new_pos = 0;
-    SignalQueueEntry* signals_s = imgs->core->tc->signals_s;
+    assert (path);
 
-    // ToDo: new_pos < n_signals after working program?
-    if (new_pos >= signals_s->n_signals)
+    char parent_path[MAX_PATH_LEN] = "";
+    snprintf (parent_path, MAX_PATH_LEN, "%s/" PARENT_DIR, path);
+    if (mkdir (parent_path, 0777) && errno != EEXIST)
     {
-        // fprintf (stderr, "Error: amount of siginfo_t structs >= n_signals. Maybe fix it in this program?\n");
-        // NHDR_RETURN;
+        fprintf (stderr, "Error: Can't create directory %s : %s.\n", parent_path, strerror (errno));
+        return -1;
+    }
+
+    // Pages of the previous run can't be replaced: old parent's pagemap points to them
+    char* filename = CreateImagePathWithPid (parent_path, "pages", pages_id);
+    int res = -1;
+    if (!filename)
+        ;
+    else if (access (filename, F_OK) == 0)
+        fprintf (stderr, "Error: Parent images already have %s.\n", filename);
+    else
+        res = 0;
+
+    free (filename);
+    return res;
+}
 
-        // ToDo: I'm not sure, but it can work
-        signals_s->n_signals++; // always imgs->core->tc->signals_s->n_signals + 1 > new_pos
-        signals_s->signals = realloc (signals_s->signals, signals_s->n_signals * sizeof (*signals_s->signals)); // realloc (NULL) = malloc
-        signals_s->signals[new_pos] = calloc (1, sizeof (*signals_s->signals[new_pos]));
-        siginfo_entry__init (signals_s->signals[new_pos]);
-    }
-    
-    signals_s->signals[new_pos]->siginfo.len = sizeof (*siginfo);
-    free (signals_s->signals[new_pos]->siginfo.data);
-    signals_s->signals[new_pos]->siginfo.data = calloc (1, sizeof (*siginfo));
-    memcpy (signals_s->signals[new_pos]->siginfo.data, siginfo, sizeof (*siginfo));
+// Donor's pages are kept for parent images, new pages-<id>.img of coredump is put instead of them
+int MoveDonorPagesToParent (const char* path, uint32_t pages_id)
+{
+    assert (path);
 
-    /*
-    I found it in criu/cr-restore.c
-        static int signal_to_mem(SiginfoEntry *se)
-        {
-            siginfo_t *info, *t;
+    if (PrepareParentDirectory (path, pages_id))
+        return -1;
 
-            info = (siginfo_t *)se->siginfo.data;
-            t = rst_mem_alloc(sizeof(siginfo_t), RM_PRIVATE);
-            if (!t)
-                return -1;
+    char parent_path[MAX_PATH_LEN] = "";
+    snprintf (parent_path, MAX_PATH_LEN, "%s/" PARENT_DIR, path);
 
-            memcpy(t, info, sizeof(*info));
+    char* old_filename = CreateImagePathWithPid (path, "pages", pages_id);
+    char* new_filename = CreateImagePathWithPid (parent_path, "pages", pages_id);
+    int res = -1;
 
-            return 0;
-        }
-    */
+    if (!old_filename || !new_filename)
+        ;
+    else if (rename (old_filename, new_filename))
+        fprintf (stderr, "Error: Can't move %s to parent images : %s.\n", old_filename, strerror (errno));
+    else
+        res = 0;
 
-    new_pos++;
-    NHDR_RETURN;
+    free (old_filename);
+    free (new_filename);
+    return res;
 }
 
-size_t GoAuxv (Elf_Nhdr* nhdr, Images* imgs)
+typedef struct
 {
-    NHDR_START (NT_AUXV, Elf_auxv, 1);
+    uint64_t donor_start, donor_end;
+    uint64_t core_start;
+} VmaShift;
 
-    if (nhdr->n_descsz % (2 * sizeof (*imgs->mm->mm_saved_auxv))) // ToDo: It's ok?
-        fprintf (stderr, "Warning: In my opinion, auxv in coredump is broken.\n");
+static int CompareVmaShifts (const void* a, const void* b)
+{
+    uint64_t start_a = ((const VmaShift*) a)->donor_start;
+    uint64_t start_b = ((const VmaShift*) b)->donor_start;
+    return (start_a > start_b) - (start_a < start_b);
+}
 
-    free (imgs->mm->mm_saved_auxv);
-    imgs->mm->mm_saved_auxv = (uint64_t*) calloc (1, nhdr->n_descsz);
-    memcpy (imgs->mm->mm_saved_auxv, Elf_auxv, nhdr->n_descsz);
-    imgs->mm->n_mm_saved_auxv = nhdr->n_descsz / sizeof (*imgs->mm->mm_saved_auxv);
+// Index of the first shift, which ends after vaddr
+static size_t FindVmaShift (const VmaShift* shifts, size_t n_shifts, uint64_t vaddr)
+{
+    size_t left = 0, right = n_shifts;
+    while (left < right)
+    {
+        size_t middle = left + (right - left) / 2;
+        if (shifts[middle].donor_end <= vaddr)
+            left = middle + 1;
+        else
+            right = middle;
+    }
 
-    NHDR_RETURN;
+    return left;
 }
 
-size_t GoFile (Elf_Nhdr* nhdr, Images* imgs) // ToDo: not working function
+static int IsPresentEntry (const PagemapEntry* entry)
 {
-    NHDR_START (NT_FILE, file, 1);
-    (void) file;
-    VmaEntry** vmas = imgs->mm->vmas;
+    // Old images have only in_parent
+    return entry->has_flags ? (entry->flags & PE_PRESENT) != 0 : !entry->in_parent;
+}
 
-    for (size_t i_vma = 0, i_file = 0; i_vma < imgs->mm->n_vmas; i_vma++)
+/*
+    Runs of parent are placed in order of donor's pages image. Pages of matched VMAs are shifted to addresses
+    of coredump, pages of donor's VMAs without pair are packed after previous run. If runs aren't sorted
+    after that (VMAs are placed in other order), donor's addresses are kept: criu can't read unsorted pagemap.
+*/
+static int FillParentRuns (ParentPages* parent, const Images* imgs, const VmaShift* shifts, size_t n_shifts)
+{
+    size_t pages_offset = 0;
+    parent->n_runs = 0;
+
+    for (size_t i_entry = 0; i_entry < imgs->n_donor_pagemap; i_entry++)
     {
-        if (vmas[i_vma]->shmid == 0) // isn't file
-            continue;
+        const PagemapEntry* entry = imgs->donor_pagemap[i_entry];
+        if (!IsPresentEntry (entry))
+            continue; // it hasn't data in pages image
 
-        // This printf shows full match between NT_FILE nhdr and vma with shmid != 0.
-        // But now I don't know how to use it because PT_LOAD phdrs contains all necessary information.
-        // printf ("shmid = %ld filename = %s [coredump] = %lX [criu] = %lX\n", 
-        //                                 vmas[i_vma]->shmid,
-        //                                 GetFilenameByNumInNTFile (file, i_file),
-        //                                 file->array[i_file].end - file->array[i_file].start,
-        //                                 vmas[i_vma]->end - vmas[i_vma]->start);
+        uint64_t end = entry->vaddr + (uint64_t) entry->nr_pages * page_size;
+        for (uint64_t vaddr = entry->vaddr; vaddr < end; )
+        {
+            ParentRun* last = parent->n_runs ? parent->runs + parent->n_runs - 1 : NULL;
+            uint64_t last_end = last ? last->vaddr + last->n_pages * page_size : 0;
+            size_t i_shift = FindVmaShift (shifts, n_shifts, vaddr);
+            uint64_t piece_end = end, new_vaddr = vaddr;
+
+            if (i_shift < n_shifts && shifts[i_shift].donor_start <= vaddr)
+            {
+                piece_end = (end < shifts[i_shift].donor_end) ? end : shifts[i_shift].donor_end;
+                new_vaddr = vaddr - shifts[i_shift].donor_start + shifts[i_shift].core_start;
+            }
+            else if (n_shifts)
+            {
+                if (i_shift < n_shifts && shifts[i_shift].donor_start < end)
+                    piece_end = shifts[i_shift].donor_start;
+                new_vaddr = last ? last_end : vaddr;
+            }
+
+            if (last && new_vaddr < last_end)
+                return -1;
 
-        i_file++;
+            parent->runs[parent->n_runs++] = (ParentRun) {.vaddr = new_vaddr, .n_pages = (piece_end - vaddr) / page_size,
+                                                          .pages_offset = pages_offset};
+            pages_offset += piece_end - vaddr;
+            vaddr = piece_end;
+        }
     }
 
-    /*  ToDo: this is incorrect function. Rewrite it.
-    if (imgs->mm->n_vmas != (size_t) file->count)
-    {
-        fprintf (stderr, "Error (FIXME): n_vmas != count in NT_FILE.\n");
-        return 0;
-    }
+    return 0;
+}
 
-    // ToDo: names? See coredump.py:583
-    // ToDo: Maybe do this more carefully?
-    for (int i_vma = 0; i_vma < file->count; i_vma++)
+ParentPages* ParentPagesConstructor (Images* imgs)
+{
+    assert (imgs);
+    assert (imgs->mm);
+
+    ParentPages* parent = (ParentPages*) calloc (1, sizeof (*parent));
+    VmaShift* shifts = (VmaShift*) calloc (imgs->mm->n_vmas + 1, sizeof (*shifts));
+    size_t n_shifts = 0;
+    if (parent)
+        parent->pages_fd = -1;
+
+    // Every donor's entry is cut by borders of VMAs: twice per matched VMA at most
+    if (parent && shifts)
+        parent->runs = (ParentRun*) calloc (imgs->n_donor_pagemap + 2 * imgs->mm->n_vmas + 1, sizeof (*parent->runs));
+
+    if (!parent || !shifts || !parent->runs)
     {
-        imgs->mm->vmas[i_vma]->start = file->array[i_vma].start;
-        imgs->mm->vmas[i_vma]->end   = file->array[i_vma].end;
-        imgs->mm->vmas[i_vma]->pgoff = file->array[i_vma].file_ofs * PAGESIZE;     
+        perror ("Can't allocate memory");
+        free (shifts);
+        ParentPagesDestructor (parent);
+        return NULL;
     }
-    */
 
-    NHDR_RETURN;
-}
+    for (size_t i_vma = 0; imgs->donor_vmas && i_vma < imgs->mm->n_vmas; i_vma++)
+        if (imgs->donor_vmas[i_vma])
+            shifts[n_shifts++] = (VmaShift) {.donor_start = imgs->donor_vmas[i_vma]->start, .donor_end = imgs->donor_vmas[i_vma]->end,
+                                             .core_start  = imgs->mm->vmas[i_vma]->start};
+    qsort (shifts, n_shifts, sizeof (*shifts), CompareVmaShifts);
 
-char* GetFilenameByNumInNTFile (file_t* file, size_t file_num) // ToDo: Very slow, if you use it in cycle
-{
-    assert (file);
+    int res = FillParentRuns (parent, imgs, shifts, n_shifts);
+    if (res)
+        res = FillParentRuns (parent, imgs, NULL, 0);
+    free (shifts);
 
-    char* str = (char*) file + sizeof (*file) + file->count * sizeof (file->array[0]);
-    for (size_t i_str = 0; i_str < file_num; i_str++)
-        str = str + strlen (str) +  1;
+    // Donor's pages are moved to parent only after writing, till then they are in place
+    char pages_path[MAX_PATH_LEN] = "";
+    snprintf (pages_path, MAX_PATH_LEN, "%s/pages-%u.img", imgs->images_path, imgs->pages_id);
 
-    return str;
-}
+    if (res)
+        fprintf (stderr, "Error: Donor's pagemap isn't sorted.\n");
+    else if (!(parent->pages = MapFile (pages_path, &parent->pages_size, &parent->pages_fd)))
+        res = -1;
 
-#undef NHDR_START
-#undef NHDR_RETURN
+    if (res)
+    {
+        ParentPagesDestructor (parent);
+        return NULL;
+    }
 
-int GoLoadPhdr (Elf* elf, Elf_Phdr* phdr, Images* imgs, size_t vma_counter) 
+    return parent;
+}
+
+int ParentPagesWrite (const ParentPages* parent, const char* path, int pid, uint32_t pages_id)
 {
-    assert (elf);
-    assert (phdr);
-    assert (imgs);
+    assert (parent);
+    assert (path);
 
-#define check_correct(cond, ...) if ((cond))                        \
-                                 {                                  \
-                                     fprintf (stderr, __VA_ARGS__); \
-                                     return -1;                     \
-                                 }
+    char parent_path[MAX_PATH_LEN] = "";
+    snprintf (parent_path, MAX_PATH_LEN, "%s/" PARENT_DIR, path);
 
+    char* pagemap_filename = CreateImagePathWithPid (parent_path, "pagemap", pid);
+    ImageWriter* writer = pagemap_filename ? ImageWriterOpen (pagemap_filename, MY_PAGEMAP_MAGIC) : NULL;
+    free (pagemap_filename);
+    if (!writer)
+        return -1;
 
-    check_correct (vma_counter >= imgs->mm->n_vmas, "Error: criu dump has less vmas than needed.\n")
-    check_correct (phdr->p_filesz % PAGESIZE, "Error: PT_LOAD phdr size isn't aligned.\n")
-    check_correct (phdr->p_memsz > phdr->p_filesz, "Error: In some program header memsz > filesz."
-                                                   "It means, that coredump isn't full and generated images is incorrect.\n")
+    PagemapHead head = PAGEMAP_HEAD__INIT;
+    head.pages_id = pages_id;
+    int res = ImageWriterMessage (writer, (MessagePacker*) pagemap_head__pack, &head, pagemap_head__get_packed_size (&head));
 
-    VmaEntry* vma = imgs->mm->vmas[vma_counter];
-    check_correct (phdr->p_filesz != vma->end - vma->start, "Error: vma and following phdr have different sizes. vma_counter = %zu\n", vma_counter)
+    for (size_t i_run = 0; i_run < parent->n_runs && !res; i_run++)
+        res = ImageWriterPagemapEntry (writer, parent->runs[i_run].vaddr, parent->runs[i_run].n_pages, PE_PRESENT);
 
-    MmChangeIfNeeded (imgs->mm, vma, phdr);
+    return (ImageWriterClose (writer) || res) ? -1 : 0;
+}
 
-    vma->start = phdr->p_vaddr;
-    vma->end   = phdr->p_vaddr + phdr->p_filesz;
-    // pgoff, shmid, prot, flags, status, flags, fd, fdflags --- I hope it's equal
+void ParentPagesDestructor (ParentPages* parent)
+{
+    if (!parent)
+        return;
 
-    // ToDo: criu writes: "Trying to restore page for non-private VMA", but this vma has flags: VMA_AREA_VSYSCALL | VMA_ANON_PRIVATE
-    // Maybe check !(vma->flags && VMA_AREA_REGULAR) ???
-    if (vma->status & VMA_AREA_VSYSCALL)
-        return 0;
+    UnmapFile (parent->pages, parent->pages_size, parent->pages_fd);
+    free (parent->runs);
+    free (parent);
+    return;
+}
 
-    PagemapEntry pagemap = PAGEMAP_ENTRY__INIT;
-    pagemap.vaddr = phdr->p_vaddr;
-    pagemap.nr_pages = phdr->p_filesz / PAGESIZE;
-    pagemap.has_flags = 1; // ToDo: Is it correct?
-    pagemap.flags = PE_PRESENT;
+VmaRole GetVmaRole (const MmEntry* mm, const VmaEntry* vma)
+{
+    assert (mm);
+    assert (vma);
 
-    WriteMessage ((MessagePacker*) pagemap_entry__pack, (ProtobufCMessage*) &pagemap, 
-                  pagemap_entry__get_packed_size (&pagemap), imgs->pagemap);
+    if (mm->mm_start_code == vma->start)
+        return VMA_ROLE_CODE;
+    if (mm->mm_start_data == vma->start)
+        return VMA_ROLE_DATA;
+    if (vma->flags & MAP_GROWSDOWN)
+        return VMA_ROLE_STACK;
+    if (vma->status & VMA_AREA_HEAP)
+        return VMA_ROLE_HEAP;
 
-    fwrite ((char*) elf->buf + phdr->p_offset, 1, phdr->p_filesz, imgs->pages);
-    #undef check_correct
-    return 0;
+    return VMA_ROLE_NONE;
 }
 
-void MmChangeIfNeeded (MmEntry* mm, VmaEntry* vma, Elf_Phdr* phdr)
+// vma is donor's VMA before changing, role is found for it before any change of mm
+void MmChangeIfNeeded (MmEntry* mm, const VmaEntry* vma, VmaRole role, Elf_Phdr* phdr)
 {
     assert (mm);
     assert (vma);
     assert (phdr);
 
-    if (mm->mm_start_code == vma->start)
-    {
-        mm->mm_start_code = phdr->p_vaddr;
-        mm->mm_end_code   = phdr->p_vaddr + phdr->p_filesz;
-        return;
-    }
+    uint64_t new_end = phdr->p_vaddr + phdr->p_memsz;
 
-    if (mm->mm_start_data == vma->start)
+    switch (role)
     {
-        mm->mm_start_data = phdr->p_vaddr;
-        mm->mm_end_data   = phdr->p_vaddr + phdr->p_filesz;
-        return;
-    }
+        case VMA_ROLE_CODE:
+            mm->mm_start_code = phdr->p_vaddr;
+            mm->mm_end_code   = new_end;
+            break;
 
-    if (vma->flags & MAP_GROWSDOWN)
-    {
-        mm->mm_start_stack = phdr->p_vaddr + mm->mm_start_stack - vma->start;
-        mm->mm_arg_start   = phdr->p_vaddr + mm->mm_arg_start   - vma->start;
-        mm->mm_arg_end     = phdr->p_vaddr + mm->mm_arg_end     - vma->start;
-        mm->mm_env_start   = phdr->p_vaddr + mm->mm_env_start   - vma->start;
-        mm->mm_env_end     = phdr->p_vaddr + mm->mm_env_end     - vma->start;
-        return;
-    }
+        case VMA_ROLE_DATA:
+            mm->mm_start_data = phdr->p_vaddr;
+            mm->mm_end_data   = new_end;
+            break;
 
-    if (vma->status & VMA_AREA_HEAP)
-    {
-        mm->mm_start_brk = phdr->p_vaddr;
-        mm->mm_brk       = phdr->p_vaddr + phdr->p_filesz;
-        return;
+        // Stack grows down, so args and env are kept at the same distance from its end
+        case VMA_ROLE_STACK:
+            mm->mm_start_stack = new_end - (vma->end - mm->mm_start_stack);
+            mm->mm_arg_start   = new_end - (vma->end - mm->mm_arg_start);
+            mm->mm_arg_end     = new_end - (vma->end - mm->mm_arg_end);
+            mm->mm_env_start   = new_end - (vma->end - mm->mm_env_start);
+            mm->mm_env_end     = new_end - (vma->end - mm->mm_env_end);
+            break;
+
+        case VMA_ROLE_HEAP:
+            mm->mm_start_brk = phdr->p_vaddr;
+            mm->mm_brk       = new_end;
+            break;
+
+        case VMA_ROLE_NONE:
+        default:
+            break;
     }
 
     return;
@@ -803,7 +4230,11 @@ FILE* StartImageReading (const char* filename, CriuMagic expected_magic)
 {
     assert (filename);
 
-    FILE* file = fopen (filename, "r");
+    // In batch mode donor's images are read from memory, output directory has only their copies
+    const char* basename = strrchr (filename, '/');
+    const DonorImage* cached = donor_template ? DonorTemplateFind (donor_template, basename ? basename + 1 : filename) : NULL;
+
+    FILE* file = cached ? fmemopen (cached->buf, cached->size, "r") : fopen (filename, "r");
     if (!file)
     {
         fprintf (stderr, "Can't open file %s\n", filename);
@@ -815,6 +4246,7 @@ FILE* StartImageReading (const char* filename, CriuMagic expected_magic)
     if (err != sizeof (magic) || !CompareMagic (magic, expected_magic))
     {
         fprintf (stderr, "Bad magic in file %s.\n", filename);
+        fclose (file);
         return NULL;
     }
 
@@ -823,7 +4255,7 @@ FILE* StartImageReading (const char* filename, CriuMagic expected_magic)
 
 // type of unpacker's return value == type of *unpacked_image
 // allocator for unpacker = default
-int ReadMessage (MessageUnpacker unpacker, ProtobufCMessage** unpacked_image, FILE* file) 
+int ReadMessage (MessageUnpacker unpacker, Arena* arena, ProtobufCMessage** unpacked_image, FILE* file) 
 {
     assert (unpacker);
     assert (unpacked_image);
@@ -851,12 +4283,16 @@ int ReadMessage (MessageUnpacker unpacker, ProtobufCMessage** unpacked_image, FI
         return -1;
     }
 
-    *unpacked_image = unpacker (NULL, (size_t) size, packed_data);
+    StatsAdd (COUNTER_IMAGES_READ, sizeof (size) + size);
+
+    // protobuf-c copies all data from packed message, so it isn't needed after unpacking
+    *unpacked_image = unpacker (arena ? &arena->allocator : NULL, (size_t) size, packed_data);
+    free (packed_data);
     return *unpacked_image ? 0 : -1;
 }
 
-int ReadOnlyOneMessage (const char* path, const char* name, int pid, 
-                        MessageUnpacker unpacker, ProtobufCMessage** unpacked_image, CriuMagic expected_magic)
+int ReadOnlyOneMessage (const char* path, const char* name, int pid, MessageUnpacker unpacker, Arena* arena,
+                        ProtobufCMessage** unpacked_image, CriuMagic expected_magic)
 {
     assert (path);
     assert (name);
@@ -869,61 +4305,261 @@ int ReadOnlyOneMessage (const char* path, const char* name, int pid,
 
     FILE* file = StartImageReading (filename, expected_magic);
     int res = 0;
+    free (filename);
 
     if (!file)
         return -1;
     else
-        res = ReadMessage (unpacker, unpacked_image, file);
+        res = ReadMessage (unpacker, arena, unpacked_image, file);
 
     fclose (file);
-    free   (filename);
     return res;
 }
 
-FILE* StartImageWriting (const char* filename, CriuMagic magic)
+// Messages of one type are read up to EOF, file isn't closed
+static int ReadMessagesToEnd (FILE* file, MessageUnpacker unpacker, Arena* arena, ProtobufCMessage*** unpacked_images, size_t* n_images)
 {
-    assert (filename);
+    ProtobufCMessage** images = NULL;
+    size_t n_read = 0, capacity = 0;
+    int res = 0;
+
+    // Array image is read up to EOF
+    for (int next_byte = 0; (next_byte = fgetc (file)) != EOF; n_read++)
+    {
+        ungetc (next_byte, file);
+
+        if (n_read == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 16;
+            ProtobufCMessage** new_images = (ProtobufCMessage**) realloc (images, capacity * sizeof (*new_images));
+            if (!new_images)
+            {
+                perror ("Can't allocate memory");
+                res = -1;
+                break;
+            }
+            images = new_images;
+        }
+
+        if ((res = ReadMessage (unpacker, arena, images + n_read, file)))
+            break;
+    }
+
+    if (res)
+    {
+        free (images);
+        return -1;
+    }
+
+    *unpacked_images = images;
+    *n_images = n_read;
+    return 0;
+}
+
+int ReadAllMessages (const char* path, const char* name, int pid, MessageUnpacker unpacker, Arena* arena,
+                     ProtobufCMessage*** unpacked_images, size_t* n_images, CriuMagic expected_magic)
+{
+    assert (path);
+    assert (name);
+    assert (unpacker);
+    assert (unpacked_images);
+    assert (n_images);
+
+    char* filename = (pid) ? CreateImagePathWithPid (path, name, pid) : CreateImagePath (path, name);
+    if (!filename)
+        return -1;
+
+    FILE* file = StartImageReading (filename, expected_magic);
+    free (filename);
+    if (!file)
+        return -1;
+
+    int res = ReadMessagesToEnd (file, unpacker, arena, unpacked_images, n_images);
+    fclose (file);
+    return res;
+}
+
+// Pagemap has head with other type before entries
+int ReadPagemap (const char* path, int pid, Arena* arena, PagemapHead** head, PagemapEntry*** entries, size_t* n_entries)
+{
+    assert (path);
+    assert (head);
+    assert (entries);
+    assert (n_entries);
+
+    char* filename = CreateImagePathWithPid (path, "pagemap", pid);
+    if (!filename)
+        return -1;
 
-    FILE* file = fopen (filename, "w");
+    FILE* file = StartImageReading (filename, MY_PAGEMAP_MAGIC);
+    free (filename);
     if (!file)
+        return -1;
+
+    int res = ReadMessage ((MessageUnpacker*) pagemap_head__unpack, arena, (ProtobufCMessage**) head, file);
+    if (!res)
+        res = ReadMessagesToEnd (file, (MessageUnpacker*) pagemap_entry__unpack, arena, (ProtobufCMessage***) entries, n_entries);
+
+    fclose (file);
+    return res;
+}
+
+ImageWriter* ImageWriterOpen (const char* filename, CriuMagic magic)
+{
+    assert (filename);
+
+    ImageWriter* writer = (ImageWriter*) calloc (1, sizeof (*writer));
+    if (!writer)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
+    }
+
+    writer->fd = RecreateFile (filename);
+    if (writer->fd == -1)
     {
         fprintf (stderr, "Can't open file %s\n", filename);
+        free (writer);
         return NULL;
     }
 
-    size_t err = fwrite (&magic, 1, sizeof (magic), file);
-    if (err != sizeof (magic))
+    // Magic is only first bytes in buffer
+    writer->capacity = IMAGE_WRITER_FLUSH_SIZE * 2;
+    writer->buf = (uint8_t*) malloc (writer->capacity);
+    if (!writer->buf)
     {
-        perror ("Write error");
-        fclose (file);
+        perror ("Can't allocate memory");
+        close (writer->fd);
+        free (writer);
         return NULL;
     }
 
-    return file;
+    memcpy (writer->buf, &magic, sizeof (magic));
+    writer->size = sizeof (magic);
+    return writer;
+}
+
+// Makes place for size bytes at the end of buffer
+static uint8_t* ImageWriterReserve (ImageWriter* writer, size_t size)
+{
+    if (writer->size + size > writer->capacity)
+    {
+        size_t new_capacity = 2 * (writer->size + size);
+        uint8_t* new_buf = (uint8_t*) realloc (writer->buf, new_capacity);
+        if (!new_buf)
+        {
+            perror ("Can't allocate memory");
+            writer->error = 1;
+            return NULL;
+        }
+
+        writer->buf = new_buf;
+        writer->capacity = new_capacity;
+    }
+
+    return writer->buf + writer->size;
 }
 
-int WriteMessage (MessagePacker packer, const ProtobufCMessage* unpacked_image, size_t packed_image_size, FILE* file)
+// Message is finished: it's time to flush, if buffer is big enough
+static int ImageWriterCommit (ImageWriter* writer, size_t size)
 {
+    writer->size += size;
+    return (writer->size >= IMAGE_WRITER_FLUSH_SIZE) ? ImageWriterFlush (writer) : 0;
+}
+
+int ImageWriterMessage (ImageWriter* writer, MessagePacker packer, const void* unpacked_image, size_t packed_image_size)
+{
+    assert (writer);
     assert (packer);
     assert (unpacked_image);
-    assert (file);
 
-    uint8_t* packed_image = (uint8_t*) calloc (1, packed_image_size);
-    if (!packed_image)
+    uint8_t* place = ImageWriterReserve (writer, sizeof (uint32_t) + packed_image_size);
+    if (!place)
+        return -1;
+
+    // 4 bytes of size, it's only criu images standart
+    uint32_t size = packed_image_size;
+    memcpy (place, &size, sizeof (size));
+    packer (unpacked_image, place + sizeof (size));
+
+    return ImageWriterCommit (writer, sizeof (size) + packed_image_size);
+}
+
+static inline uint8_t* PutVarint (uint8_t* place, uint64_t value)
+{
+    while (value >= 0x80)
     {
-        perror ("Can't allocate memory");
+        *place++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+
+    *place++ = (uint8_t) value;
+    return place;
+}
+
+// pagemap_entry is packed without protobuf-c, it's the same as pagemap_entry__pack with has_flags = 1
+int ImageWriterPagemapEntry (ImageWriter* writer, uint64_t vaddr, uint32_t nr_pages, uint32_t flags)
+{
+    assert (writer);
+
+    // size (4) + 3 tags (3) + vaddr (10) + nr_pages (5) + flags (5)
+    uint8_t* place = ImageWriterReserve (writer, 32);
+    if (!place)
         return -1;
+
+    uint8_t* msg = place + sizeof (uint32_t);
+    uint8_t* end = msg;
+
+    *end++ = (1 << 3) | 0; // vaddr,    field 1, varint
+    end = PutVarint (end, vaddr);
+    *end++ = (2 << 3) | 0; // nr_pages, field 2, varint
+    end = PutVarint (end, nr_pages);
+    *end++ = (4 << 3) | 0; // flags,    field 4, varint
+    end = PutVarint (end, flags);
+
+    uint32_t size = end - msg;
+    memcpy (place, &size, sizeof (size));
+
+    return ImageWriterCommit (writer, end - place);
+}
+
+int ImageWriterFlush (ImageWriter* writer)
+{
+    assert (writer);
+
+    for (size_t done = 0; done < writer->size && !writer->error; )
+    {
+        ssize_t n_written = write (writer->fd, writer->buf + done, writer->size - done);
+        if (n_written == -1 && errno == EINTR)
+            continue;
+
+        if (n_written <= 0)
+        {
+            perror ("Write error");
+            writer->error = 1;
+        }
+        else
+            done += n_written;
     }
 
-    packer (unpacked_image, packed_image);
-    size_t err = fwrite (&packed_image_size, 1, sizeof (uint32_t), file); // very bad place, but it's only criu images standart
-    err += fwrite (packed_image, 1, packed_image_size, file);
+    StatsAdd (COUNTER_IMAGES_WRITTEN, writer->size);
+    writer->size = 0;
+    return writer->error ? -1 : 0;
+}
+
+int ImageWriterClose (ImageWriter* writer)
+{
+    if (!writer)
+        return 0;
 
-    if (err != packed_image_size + sizeof (uint32_t))
-        perror ("Write error");
+    ImageWriterFlush (writer);
+    if (close (writer->fd))
+        writer->error = 1;
 
-    free (packed_image);
-    return err == packed_image_size + sizeof (uint32_t) ? 0 : -1;
+    int error = writer->error;
+    free (writer->buf);
+    free (writer);
+    return error ? -1 : 0;
 }
 
 int WriteOnlyOneMessage (const char* path, const char* name, int pid, 
@@ -938,27 +4574,48 @@ int WriteOnlyOneMessage (const char* path, const char* name, int pid,
     if (!filename)
         return -1;
 
-    FILE* file = StartImageWriting (filename, magic);
+    ImageWriter* writer = ImageWriterOpen (filename, magic);
     int res = 0;
+    free (filename);
 
-    if (!file)
+    if (!writer)
         return -1;
     else
-        res = WriteMessage (packer, unpacked_image, packed_image_size, file);
+        res = ImageWriterMessage (writer, packer, unpacked_image, packed_image_size);
 
-    fclose (file);
-    free   (filename);
-    return res;
+    return (ImageWriterClose (writer) || res) ? -1 : 0;
 }
 
 void PrintUsage (void)
 {
     printf (     "Usage:"
-            "\n" "    criu-necromancer -c <FILE> -i <PATH> [-h]"
+            "\n" "    criu-necromancer -c <FILE> [-c <FILE>...] -i <PATH> [-j <N>] [-p <PID>] [-b <DIR> | -o <DIR>] [-f] [-P] [-S <DIR> [-M | -R]] [-D] [-U] [-L] [--stats[=<FILE>]] [--check] [-h]"
             "\n"
             "\n" "Options:"
-            "\n" "    -c <FILE>, --coredump <FILE>   # path to file with ELF coredump"
+            "\n" "    -c <FILE>, --coredump <FILE>   # path to file with ELF coredump, \"-\" for stdin;"
+            "\n" "                                   # several coredumps (or directory) of one process tree are allowed"
             "\n" "    -i <PATH>, --images   <PATH>   # path to directory with donor's CRIU images"
+            "\n" "    -j <N>,    --jobs     <N>      # number of threads for copying of pages (default: 1)"
+            "\n" "    -p <PID>,  --pid      <PID>    # pid of dead process, if it differs from coredump (%%p in core_pattern)"
+            "\n" "    -b <DIR>,  --batch    <DIR>    # convert every coredump separately against one donor,"
+            "\n" "                                   # images are written to DIR/<name of coredump>/, donor isn't changed"
+            "\n" "    -o <DIR>,  --output   <DIR>    # write images to DIR, other donor's files are cloned there, donor isn't changed"
+            "\n" "    -C <FILE>, --catalog  <FILE>   # catalog of donors: add donor (-i or -a) or find donor for coredumps (-l)"
+            "\n" "    -a <PATH>, --add-donor <PATH>  # add donor's images to catalog"
+            "\n" "    -l,        --lookup            # print the best donor from catalog for every coredump"
+            "\n" "    -f,        --file-pages        # don't write pages of private file mappings, which are equal to file"
+            "\n" "    -P,        --parent            # write pages equal to donor's ones as in_parent, donor's pages are moved to parent/"
+            "\n" "    -S <DIR>,  --store    <DIR>    # write pages to content-addressed store, images get pages-<id>.manifest"
+            "\n" "    -M,        --materialize       # rebuild pages images of -i directory from store"
+            "\n" "    -R,        --release           # remove manifests of -i directory, their pages aren't referenced in store"
+            "\n" "    -D,        --direct            # preallocate pages image and write it with O_DIRECT, past page cache"
+            "\n" "    -U,        --uring             # copy pages by io_uring from one thread with many requests in flight"
+            "\n" "    -L,        --lazy-pages        # don't copy anonymous memory, give it to criu restore --lazy-pages on demand:"
+            "\n" "                                   # necromancer waits on <images>/lazy-pages.socket until processes exit"
+            "\n" "               --stats[=<FILE>]    # write statistics as JSON to stdout or FILE: time of phases, bytes, pages, peak RSS;"
+            "\n" "                                   # progress is shown on terminal"
+            "\n" "               --check             # check donor against coredumps and estimate images without writing:"
+            "\n" "                                   # JSON on stdout, exit code 1 if donor doesn't fit"
             "\n" "    -h, --help                     # get this help" 
             "\n");
 }
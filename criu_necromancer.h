@@ -7,6 +7,13 @@
 #include <stdio.h>
 #include "user.h"
 #include "file.h"
+#include "decompress.h"
+#include "arena.h"
+#include "donor.h"
+#include "catalog.h"
+#include "store.h"
+#include "lazy.h"
+#include "uring.h"
 
 #ifdef MODE32
 
@@ -71,19 +78,132 @@
 typedef struct
 {
     // Placed on argv
-    const char* elf;
+    char** elfs; // coredumps of processes from one tree (files of directory are expanded)
+    size_t n_elfs;
     const char* criu_dump_path;
-
-    // Given from pstree
-    int criu_dump_id;
+    size_t n_jobs;
+    int pid; // from kernel (%p in core_pattern), 0 if pid from coredump is used
+    const char* batch_path; // every coredump is converted separately to its subdirectory here
+    const char* output_path; // images are written here instead of donor's directory
+    int file_pages;         // pages equal to mapped file aren't written, criu takes them from file
+    int parent;             // pages equal to donor's pages are in_parent, donor's pages are moved to parent/
+    const char* store_path; // pages are written to content-addressed store, images get manifest instead of them
+    int materialize;        // pages images are rebuilt from manifests and store
+    int release;            // manifests are removed, their pages aren't referenced in store
+    int direct;             // pages image is preallocated and written with O_DIRECT, past page cache
+    int stats;              // statistics of converting are written as JSON
+    const char* stats_path; // file for statistics, stdout if NULL
+    int lazy_pages;         // anonymous memory isn't copied, it's given to criu restore --lazy-pages from coredump
+    int check;              // only headers, notes and donor's images are read and checked, nothing is written
+    int uring;              // pages are copied by io_uring from one thread, synchronous copying is fallback
+
+    // Catalog of donors: adding of donor or looking for the best donor for coredumps
+    const char* catalog_path;
+    const char* add_donor_path;
+    int lookup;
 } ArgInfo;
 
+/*
+    VMAs of donor and PT_LOAD segments of coredump are matched by keys, not by position:
+    mappings of files by name, offset and prot, other mappings by their class and prot in order of addresses,
+    private anonymous ones by size too. Shared anonymous memory, SysV shm, AIO rings and mappings of sockets
+    can't be told from coredump, so donor's VMAs of these classes are never paired.
+    mm->vmas is rebuilt after that: one VMA per PT_LOAD, so extra guard page or dlopen'ed library isn't fatal.
+*/
+
+typedef enum
+{
+    VMA_CLASS_FILE,
+    VMA_CLASS_ANON,
+    VMA_CLASS_HEAP,
+    VMA_CLASS_STACK,
+    VMA_CLASS_VDSO,
+    VMA_CLASS_VVAR,
+    VMA_CLASS_VSYSCALL,
+    VMA_CLASS_ANON_SHARED, // only in donor
+    VMA_CLASS_SYSVIPC,     // only in donor
+    VMA_CLASS_AIORING,     // only in donor
+    VMA_CLASS_SOCKET       // only in donor
+} VmaClass;
+
+// What mm fields point to this VMA. It's found once, before mm is changed.
+typedef enum
+{
+    VMA_ROLE_NONE,
+    VMA_ROLE_CODE,
+    VMA_ROLE_DATA,
+    VMA_ROLE_STACK,
+    VMA_ROLE_HEAP
+} VmaRole;
+
+typedef struct
+{
+    VmaClass vma_class;
+    const char* name; // for VMA_CLASS_FILE
+    uint64_t pgoff;   // in bytes
+    uint32_t prot;
+    uint64_t start;
+    uint64_t size;    // compared for VMA_CLASS_ANON only: heap and stack grow
+    size_t index;     // in donor's mm->vmas or in PT_LOADs of coredump
+} VmaKey;
+
+const size_t NO_VMA = (size_t) -1;
+
+/*
+    Notes of one thread. Kernel writes NT_PRSTATUS at first, then other notes of this thread
+    (for the first thread notes of the whole process are placed between them).
+*/
+
 typedef struct
 {
-    char* buf;
+    uint32_t tid; // pr_pid in NT_PRSTATUS
+    Elf_Nhdr* prstatus;
+    Elf_Nhdr* fpregset;
+    Elf_Nhdr* xstate;
+} ThreadNotes;
+
+// NT_FILE as arrays: file names[i] is mapped to [start[i], end[i]) from offset pgoff[i] (in bytes).
+// Kernel writes mappings in order of addresses.
+typedef struct
+{
+    size_t count;
+    uint64_t* start;
+    uint64_t* end;
+    uint64_t* pgoff;
+    const char** names; // placed in note
+    size_t page_size;   // pagesize of NT_FILE, 0 without it
+} FileTable;
+
+typedef enum
+{
+    NOTE_PRPSINFO,
+    NOTE_SIGINFO,
+    NOTE_AUXV,
+    NOTE_FILE,
+    N_PROCESS_NOTES
+} ProcessNote;
+
+// Notes are parsed once, when coredump is opened. After that every stage gets them without searching.
+typedef struct
+{
+    Elf_Nhdr* process[N_PROCESS_NOTES];
+    ThreadNotes* threads;
+    size_t n_threads, threads_capacity;
+    FileTable files;
+} NoteIndex;
+
+typedef struct
+{
+    char* buf; // read-only mapping of coredump or, for stream, only headers and notes
+    size_t size;
+    int fd;
+    int is_stream;     // coredump is read from pipe in one forward pass
+    size_t stream_pos; // bytes read from stream
+    Decompressor* decompressor; // for compressed coredump, fd is pipe with decompressed data
     Elf_Ehdr* elf_hdr; // usually == buf
     Elf_Phdr* phdr_table;
     Elf_Half phnum;
+    NoteIndex notes;
 } Elf;
 
 /*
@@ -119,12 +239,119 @@ typedef struct
     // ToDo: pstree and pagemap work with array?
 */
 
+/*
+    Writer of protobuf images. Messages are packed into one growable buffer,
+    which is written to file by big parts, so there is no allocation and syscall per message.
+*/
+
 typedef struct
 {
-    PstreeEntry* pstree;
+    int fd;
+    uint8_t* buf;
+    size_t size, capacity;
+    int error;
+} ImageWriter;
+
+/*
+    Page data is written in two passes. At first, while phdrs are parsed, PT_LOAD segments
+    are only collected to plan. After that all offsets in pages-1.img are known (after scanning
+    for zero pages), pagemap is written in vaddr order and page data is copied by worker threads.
+*/
+
+/*
+    Parent images (--parent): donor's pages image is moved to parent/ directory, its pagemap is rewritten there
+    in addresses of coredump (shifted by pairs of matched VMAs). Page of coredump, which is equal to page of parent
+    at the same address, is written to pagemap as in_parent without data: criu takes it from parent while restoring.
+*/
+
+typedef struct
+{
+    uint64_t vaddr;      // in addresses of coredump
+    size_t n_pages;
+    size_t pages_offset; // in parent's pages image
+} ParentRun;
+
+typedef struct
+{
+    ParentRun* runs; // sorted by vaddr, don't overlap (criu reads parent's pagemap sequentially)
+    size_t n_runs;
+    char* pages;     // mapping of parent's pages image
+    size_t pages_size;
+    int pages_fd;
+} ParentPages;
+
+typedef struct
+{
+    size_t first_page, n_pages; // in segment
+    size_t pages_offset;        // in pages-1.img
+    int in_parent;              // pages are equal to pages of parent images, they aren't copied
+} PagesRun;
+
+typedef struct
+{
+    Elf_Phdr* phdr;
+    int is_anon; // zero pages can be skipped
+    int is_lazy; // --lazy-pages: pages aren't copied, pagemap has one PE_LAZY entry for the whole segment
+    size_t huge_pages; // pages in huge page (hugetlb or MADV_HUGEPAGE), runs are widened to whole huge pages, 0 without it
+
+    // Private mapping of file (--file-pages): pages equal to file are taken by criu from file
+    const char* file_name; // from NT_FILE, NULL if all pages are needed
+    uint64_t file_offset;  // of segment's start in file
+    char* file_buf;        // file is mapped by PlanMapFiles
+    size_t file_size;
+    int file_fd;
+
+    PagesRun* runs;
+    size_t n_runs;
+} SegmentPlan;
+
+typedef struct
+{
+    SegmentPlan* segments;
+    size_t n_segments, capacity;
+    size_t n_jobs;
+    int file_pages; // skip pages of private file mappings, which are equal to file
+    int lazy;       // anonymous private segments are restored lazily (not for stream)
+    int uring;      // pieces are copied by io_uring (not for stream and store)
+    ParentPages* parent; // NULL without --parent
+} PagesPlan;
+
+typedef struct
+{
+    Arena* arena; // all unpacked images are allocated here
+    PstreeEntry* pstree; // entry of process in ProcessTree
+    int donor_pid;       // pid of this entry in donor's images
+    uint32_t pages_id;   // pages-<pages_id>.img
     CoreEntry* core;
     MmEntry* mm;
-    FILE *pagemap, *pages;
+    ImageWriter* pagemap;
+    int pages_fd; // pages are copied by file ranges, so it isn't FILE*
+    int pages_direct_fd; // --direct: the same file opened with O_DIRECT, -1 without it
+    size_t pages_size;
+    PagesPlan plan;
+
+    const NoteIndex* notes;   // of coredump, it's converted now
+    FileEntry** files;        // donor's files.img, names of mapped files are taken from here
+    size_t n_files;
+    CoreEntry** thread_cores; // core-tid.img for notes->threads[i]
+    VmaEntry** donor_vmas;    // donor's VMA for mm->vmas[i], NULL if VMA has no pair in donor
+
+    // --parent: donor's pagemap is read before it's rewritten, its pages are moved to parent only after writing of new images
+    PagemapEntry** donor_pagemap;
+    size_t n_donor_pagemap;
+    int pages_failed; // pages of coredump aren't written completely
+
+    // --store: keys of pages in order of pages image, they are written to manifest
+    uint64_t* store_keys; // 0 for page, which isn't added
+    size_t store_keys_capacity;
+    int is_manifest_written; // else references of store_keys are released by destructor
+
+    // Packed core of donor's thread (or main core without task parts), cores of threads are unpacked from it
+    uint8_t* thread_template;
+    size_t thread_template_size;
+    int template_is_thread;
+
+    const char* images_path; // where images are written
     // PagemapEntry* pagemap; // pagemap[0] = pages_id; pages-id.img - raw data
     // FileEntry* files;
 
@@ -132,6 +359,35 @@ typedef struct
 } Images; 
 // ToDo: I don't like this struct and working with it. It's look like big copypaste.
 
+/*
+    Several coredumps of one process tree (supervisor with workers, for example) are converted together.
+    Each coredump is matched to one entry of donor's pstree by relations of processes
+    (parent, group and session leaders), because pids in donor and coredumps are different.
+*/
+
+typedef struct
+{
+    const char* elf_path;
+    Elf* elf;
+    Images* imgs;
+    prpsinfo_t prpsinfo;    // copy of NT_PRPSINFO: pid, ppid, pgrp and sid of dead process
+    size_t parent;          // index of parent's coredump, NO_PROCESS if parent isn't dumped
+    size_t n_children;
+    PstreeEntry* donor;     // matched entry of donor's pstree
+    size_t n_jobs;          // threads for converting of this process
+} Process;
+
+typedef struct
+{
+    Arena* arena; // donor's pstree
+    PstreeEntry** entries;
+    size_t n_entries;
+    int* donor_pids; // donor_pids[i] - pid of entries[i] before converting
+    Process* processes;
+    size_t n_processes;
+    ArgInfo* args;
+} ProcessTree;
+
 typedef ProtobufCMessage*  MessageUnpacker (ProtobufCAllocator*, size_t, const uint8_t*); // ToDo: maybe void -> ProtobufCMessage?
 typedef size_t MessagePacker (const void*, uint8_t*);
 typedef struct
@@ -152,11 +408,38 @@ static inline int CompareMagic (CriuMagic a, CriuMagic b) {return a.magic0 == b.
 const size_t SIZEOF_P_IMAGE_HDR = sizeof (uint32_t) * 3; // not including pb_msg
 const ArgInfo EMPTY_ARGINFO = {};
 const Images  EMPTY_IMAGES  = {};
-const size_t PAGESIZE = 4096;
-
+const size_t NO_PROCESS = (size_t) -1;
+const size_t PAGESIZE = 4096;       // of generated coredumps and if kernel doesn't tell its page size
+const size_t HUGE_PAGE_SIZE = 2 << 20; // THP of x86-64 and hugetlb without size in flags of VMA
+const size_t SCAN_CHUNK_PAGES = 16384; // 64 MiB, zero pages are searched by such parts in parallel
+const size_t COPY_CHUNK_SIZE  = 64 << 20;
+const size_t URING_DEPTH = 32;            // chunks in flight with --uring
+const size_t URING_CHUNK_SIZE = 1 << 20;
+const size_t STREAM_CHUNK_SIZE = 8 << 20;
+const size_t MAX_STREAM_HEADERS_SIZE = 1 << 30; // phdrs and notes are kept in memory
+const size_t IMAGE_WRITER_FLUSH_SIZE = 1 << 20;
+const size_t CHECK_SAMPLES = 256; // pages of anonymous memory, which are read by --check to estimate zero pages
+
+#define PE_PARENT  (1 << 0) // copypasted from criu/include/pagemap.h
+#define PE_LAZY    (1 << 1) // copypasted from criu/include/pagemap.h
 #define PE_PRESENT (1 << 2) // copypasted from criu/include/pagemap.h
+#define PARENT_DIR "parent" // criu/include/image.h: CR_PARENT_LINK
+#define MANIFEST_SUFFIX ".manifest" // pages-<id>.manifest replaces pages-<id>.img, if pages are in store
+#define VMA_AREA_REGULAR  (1 << 0) // copypasted from criu/include/image.h
+#define VMA_AREA_STACK    (1 << 1) // copypasted from criu/include/image.h
 #define VMA_AREA_VSYSCALL (1 << 2) // copypasted from criu/include/image.h
+#define VMA_AREA_VDSO     (1 << 3) // copypasted from criu/include/image.h
 #define VMA_AREA_HEAP (1 << 5) // copypasted from criu/include/image.h
+#define VMA_FILE_PRIVATE  (1 << 6) // copypasted from criu/include/image.h
+#define VMA_FILE_SHARED   (1 << 7) // copypasted from criu/include/image.h
+#define VMA_ANON_SHARED  (1 << 8) // copypasted from criu/include/image.h
+#define VMA_ANON_PRIVATE (1 << 9) // copypasted from criu/include/image.h
+#define VMA_AREA_SYSVIPC  (1 << 10) // copypasted from criu/include/image.h
+#define VMA_AREA_SOCKET   (1 << 11) // copypasted from criu/include/image.h
+#define VMA_AREA_VVAR     (1 << 12) // copypasted from criu/include/image.h
+#define VMA_AREA_AIORING  (1 << 13) // copypasted from criu/include/image.h
+
+#define VSYSCALL_ADDR 0xffffffffff600000UL
 
 #define MAX_PATH_LEN 1024
 
@@ -166,23 +449,58 @@ int ParseArguments (int argc, char** argv, ArgInfo* args);
 char* CreateImagePath           (const char* path, const char* name);
 char* CreateImagePathWithPid (const char* path, const char* name, int pid);
 
+int AddCoredumpArgument (ArgInfo* args, const char* path);
 void ArgInfoFree (ArgInfo* args);
 
-Images* ImagesConstructor (ArgInfo* args);
+ProcessTree* ProcessTreeConstructor (ArgInfo* args);
+prpsinfo_t* FindPrpsinfo (Elf* elf);
+int MatchProcesses (ProcessTree* tree);
+int ProcessTreeConvert (ProcessTree* tree);
+int ProcessTreeWrite (ProcessTree* tree);
+void ProcessTreeDestructor (ProcessTree* tree);
+
+int BatchConvert (ArgInfo* args);
+int OutputConvert (ArgInfo* args);
+int ServeLazyPages (ProcessTree* tree);
+int CheckCommand (ArgInfo* args);
+
+int CatalogCommand (ArgInfo* args);
+int StoreCommand (ArgInfo* args);
+int WriteManifest (Images* imgs, const char* path);
+int GetDonorLayout (const char* path, LayoutItem** layout, size_t* n_layout, char* build_id);
+int GetCoreLayout (Elf* elf, LayoutItem** layout, size_t* n_layout, char* build_id);
+int GetCoreBuildId (Elf* elf, char* build_id);
+const char* GetCoreMemory (Elf* elf, uint64_t vaddr, size_t size);
+
+Images* ImagesConstructor (ArgInfo* args, PstreeEntry* pstree, size_t n_jobs);
 void ImagesDestructor (Images* imgs);
 
-void ChangeImagePid (const char* path, const char* name, int old_pid, int new_pid);
-void ImagesWrite (Images* imgs, ArgInfo* args);
+int MoveImage (const char* path, const char* old_name, int old_pid, const char* new_name, int new_pid);
+int ChangeImagePid (const char* path, const char* name, int old_pid, int new_pid);
+int ImagesWrite (Images* imgs, ArgInfo* args);
+void ChangeProcessPid (Images* imgs, int pid);
 
-Elf* ElfConstructor (const char* filename);
+Elf* ElfConstructor (const char* filename, size_t n_jobs);
+Elf* ElfStreamConstructor (int fd, size_t n_jobs);
+int ElfStreamReadUpTo (Elf* elf, size_t new_size);
 void ElfDestructor (Elf* elf);
 
-Elf_Ehdr* CheckElfHdr (const char* buf);
+Elf_Ehdr* CheckElfHdr (const char* buf, size_t size);
 Elf_Phdr* CheckPhdrs (Elf* elf);
 
-void GoPhdrs (Elf* elf, Images* imgs);
+int PlanPhdrs (Elf* elf, Images* imgs);
+int GoPhdrs (Elf* elf, Images* imgs);
+
+int NoteIndexBuild (Elf* elf);
+void NoteIndexFree (NoteIndex* notes);
+int FileTableBuild (FileTable* files, Elf_Nhdr* nhdr);
+long FileTableFind (const FileTable* files, uint64_t addr);
 
-void GoNhdrs (void* nhdrs, Elf_Xword p_filesz, Images* imgs);
+void GoNotes (Elf* elf, Images* imgs);
+
+int CreateThreadTemplate (Images* imgs, ArgInfo* args);
+ThreadNotes* AddThread (NoteIndex* notes, Elf_Nhdr* prstatus);
+int ConvertThreads (Images* imgs);
 
 // ToDo: Mini documentation
 /*
@@ -197,29 +515,58 @@ static inline size_t GetAligned (size_t value, size_t align)
 }
 #define GetAlignedSimple(value) GetAligned (value, sizeof (value))
 
+static inline void* GetNoteDesc (Elf_Nhdr* nhdr)
+{
+    return (char*) nhdr + sizeof (*nhdr) + GetAlignedSimple (nhdr->n_namesz);
+}
+
+static inline size_t GetNoteSize (Elf_Nhdr* nhdr)
+{
+    return sizeof (*nhdr) + GetAlignedSimple (nhdr->n_descsz) + GetAlignedSimple (nhdr->n_namesz);
+}
+
 size_t GoPrpsinfo  (Elf_Nhdr* nhdr, Images* imgs);
-size_t GoPrstatus  (Elf_Nhdr* nhdr, Images* imgs);
-size_t GoFpregset  (Elf_Nhdr* nhdr, Images* imgs);
-size_t GoX86_State (Elf_Nhdr* nhdr, Images* imgs);
+size_t GoPrstatus  (Elf_Nhdr* nhdr, Images* imgs, CoreEntry* core);
+size_t GoFpregset  (Elf_Nhdr* nhdr, Images* imgs, CoreEntry* core);
+size_t GoX86_State (Elf_Nhdr* nhdr, Images* imgs, CoreEntry* core);
 size_t GoSiginfo   (Elf_Nhdr* nhdr, Images* imgs);
 size_t GoAuxv      (Elf_Nhdr* nhdr, Images* imgs);
 size_t GoFile      (Elf_Nhdr* nhdr, Images* imgs);
 
-char* GetFilenameByNumInNTFile (file_t* file, size_t file_num);
 
+int MatchVmas (Elf* elf, Images* imgs);
 int GoLoadPhdr (Elf* elf, Elf_Phdr* phdr, Images* imgs, size_t vma_counter);
-void MmChangeIfNeeded (MmEntry* mm, VmaEntry* vma, Elf_Phdr* phdr);
+int PagesPlanAdd (PagesPlan* plan, Elf_Phdr* phdr, int is_anon, int is_lazy, size_t huge_pages, const char* file_name, uint64_t file_offset);
+int PagesPlanExecute (PagesPlan* plan, Elf* elf, Images* imgs);
+int PagesPlanExecuteStream (PagesPlan* plan, Elf* elf, Images* imgs);
+int WritePagemapEntry (Images* imgs, uint64_t vaddr, size_t nr_pages, uint32_t flags);
+void PagesPlanFree (PagesPlan* plan);
+
+int PrepareParentDirectory (const char* path, uint32_t pages_id);
+int MoveDonorPagesToParent (const char* path, uint32_t pages_id);
+ParentPages* ParentPagesConstructor (Images* imgs);
+int ParentPagesWrite (const ParentPages* parent, const char* path, int pid, uint32_t pages_id);
+void ParentPagesDestructor (ParentPages* parent);
+VmaRole GetVmaRole (const MmEntry* mm, const VmaEntry* vma);
+void MmChangeIfNeeded (MmEntry* mm, const VmaEntry* vma, VmaRole role, Elf_Phdr* phdr);
 uint32_t GetVmaProtByPhdr (Elf_Word phdr_flags);
 
 // type of unpacker's return value == type of *unpacked_image
-// allocator for unpacker = default
+// allocator for unpacker = arena, so images are freed with it
 FILE* StartImageReading (const char* filename, CriuMagic expected_magic);
-int ReadMessage (MessageUnpacker unpacker, ProtobufCMessage** unpacked_image, FILE* file);
-int ReadOnlyOneMessage (const char* path, const char* name, int pid, 
-                                 MessageUnpacker unpacker, ProtobufCMessage** unpacked_image, CriuMagic expected_magic);
-
-FILE* StartImageWriting (const char* filename, CriuMagic magic);
-int WriteMessage (MessagePacker packer, const ProtobufCMessage* unpacked_image, size_t packed_image_size, FILE* file);
+int ReadMessage (MessageUnpacker unpacker, Arena* arena, ProtobufCMessage** unpacked_image, FILE* file);
+int ReadOnlyOneMessage (const char* path, const char* name, int pid, MessageUnpacker unpacker, Arena* arena,
+                        ProtobufCMessage** unpacked_image, CriuMagic expected_magic);
+// *unpacked_images is allocated by malloc, messages - in arena
+int ReadPagemap (const char* path, int pid, Arena* arena, PagemapHead** head, PagemapEntry*** entries, size_t* n_entries);
+int ReadAllMessages (const char* path, const char* name, int pid, MessageUnpacker unpacker, Arena* arena,
+                     ProtobufCMessage*** unpacked_images, size_t* n_images, CriuMagic expected_magic);
+
+ImageWriter* ImageWriterOpen (const char* filename, CriuMagic magic);
+int ImageWriterMessage (ImageWriter* writer, MessagePacker packer, const void* unpacked_image, size_t packed_image_size);
+int ImageWriterPagemapEntry (ImageWriter* writer, uint64_t vaddr, uint32_t nr_pages, uint32_t flags);
+int ImageWriterFlush (ImageWriter* writer);
+int ImageWriterClose (ImageWriter* writer);
 int WriteOnlyOneMessage (const char* path, const char* name, int pid, 
                          MessagePacker packer, const void* unpacked_image, size_t packed_image_size, CriuMagic magic);
 
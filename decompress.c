@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#ifdef HAVE_XZ
+#include <lzma.h>
+#endif
+
+#include "fileworking.h"
+#include "decompress.h"
+#include "jobs.h"
+
+struct Decompressor
+{
+    Codec codec;
+    int fd_in, fd_out;
+    char* prefix;
+    size_t prefix_size;
+    size_t n_jobs;
+    pthread_t thread;
+    int error;
+};
+
+Codec DetectCodec (const char* magic, size_t size)
+{
+    assert (magic);
+
+    if (size >= 4 && memcmp (magic, "\x28\xB5\x2F\xFD", 4) == 0)
+        return CODEC_ZSTD;
+
+    if (size >= 6 && memcmp (magic, "\xFD" "7zXZ\x00", 6) == 0)
+        return CODEC_XZ;
+
+    if (size >= 4 && memcmp (magic, "\x04\x22\x4D\x18", 4) == 0)
+        return CODEC_LZ4;
+
+    return CODEC_NONE;
+}
+
+#if defined (HAVE_ZSTD) || defined (HAVE_LZ4) || defined (HAVE_XZ)
+
+static const size_t IN_BUF_SIZE  = 1 << 20;
+static const size_t OUT_BUF_SIZE = 4 << 20;
+static const int READER_CLOSED = 2; // reader has closed pipe (EPIPE): it has enough data, it isn't error of decompression
+
+// Reads compressed data: prefix at first, then fd_in. Returns number of bytes, 0 on EOF, -1 on error.
+static ssize_t ReadCompressed (Decompressor* decompressor, char* buf, size_t size)
+{
+    if (decompressor->prefix_size)
+    {
+        size_t part = decompressor->prefix_size < size ? decompressor->prefix_size : size;
+        memcpy (buf, decompressor->prefix, part);
+        memmove (decompressor->prefix, decompressor->prefix + part, decompressor->prefix_size - part);
+        decompressor->prefix_size -= part;
+        return part;
+    }
+
+    ssize_t n_read = 0;
+    do
+        n_read = read (decompressor->fd_in, buf, size);
+    while (n_read == -1 && errno == EINTR);
+
+    if (n_read == -1)
+        fprintf (stderr, "Error: Can't read compressed coredump: %s.\n", strerror (errno));
+    return n_read;
+}
+
+// Returns READER_CLOSED, if reader doesn't need more data, decompression stops then
+static int WriteDecompressed (Decompressor* decompressor, const char* buf, size_t size)
+{
+    while (size)
+    {
+        ssize_t n_written = write (decompressor->fd_out, buf, size);
+        if (n_written == -1 && errno == EINTR)
+            continue;
+
+        if (n_written <= 0)
+        {
+            // Reader has enough data (the rest of coredump isn't needed) or has failed itself
+            if (errno == EPIPE)
+                return READER_CLOSED;
+
+            fprintf (stderr, "Error: Can't write decompressed data: %s.\n", strerror (errno));
+            return -1;
+        }
+
+        buf  += n_written;
+        size -= n_written;
+    }
+
+    return 0;
+}
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+typedef struct
+{
+    const char* src;
+    size_t src_size;
+    char* dst;
+    size_t dst_size;
+} ZstdFrame;
+
+static int ZstdFrameJob (void* ctx, size_t i_task)
+{
+    ZstdFrame* frame = (ZstdFrame*) ctx + i_task;
+
+    size_t res = ZSTD_decompress (frame->dst, frame->dst_size, frame->src, frame->src_size);
+    if (ZSTD_isError (res) || res != frame->dst_size)
+    {
+        fprintf (stderr, "Error: Can't decompress zstd frame: %s.\n", ZSTD_isError (res) ? ZSTD_getErrorName (res) : "bad size");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Multi-frame file (zstd -T, pzstd) with known sizes of frames: frames are decompressed in parallel by groups of n_jobs.
+// Returns 1 if file isn't suitable for it and nothing was written.
+static int DecompressZstdFrames (Decompressor* decompressor)
+{
+    const size_t MAX_FRAME_SIZE = 256 << 20;
+    struct stat in_stat = {};
+
+    if (decompressor->n_jobs < 2 || decompressor->prefix_size || fstat (decompressor->fd_in, &in_stat) ||
+        !S_ISREG (in_stat.st_mode) || lseek (decompressor->fd_in, 0, SEEK_CUR) != 0 || in_stat.st_size == 0)
+        return 1;
+
+    size_t size = in_stat.st_size;
+    char* buf = (char*) mmap (NULL, size, PROT_READ, MAP_PRIVATE, decompressor->fd_in, 0);
+    if (buf == MAP_FAILED)
+        return 1;
+
+    // Checking of all frames before writing, so it's possible to return to usual decompression.
+    size_t n_frames = 0;
+    for (size_t pos = 0; pos < size; n_frames++)
+    {
+        size_t frame_size = ZSTD_findFrameCompressedSize (buf + pos, size - pos);
+        unsigned long long content_size = ZSTD_getFrameContentSize (buf + pos, size - pos);
+
+        if (ZSTD_isError (frame_size) || content_size == ZSTD_CONTENTSIZE_UNKNOWN || 
+            content_size == ZSTD_CONTENTSIZE_ERROR || content_size > MAX_FRAME_SIZE)
+        {
+            munmap (buf, size);
+            return 1;
+        }
+
+        pos += frame_size;
+    }
+
+    if (n_frames < 2)
+    {
+        munmap (buf, size);
+        return 1;
+    }
+
+    ZstdFrame* frames = (ZstdFrame*) calloc (decompressor->n_jobs, sizeof (*frames));
+    int res = frames ? 0 : -1;
+
+    for (size_t pos = 0; pos < size && res == 0; )
+    {
+        size_t n_group = 0;
+        for (; n_group < decompressor->n_jobs && pos < size; n_group++)
+        {
+            ZstdFrame* frame = frames + n_group;
+            frame->src = buf + pos;
+            frame->src_size = ZSTD_findFrameCompressedSize (buf + pos, size - pos);
+            frame->dst_size = ZSTD_getFrameContentSize (buf + pos, size - pos);
+            frame->dst = (char*) malloc (frame->dst_size + 1);
+            pos += frame->src_size;
+
+            if (!frame->dst)
+            {
+                res = -1;
+                n_group++;
+                break;
+            }
+        }
+
+        if (res == 0)
+            res = RunJobs (n_group, n_group, ZstdFrameJob, frames);
+
+        for (size_t i_frame = 0; i_frame < n_group; i_frame++)
+        {
+            if (res == 0)
+                res = WriteDecompressed (decompressor, frames[i_frame].dst, frames[i_frame].dst_size);
+            free (frames[i_frame].dst);
+            frames[i_frame].dst = NULL;
+        }
+
+        // Frames were read once
+        madvise (buf, pos, MADV_DONTNEED);
+    }
+
+    free (frames);
+    munmap (buf, size);
+    return res;
+}
+
+static int DecompressZstd (Decompressor* decompressor)
+{
+    int res = DecompressZstdFrames (decompressor);
+    if (res != 1)
+        return res;
+
+    ZSTD_DStream* stream = ZSTD_createDStream ();
+    char* in_buf  = (char*) malloc (IN_BUF_SIZE);
+    char* out_buf = (char*) malloc (OUT_BUF_SIZE);
+    res = (stream && in_buf && out_buf) ? 0 : -1;
+
+    if (stream)
+        ZSTD_initDStream (stream);
+
+    ssize_t n_read = 0;
+    while (res == 0 && (n_read = ReadCompressed (decompressor, in_buf, IN_BUF_SIZE)) > 0)
+    {
+        ZSTD_inBuffer input = {in_buf, (size_t) n_read, 0};
+        while (res == 0 && input.pos < input.size)
+        {
+            ZSTD_outBuffer output = {out_buf, OUT_BUF_SIZE, 0};
+            size_t ret = ZSTD_decompressStream (stream, &output, &input);
+
+            if (ZSTD_isError (ret))
+            {
+                fprintf (stderr, "Error: Can't decompress zstd coredump: %s.\n", ZSTD_getErrorName (ret));
+                res = -1;
+            }
+            else
+                res = WriteDecompressed (decompressor, out_buf, output.pos);
+        }
+    }
+
+    if (n_read == -1 && res == 0)
+        res = -1;
+
+    ZSTD_freeDStream (stream);
+    free (in_buf);
+    free (out_buf);
+    return res;
+}
+
+#endif
+
+#ifdef HAVE_LZ4
+
+static int DecompressLz4 (Decompressor* decompressor)
+{
+    LZ4F_dctx* ctx = NULL;
+    char* in_buf  = (char*) malloc (IN_BUF_SIZE);
+    char* out_buf = (char*) malloc (OUT_BUF_SIZE);
+    int res = (in_buf && out_buf && !LZ4F_isError (LZ4F_createDecompressionContext (&ctx, LZ4F_VERSION))) ? 0 : -1;
+
+    ssize_t n_read = 0;
+    while (res == 0 && (n_read = ReadCompressed (decompressor, in_buf, IN_BUF_SIZE)) > 0)
+    {
+        for (size_t pos = 0; res == 0 && pos < (size_t) n_read; )
+        {
+            size_t out_size = OUT_BUF_SIZE, in_size = n_read - pos;
+            size_t ret = LZ4F_decompress (ctx, out_buf, &out_size, in_buf + pos, &in_size, NULL);
+
+            if (LZ4F_isError (ret))
+            {
+                fprintf (stderr, "Error: Can't decompress lz4 coredump: %s.\n", LZ4F_getErrorName (ret));
+                res = -1;
+            }
+            else
+                res = WriteDecompressed (decompressor, out_buf, out_size);
+
+            pos += in_size;
+        }
+    }
+
+    if (n_read == -1 && res == 0)
+        res = -1;
+
+    if (ctx)
+        LZ4F_freeDecompressionContext (ctx);
+    free (in_buf);
+    free (out_buf);
+    return res;
+}
+
+#endif
+
+#ifdef HAVE_XZ
+
+static int DecompressXz (Decompressor* decompressor)
+{
+    lzma_stream stream = LZMA_STREAM_INIT;
+    char* in_buf  = (char*) malloc (IN_BUF_SIZE);
+    char* out_buf = (char*) malloc (OUT_BUF_SIZE);
+    int res = (in_buf && out_buf && lzma_stream_decoder (&stream, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK) ? 0 : -1;
+
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret = LZMA_OK;
+
+    while (res == 0 && ret != LZMA_STREAM_END)
+    {
+        if (stream.avail_in == 0 && action == LZMA_RUN)
+        {
+            ssize_t n_read = ReadCompressed (decompressor, in_buf, IN_BUF_SIZE);
+            if (n_read == -1)
+            {
+                res = -1;
+                break;
+            }
+
+            stream.next_in  = (const uint8_t*) in_buf;
+            stream.avail_in = n_read;
+            if (n_read == 0)
+                action = LZMA_FINISH;
+        }
+
+        stream.next_out  = (uint8_t*) out_buf;
+        stream.avail_out = OUT_BUF_SIZE;
+        ret = lzma_code (&stream, action);
+
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+        {
+            fprintf (stderr, "Error: Can't decompress xz coredump, lzma error %d.\n", ret);
+            res = -1;
+        }
+        else
+            res = WriteDecompressed (decompressor, out_buf, OUT_BUF_SIZE - stream.avail_out);
+    }
+
+    lzma_end (&stream);
+    free (in_buf);
+    free (out_buf);
+    return res;
+}
+
+#endif
+
+static void* DecompressionThread (void* arg)
+{
+    Decompressor* decompressor = (Decompressor*) arg;
+    int res = -1;
+
+    switch (decompressor->codec)
+    {
+    #ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+            res = DecompressZstd (decompressor);
+            break;
+    #endif
+
+    #ifdef HAVE_LZ4
+        case CODEC_LZ4:
+            res = DecompressLz4 (decompressor);
+            break;
+    #endif
+
+    #ifdef HAVE_XZ
+        case CODEC_XZ:
+            res = DecompressXz (decompressor);
+            break;
+    #endif
+
+        case CODEC_NONE:
+        default:
+            fprintf (stderr, "Error: Compressed coredump isn't supported: criu-necromancer was built without its library.\n");
+            break;
+    }
+
+    #if defined (HAVE_ZSTD) || defined (HAVE_LZ4) || defined (HAVE_XZ)
+    if (res == READER_CLOSED)
+        res = 0;
+    #endif
+    decompressor->error = res;
+
+    // Reader will see EOF
+    close (decompressor->fd_out);
+    decompressor->fd_out = -1;
+    return NULL;
+}
+
+Decompressor* StartDecompression (int fd_in, Codec codec, const char* prefix, size_t prefix_size, size_t n_jobs, int* fd_out)
+{
+    assert (fd_out);
+
+    Decompressor* decompressor = (Decompressor*) calloc (1, sizeof (*decompressor));
+    if (!decompressor)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
+    }
+
+    *decompressor = (Decompressor) {.codec = codec, .fd_in = fd_in, .fd_out = -1, .n_jobs = n_jobs};
+    decompressor->prefix = (char*) malloc (prefix_size + 1);
+
+    int pipe_fds[2] = {-1, -1};
+    if (!decompressor->prefix || pipe (pipe_fds))
+    {
+        perror ("Can't start decompression");
+        free (decompressor->prefix);
+        free (decompressor);
+        return NULL;
+    }
+
+    if (prefix_size)
+        memcpy (decompressor->prefix, prefix, prefix_size);
+    decompressor->prefix_size = prefix_size;
+    decompressor->fd_out = pipe_fds[1];
+
+    // Reader can close pipe before the end of decompression, it must be EPIPE, not death
+    signal (SIGPIPE, SIG_IGN);
+
+    if (pthread_create (&decompressor->thread, NULL, DecompressionThread, decompressor))
+    {
+        fprintf (stderr, "Error: Can't create thread for decompression.\n");
+        close (pipe_fds[0]);
+        close (pipe_fds[1]);
+        free (decompressor->prefix);
+        free (decompressor);
+        return NULL;
+    }
+
+    *fd_out = pipe_fds[0];
+    return decompressor;
+}
+
+int FinishDecompression (Decompressor* decompressor)
+{
+    if (!decompressor)
+        return 0;
+
+    pthread_join (decompressor->thread, NULL);
+    int error = decompressor->error;
+
+    close (decompressor->fd_in);
+    free (decompressor->prefix);
+    free (decompressor);
+    return error ? -1 : 0;
+}
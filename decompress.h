@@ -0,0 +1,26 @@
+// Compressed coredumps (systemd-coredump stores them as .zst, .xz or .lz4).
+// Data is decompressed by separate thread to pipe, so for ELF reader it's only stream.
+
+typedef enum
+{
+    CODEC_NONE = 0,
+    CODEC_ZSTD,
+    CODEC_XZ,
+    CODEC_LZ4
+} Codec;
+
+// It's enough to read this number of bytes for DetectCodec.
+#define CODEC_MAGIC_SIZE 6
+
+Codec DetectCodec (const char* magic, size_t size);
+
+typedef struct Decompressor Decompressor;
+
+// fd_in is read from the current position, prefix (bytes, that already have been read from fd_in) is decompressed at first.
+// If n_jobs > 1, frames of zstd file can be decompressed in parallel. fd_in is closed by FinishDecompression.
+// Returns decompressor, *fd_out is read end of pipe with decompressed data.
+Decompressor* StartDecompression (int fd_in, Codec codec, const char* prefix, size_t prefix_size, size_t n_jobs, int* fd_out);
+
+// Waits for the end of decompression. Read end of pipe must be closed before it.
+// Returns 0 if all data was decompressed successfully.
+int FinishDecompression (Decompressor* decompressor);
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "donor.h"
+#include "fileworking.h"
+
+#define MAX_DONOR_PATH_LEN 1024
+
+static int CompareDonorImages (const void* a, const void* b)
+{
+    return strcmp (((const DonorImage*) a)->name, ((const DonorImage*) b)->name);
+}
+
+static int IsImageRead (const char* name, const char* const* read_prefixes, size_t n_prefixes)
+{
+    for (size_t i_prefix = 0; i_prefix < n_prefixes; i_prefix++)
+        if (strncmp (name, read_prefixes[i_prefix], strlen (read_prefixes[i_prefix])) == 0)
+            return 1;
+
+    return 0;
+}
+
+DonorTemplate* DonorTemplateConstructor (const char* path, const char* const* read_prefixes, size_t n_prefixes)
+{
+    assert (path);
+
+    DonorTemplate* donor = (DonorTemplate*) calloc (1, sizeof (*donor));
+    DIR* dir = opendir (path);
+    if (!donor || !dir || !(donor->path = strdup (path)))
+    {
+        fprintf (stderr, "Error: Can't read donor's directory %s.\n", path);
+        if (dir)
+            closedir (dir);
+        DonorTemplateDestructor (donor);
+        return NULL;
+    }
+
+    size_t capacity = 0;
+    int error = 0;
+
+    for (struct dirent* entry = readdir (dir); entry && !error; entry = readdir (dir))
+    {
+        char filename[MAX_DONOR_PATH_LEN] = "";
+        snprintf (filename, MAX_DONOR_PATH_LEN, "%s/%s", path, entry->d_name);
+
+        struct stat file_stat = {};
+        if (stat (filename, &file_stat) || !S_ISREG (file_stat.st_mode))
+            continue;
+
+        if (donor->n_images == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            DonorImage* new_images = (DonorImage*) realloc (donor->images, capacity * sizeof (*new_images));
+            if (!new_images)
+            {
+                perror ("Can't allocate memory");
+                error = 1;
+                break;
+            }
+            donor->images = new_images;
+        }
+
+        DonorImage* image = donor->images + donor->n_images;
+        *image = (DonorImage) {.name = strdup (entry->d_name)};
+        if (!image->name)
+        {
+            perror ("Can't allocate memory");
+            error = 1;
+            break;
+        }
+        donor->n_images++;
+
+        if (IsImageRead (entry->d_name, read_prefixes, n_prefixes))
+        {
+            int fd = -1;
+            image->buf = MapFile (filename, &image->size, &fd);
+            UnmapFile (NULL, 0, fd); // mapping is kept without fd
+            error = (image->buf == NULL);
+        }
+    }
+
+    closedir (dir);
+    if (error)
+    {
+        DonorTemplateDestructor (donor);
+        return NULL;
+    }
+
+    if (donor->n_images)
+        qsort (donor->images, donor->n_images, sizeof (*donor->images), CompareDonorImages);
+    return donor;
+}
+
+void DonorTemplateDestructor (DonorTemplate* donor)
+{
+    if (!donor)
+        return;
+
+    for (size_t i_image = 0; i_image < donor->n_images; i_image++)
+    {
+        UnmapFile (donor->images[i_image].buf, donor->images[i_image].size, -1);
+        free (donor->images[i_image].name);
+    }
+
+    free (donor->images);
+    free (donor->path);
+    free (donor);
+    return;
+}
+
+const DonorImage* DonorTemplateFind (const DonorTemplate* donor, const char* name)
+{
+    assert (donor);
+    assert (name);
+
+    DonorImage key = {.name = (char*) name};
+    const DonorImage* image = (const DonorImage*) bsearch (&key, donor->images, donor->n_images,
+                                                           sizeof (*donor->images), CompareDonorImages);
+    return (image && image->buf) ? image : NULL;
+}
+
+// Independent file, which shares data blocks with donor's one (btrfs, XFS): only metadata is written
+static int ReflinkDonorFile (const char* from, const char* to)
+{
+    int fd_in = open (from, O_RDONLY);
+    int fd_out = (fd_in != -1) ? open (to, O_WRONLY | O_CREAT | O_EXCL, 0666) : -1;
+    int res = (fd_out != -1) ? ioctl (fd_out, FICLONE, fd_in) : -1;
+
+    if (fd_in  != -1) close (fd_in);
+    if (fd_out != -1) close (fd_out);
+    if (res && fd_out != -1)
+        unlink (to);
+    return res;
+}
+
+static int CopyDonorFile (const char* from, const char* to)
+{
+    int fd_in = open (from, O_RDONLY);
+    int fd_out = open (to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    struct stat file_stat = {};
+    int res = -1;
+
+    if (fd_in != -1 && fd_out != -1 && fstat (fd_in, &file_stat) == 0)
+        res = CopyFileRange (fd_in, 0, fd_out, 0, (size_t) file_stat.st_size);
+
+    if (fd_in  != -1) close (fd_in);
+    if (fd_out != -1) close (fd_out);
+    return res;
+}
+
+int DonorTemplateClone (const DonorTemplate* donor, const char* out_path)
+{
+    assert (donor);
+    assert (out_path);
+
+    if (mkdir (out_path, 0777) && errno != EEXIST)
+    {
+        fprintf (stderr, "Error: Can't create directory %s : %s.\n", out_path, strerror (errno));
+        return -1;
+    }
+
+    for (size_t i_image = 0; i_image < donor->n_images; i_image++)
+    {
+        char from[MAX_DONOR_PATH_LEN] = "", to[MAX_DONOR_PATH_LEN] = "";
+        snprintf (from, MAX_DONOR_PATH_LEN, "%s/%s", donor->path, donor->images[i_image].name);
+        snprintf (to,   MAX_DONOR_PATH_LEN, "%s/%s", out_path,    donor->images[i_image].name);
+
+        unlink (to); // result of previous run
+        if (ReflinkDonorFile (from, to) == 0 || link (from, to) == 0)
+            continue;
+
+        // Other filesystem or hardlinks are forbidden
+        if (CopyDonorFile (from, to))
+        {
+            fprintf (stderr, "Error: Can't copy %s to %s.\n", from, to);
+            return -1;
+        }
+    }
+
+    return 0;
+}
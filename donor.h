@@ -0,0 +1,29 @@
+// Donor's images in memory for batch mode. They are read once and never changed after,
+// so any number of coredumps can be converted against them in parallel.
+
+#include <stddef.h>
+
+typedef struct
+{
+    char* name; // name of file in donor's directory
+    char* buf;  // read-only mapping, NULL if image isn't read by necromancer (it's only cloned)
+    size_t size;
+} DonorImage;
+
+typedef struct
+{
+    char* path;
+    DonorImage* images; // sorted by name
+    size_t n_images;
+} DonorTemplate;
+
+// Files, which names start with one of prefixes, are read to memory.
+DonorTemplate* DonorTemplateConstructor (const char* path, const char* const* read_prefixes, size_t n_prefixes);
+void DonorTemplateDestructor (DonorTemplate* donor);
+
+// Returns NULL, if there is no such image in memory.
+const DonorImage* DonorTemplateFind (const DonorTemplate* donor, const char* name);
+
+// Creates directory with all donor's files: reflinks, hardlinks if filesystem can't reflink, copies at last.
+// Images are rewritten by creating new files, so donor isn't changed through hardlinks.
+int DonorTemplateClone (const DonorTemplate* donor, const char* out_path);
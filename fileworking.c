@@ -1,8 +1,20 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <elf.h>
 #include <malloc.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <pthread.h>
 #include "fileworking.h"
 
 char* ReadFile (const char* filename)
@@ -73,3 +85,310 @@ int WriteFile (const char* filename, const char* buf, size_t buf_size)
     fclose (file);
     return 0;
 }
+
+int RecreateFile (const char* filename)
+{
+    assert (filename);
+
+    if (unlink (filename) && errno != ENOENT)
+        fprintf (stderr, "Warning: Unable to unlink file %s : %s.\n", filename, strerror (errno));
+
+    return open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+char* MapFile (const char* filename, size_t* size, int* fd)
+{
+    assert (filename);
+    assert (size);
+    assert (fd);
+
+    *fd = open (filename, O_RDONLY);
+    if (*fd == -1)
+    {
+        fprintf (stderr, "Error: Unable to open file %s : %s.\n", filename, strerror (errno));
+        return NULL;
+    }
+
+    struct stat file_stat = {};
+    if (fstat (*fd, &file_stat) == 0 && !S_ISREG (file_stat.st_mode))
+        return NULL; // FIFO or something like this, fd is left open for reading
+
+    if (file_stat.st_size == 0)
+    {
+        fprintf (stderr, "Error: Unable to get size of file %s or file is empty.\n", filename);
+        close (*fd);
+        *fd = -1;
+        return NULL;
+    }
+
+    // MAP_PRIVATE + PROT_READ: pages are only page cache, so RSS doesn't grow with file size.
+    char* buf = (char*) mmap (NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, *fd, 0);
+    if (buf == MAP_FAILED)
+    {
+        fprintf (stderr, "Error: Unable to map file %s : %s.\n", filename, strerror (errno));
+        close (*fd);
+        *fd = -1;
+        return NULL;
+    }
+
+    *size = (size_t) file_stat.st_size;
+    return buf;
+}
+
+void UnmapFile (char* buf, size_t size, int fd)
+{
+    if (buf)
+        munmap (buf, size);
+
+    if (fd != -1)
+        close (fd);
+
+    return;
+}
+
+void AdviseMapping (char* buf, size_t offset, size_t len, int advice)
+{
+    assert (buf);
+
+    // madvise wants page aligned address, so extend region to the left
+    size_t page_size = (size_t) sysconf (_SC_PAGESIZE);
+    size_t shift = offset % page_size;
+
+    if (len)
+        madvise (buf + offset - shift, len + shift, advice); // It's only hint, errors are ignored
+    return;
+}
+
+static int CloneRange (int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len)
+{
+    struct stat out_stat = {};
+    if (fstat (fd_out, &out_stat) == -1 || out_stat.st_blksize <= 0)
+        return -1;
+
+    size_t block = (size_t) out_stat.st_blksize;
+    if (off_in % block || off_out % block || len % block)
+        return -1;
+
+    // Reflink: only metadata is written, data blocks are shared (btrfs, XFS).
+    struct file_clone_range range = {.src_fd = fd_in, .src_offset = off_in, .src_length = len, .dest_offset = off_out};
+    return ioctl (fd_out, FICLONERANGE, &range);
+}
+
+static int CopyRangeByBuffer (int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len)
+{
+    const size_t BUF_SIZE = 1 << 20;
+    char* buf = (char*) malloc (BUF_SIZE);
+    if (!buf)
+    {
+        fprintf (stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    while (len)
+    {
+        ssize_t n_read = pread (fd_in, buf, len < BUF_SIZE ? len : BUF_SIZE, off_in);
+        if (n_read <= 0 || pwrite (fd_out, buf, n_read, off_out) != n_read)
+        {
+            fprintf (stderr, "Error: Copying of file range failed: %s.\n", n_read ? strerror (errno) : "unexpected EOF");
+            free (buf);
+            return -1;
+        }
+
+        off_in  += n_read;
+        off_out += n_read;
+        len     -= n_read;
+    }
+
+    free (buf);
+    return 0;
+}
+
+int CopyFileRange (int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len)
+{
+    assert (fd_in  != -1);
+    assert (fd_out != -1);
+
+    if (!len || CloneRange (fd_in, off_in, fd_out, off_out, len) == 0)
+        return 0;
+
+    // In-kernel copy. Some filesystems (or old kernels) can't do it, so it's done up to first error.
+    while (len)
+    {
+        ssize_t n_copied = copy_file_range (fd_in, &off_in, fd_out, &off_out, len, 0);
+        if (n_copied <= 0)
+            break;
+        len -= n_copied;
+    }
+
+    // sendfile writes to current position of fd_out, so it's shared between threads
+    static pthread_mutex_t sendfile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    if (len)
+    {
+        pthread_mutex_lock (&sendfile_lock);
+
+        while (len && lseek (fd_out, off_out, SEEK_SET) == off_out)
+        {
+            ssize_t n_copied = sendfile (fd_out, fd_in, &off_in, len);
+            if (n_copied <= 0)
+                break;
+            off_out += n_copied;
+            len     -= n_copied;
+        }
+
+        pthread_mutex_unlock (&sendfile_lock);
+    }
+
+    return len ? CopyRangeByBuffer (fd_in, off_in, fd_out, off_out, len) : 0;
+}
+
+int ReadFull (int fd, char* buf, size_t len)
+{
+    assert (buf);
+
+    while (len)
+    {
+        ssize_t n_read = read (fd, buf, len);
+        if (n_read == -1 && errno == EINTR)
+            continue;
+
+        if (n_read <= 0)
+        {
+            fprintf (stderr, "Error: Reading failed: %s.\n", n_read ? strerror (errno) : "unexpected EOF");
+            return -1;
+        }
+
+        buf += n_read;
+        len -= n_read;
+    }
+
+    return 0;
+}
+
+int SkipBytes (int fd, size_t len)
+{
+    char buf[4096] = "";
+
+    while (len)
+    {
+        size_t part = len < sizeof (buf) ? len : sizeof (buf);
+        if (ReadFull (fd, buf, part))
+            return -1;
+        len -= part;
+    }
+
+    return 0;
+}
+
+int SpliceToFile (int fd_in, int fd_out, off_t off_out, size_t len)
+{
+    assert (fd_in  != -1);
+    assert (fd_out != -1);
+
+    // Works only if fd_in is pipe. Data isn't copied through user space.
+    while (len)
+    {
+        ssize_t n_moved = splice (fd_in, NULL, fd_out, &off_out, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n_moved <= 0)
+            break;
+        len -= n_moved;
+    }
+
+    if (!len)
+        return 0;
+
+    const size_t BUF_SIZE = 1 << 20;
+    char* buf = (char*) malloc (BUF_SIZE);
+    if (!buf)
+    {
+        fprintf (stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    while (len)
+    {
+        size_t part = len < BUF_SIZE ? len : BUF_SIZE;
+        if (ReadFull (fd_in, buf, part) || pwrite (fd_out, buf, part, off_out) != (ssize_t) part)
+        {
+            free (buf);
+            return -1;
+        }
+
+        off_out += part;
+        len     -= part;
+    }
+
+    free (buf);
+    return 0;
+}
+
+int OpenDirect (const char* filename)
+{
+    assert (filename);
+
+    int fd = open (filename, O_WRONLY | O_DIRECT);
+    if (fd == -1)
+        fprintf (stderr, "Warning: Can't open %s with O_DIRECT: %s, it's written through page cache.\n", filename, strerror (errno));
+    return fd;
+}
+
+static int WriteFullAt (int fd, const char* buf, size_t len, off_t offset)
+{
+    while (len)
+    {
+        ssize_t n_written = pwrite (fd, buf, len, offset);
+        if (n_written == -1 && errno == EINTR)
+            continue;
+        if (n_written <= 0)
+            return -1;
+
+        buf    += n_written;
+        offset += n_written;
+        len    -= n_written;
+    }
+
+    return 0;
+}
+
+int WriteDirect (int fd, const char* buf, size_t len, off_t offset)
+{
+    assert (fd != -1);
+    assert (buf);
+    assert (offset % DIRECT_ALIGN == 0 && len % DIRECT_ALIGN == 0);
+
+    if ((uintptr_t) buf % DIRECT_ALIGN == 0)
+        return WriteFullAt (fd, buf, len, offset);
+
+    const size_t BUF_SIZE = 1 << 20;
+    char* aligned = NULL;
+    if (posix_memalign ((void**) &aligned, DIRECT_ALIGN, BUF_SIZE))
+    {
+        fprintf (stderr, "Error: Unable to allocate memory\n");
+        return -1;
+    }
+
+    int res = 0;
+    for (size_t done = 0; done < len && !res; done += BUF_SIZE)
+    {
+        size_t part = (len - done < BUF_SIZE) ? len - done : BUF_SIZE;
+        memcpy (aligned, buf + done, part);
+        res = WriteFullAt (fd, aligned, part, offset + done);
+    }
+
+    free (aligned);
+    return res;
+}
+
+int PreallocateFile (int fd, off_t offset, size_t len)
+{
+    assert (fd != -1);
+
+    // It's only optimization: filesystem without fallocate allocates blocks while writing
+    if (len && fallocate (fd, 0, offset, len) && errno != EOPNOTSUPP)
+    {
+        fprintf (stderr, "Warning: Can't preallocate %zu bytes: %s.\n", len, strerror (errno));
+        return -1;
+    }
+
+    return 0;
+}
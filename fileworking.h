@@ -3,3 +3,37 @@ char* ReadFile (const char* filename);
 long GetFileSize (FILE* file);
 
 int WriteFile (const char* filename, const char* buf, size_t buf_size);
+
+// Opens file for writing from scratch. Old file is unlinked instead of truncating,
+// so its hardlinks (copies of donor's images) aren't changed.
+int RecreateFile (const char* filename);
+
+// Read-only mapping of whole file. fd is kept for syscalls, which work with file directly.
+// If file isn't regular (can't be mapped), returns NULL, but *fd is opened.
+char* MapFile (const char* filename, size_t* size, int* fd);
+
+void UnmapFile (char* buf, size_t size, int fd);
+
+// Wrapper for madvise, offset and len aren't required to be aligned.
+void AdviseMapping (char* buf, size_t offset, size_t len, int advice);
+
+// Copying of file data without passing it through user space: reflink if offsets are aligned
+// to block size, copy_file_range or sendfile otherwise. Read/write loop is the last chance.
+int CopyFileRange (int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len);
+
+// For streams (pipes), which can't be mapped or seeked.
+int ReadFull  (int fd, char* buf, size_t len);
+int SkipBytes (int fd, size_t len);
+
+// Moves len bytes from stream fd_in to file fd_out at off_out. Uses splice, if fd_in is pipe.
+int SpliceToFile (int fd_in, int fd_out, off_t off_out, size_t len);
+
+// Writing past page cache: O_DIRECT wants offset, length and memory aligned to DIRECT_ALIGN.
+#define DIRECT_ALIGN 4096
+
+// Second descriptor of file for O_DIRECT writing, -1 if filesystem can't do it (tmpfs).
+int OpenDirect (const char* filename);
+// offset and len must be aligned, unaligned memory is written through aligned buffer.
+int WriteDirect (int fd, const char* buf, size_t len, off_t offset);
+// Blocks of file are reserved at once, so it isn't fragmented. File is extended up to offset + len.
+int PreallocateFile (int fd, off_t offset, size_t len);
@@ -0,0 +1,698 @@
+// Generator of synthetic coredump and matching donor's images for benchmarks of converting.
+// Neither criu nor root is needed: coredump is written like kernel writes it, donor's images are packed by protobuf-c.
+//
+// Output directory:
+//     core   - ELF coredump: PT_NOTE with notes of process and threads, PT_LOAD per VMA, zero pages are holes
+//     donor/ - pstree, core, mm, files, pagemap and pages images of donor with the same layout of memory at other addresses
+
+#define _GNU_SOURCE
+#include <elf.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/procfs.h>
+#include <sys/stat.h>
+#include "criu_necromancer.h"
+
+typedef struct
+{
+    const char* output_path;
+    size_t size_mb;
+    size_t n_vmas;
+    size_t n_threads;
+    size_t n_files;   // VMAs of mapped files, they are listed in NT_FILE
+    unsigned zero_pct; // percent of zero pages, they are holes in coredump
+    uint64_t seed;
+} GenArgs;
+
+typedef struct
+{
+    uint64_t start, n_pages; // start in coredump, donor's VMA starts at start - DONOR_SHIFT
+    uint32_t prot;
+    long file;               // index in NT_FILE or -1
+    int is_stack;
+} GenVma;
+
+static const uint64_t CORE_BASE    = 0x7f0000000000;
+static const uint64_t DONOR_SHIFT  = 0x100000000;  // ASLR: VMAs of donor are placed at other addresses
+static const int      CORE_PID     = 31337;
+static const int      DONOR_PID    = 4242;
+static const uint32_t DONOR_PAGES_ID = 1;
+static const size_t   WRITE_CHUNK_PAGES = 256;
+
+// splitmix64: content of page depends only on seed and address, so donor's pages are the same as in coredump
+static uint64_t Mix (uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+}
+
+static int IsZeroGenPage (const GenArgs* args, uint64_t vaddr)
+{
+    return Mix (args->seed ^ vaddr) % 100 < args->zero_pct;
+}
+
+static void FillGenPage (const GenArgs* args, uint64_t vaddr, char* page)
+{
+    uint64_t* words = (uint64_t*) page;
+    uint64_t state = Mix (args->seed ^ vaddr ^ 0x5555555555555555);
+    for (size_t i_word = 0; i_word < PAGESIZE / sizeof (*words); i_word++)
+        words[i_word] = state = Mix (state);
+}
+
+static void GenPrintUsage (void)
+{
+    fprintf (stderr, "Usage: gencore -o DIR [options]\n"
+                     "Writes DIR/core and DIR/donor/ for ./criu-necromancer -c DIR/core -i DIR/donor.\n"
+                     "  -s, --size MB      memory of process, default 256\n"
+                     "  -v, --vmas N       number of VMAs (PT_LOADs), default 64\n"
+                     "  -t, --threads N    number of threads, default 4\n"
+                     "  -z, --zero PCT     percent of zero pages, default 50\n"
+                     "  -f, --files N      VMAs of mapped files in NT_FILE, default 8\n"
+                     "  -r, --seed N       seed of content of pages, default 1\n");
+}
+
+static int GenParseArguments (int argc, char** argv, GenArgs* args)
+{
+    static const struct option LONG_OPTIONS[] =
+    {
+        {"output",  required_argument, NULL, 'o'},
+        {"size",    required_argument, NULL, 's'},
+        {"vmas",    required_argument, NULL, 'v'},
+        {"threads", required_argument, NULL, 't'},
+        {"zero",    required_argument, NULL, 'z'},
+        {"files",   required_argument, NULL, 'f'},
+        {"seed",    required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+
+    *args = (GenArgs) {.size_mb = 256, .n_vmas = 64, .n_threads = 4, .n_files = 8, .zero_pct = 50, .seed = 1};
+
+    int opt = 0;
+    while ((opt = getopt_long (argc, argv, "o:s:v:t:z:f:r:", LONG_OPTIONS, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'o': args->output_path = optarg;                     break;
+            case 's': args->size_mb   = strtoul (optarg, NULL, 10);   break;
+            case 'v': args->n_vmas    = strtoul (optarg, NULL, 10);   break;
+            case 't': args->n_threads = strtoul (optarg, NULL, 10);   break;
+            case 'z': args->zero_pct  = strtoul (optarg, NULL, 10);   break;
+            case 'f': args->n_files   = strtoul (optarg, NULL, 10);   break;
+            case 'r': args->seed      = strtoull (optarg, NULL, 10);  break;
+            default:
+                GenPrintUsage();
+                return -1;
+        }
+    }
+
+    if (!args->output_path || args->n_vmas < 2 || args->n_threads == 0 || args->zero_pct > 100)
+    {
+        GenPrintUsage();
+        return -1;
+    }
+
+    // The first VMA is executable, the last one is stack
+    if (args->n_files > args->n_vmas - 1)
+        args->n_files = args->n_vmas - 1;
+    if (args->n_files == 0)
+        args->n_files = 1;
+
+    return 0;
+}
+
+// Mapped files at first (the first one is executable), then anonymous memory, stack is the last one
+static GenVma* CreateLayout (const GenArgs* args)
+{
+    GenVma* vmas = (GenVma*) calloc (args->n_vmas, sizeof (*vmas));
+    if (!vmas)
+        return NULL;
+
+    size_t total_pages = args->size_mb * ((1 << 20) / PAGESIZE);
+    size_t vma_pages = total_pages / args->n_vmas ? total_pages / args->n_vmas : 1;
+    uint64_t start = CORE_BASE;
+
+    for (size_t i_vma = 0; i_vma < args->n_vmas; i_vma++)
+    {
+        GenVma* vma = vmas + i_vma;
+        vma->start = start;
+        vma->n_pages = vma_pages;
+        vma->file = (i_vma < args->n_files) ? (long) i_vma : -1;
+        vma->prot = (vma->file == -1) ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+        vma->is_stack = (i_vma == args->n_vmas - 1);
+
+        start += (vma->n_pages + 1) * PAGESIZE; // guard page between VMAs, so they aren't merged
+    }
+
+    return vmas;
+}
+
+static void GetFileName (size_t i_file, char* name, size_t size)
+{
+    if (i_file == 0)
+        snprintf (name, size, "/usr/bin/necromancer-gen");
+    else
+        snprintf (name, size, "/usr/lib/necromancer-gen/lib%zu.so", i_file);
+}
+
+// Stack pointer and AT_EXECFN are placed near the end of stack, like after execve
+static uint64_t GetStackTop (const GenVma* stack)
+{
+    return stack->start + stack->n_pages * PAGESIZE - 256;
+}
+
+/*
+    Notes
+*/
+
+typedef struct
+{
+    char* buf;
+    size_t size, capacity;
+} NoteBuffer;
+
+static int AddNote (NoteBuffer* notes, Elf64_Word type, const void* desc, size_t desc_size)
+{
+    static const char NAME[] = "CORE";
+    size_t name_size = (sizeof (NAME) + 3) & ~(size_t) 3;
+    size_t note_size = sizeof (Elf64_Nhdr) + name_size + ((desc_size + 3) & ~(size_t) 3);
+
+    if (notes->size + note_size > notes->capacity)
+    {
+        size_t capacity = 2 * (notes->capacity + note_size);
+        char* buf = (char*) realloc (notes->buf, capacity);
+        if (!buf)
+            return -1;
+        notes->buf = buf;
+        notes->capacity = capacity;
+    }
+
+    char* place = notes->buf + notes->size;
+    memset (place, 0, note_size);
+    *(Elf64_Nhdr*) place = (Elf64_Nhdr) {.n_namesz = sizeof (NAME), .n_descsz = desc_size, .n_type = type};
+    memcpy (place + sizeof (Elf64_Nhdr), NAME, sizeof (NAME));
+    memcpy (place + sizeof (Elf64_Nhdr) + name_size, desc, desc_size);
+
+    notes->size += note_size;
+    return 0;
+}
+
+static int AddFileNote (NoteBuffer* notes, const GenArgs* args, const GenVma* vmas)
+{
+    char name[MAX_PATH_LEN] = "";
+    size_t names_size = 0;
+    for (size_t i_file = 0; i_file < args->n_files; i_file++)
+    {
+        GetFileName (i_file, name, sizeof (name));
+        names_size += strlen (name) + 1;
+    }
+
+    size_t desc_size = sizeof (file_t) + args->n_files * sizeof (struct file_array) + names_size;
+    file_t* file = (file_t*) calloc (1, desc_size);
+    if (!file)
+        return -1;
+
+    file->count = args->n_files;
+    file->pagesize = PAGESIZE;
+    char* names = (char*) (file->array + args->n_files);
+
+    for (size_t i_file = 0; i_file < args->n_files; i_file++)
+    {
+        file->array[i_file] = (struct file_array) {.start = vmas[i_file].start, .file_ofs = 0,
+                                                   .end = vmas[i_file].start + vmas[i_file].n_pages * PAGESIZE};
+        GetFileName (i_file, names, MAX_PATH_LEN);
+        names += strlen (names) + 1;
+    }
+
+    int res = AddNote (notes, NT_FILE, file, desc_size);
+    free (file);
+    return res;
+}
+
+// The same order, as kernel writes: notes of process are placed between NT_PRSTATUS and NT_FPREGSET of the first thread
+static int CreateNotes (NoteBuffer* notes, const GenArgs* args, const GenVma* vmas)
+{
+    const GenVma* stack = vmas + args->n_vmas - 1;
+
+    elf_fpregset_t fpregset = {.cwd = 0x37f, .mxcsr = 0x1f80, .mxcr_mask = 0xffff};
+
+    prpsinfo_t prpsinfo = {.pr_state = 0, .pr_sname = 'R', .pr_uid = 1000, .pr_gid = 1000,
+                           .pr_pid = CORE_PID, .pr_ppid = 1, .pr_pgrp = CORE_PID, .pr_sid = CORE_PID};
+    snprintf (prpsinfo.pr_fname,  sizeof (prpsinfo.pr_fname),  "necromancer-gen");
+    snprintf (prpsinfo.pr_psargs, sizeof (prpsinfo.pr_psargs), "necromancer-gen");
+
+    siginfo_t siginfo = {.si_signo = SIGSEGV};
+
+    Elf64_auxv_t auxv[] =
+    {
+        {.a_type = AT_PHDR,   .a_un.a_val = vmas[0].start + sizeof (Elf64_Ehdr)},
+        {.a_type = AT_PAGESZ, .a_un.a_val = PAGESIZE},
+        {.a_type = AT_EXECFN, .a_un.a_val = GetStackTop (stack)},
+        {.a_type = AT_NULL}
+    };
+
+    for (size_t i_thread = 0; i_thread < args->n_threads; i_thread++)
+    {
+        prstatus_t prstatus = {.pr_pid = CORE_PID + i_thread, .pr_ppid = 1, .pr_pgrp = CORE_PID, .pr_sid = CORE_PID,
+                               .pr_info.si_signo = SIGSEGV, .pr_cursig = SIGSEGV};
+        prstatus.pr_reg[16] = vmas[0].start + PAGESIZE / 2;                 // ip
+        prstatus.pr_reg[17] = 0x33;                                         // cs
+        prstatus.pr_reg[18] = 0x246;                                        // flags
+        prstatus.pr_reg[19] = GetStackTop (stack) - 8 * i_thread;         // sp
+        prstatus.pr_reg[20] = 0x2b;                                         // ss
+
+        if (AddNote (notes, NT_PRSTATUS, &prstatus, sizeof (prstatus)))
+            return -1;
+
+        if (i_thread == 0)
+            if (AddNote (notes, NT_PRPSINFO, &prpsinfo, sizeof (prpsinfo)) ||
+                AddNote (notes, NT_SIGINFO, &siginfo, sizeof (siginfo)) ||
+                AddNote (notes, NT_AUXV, auxv, sizeof (auxv)) ||
+                AddFileNote (notes, args, vmas))
+                return -1;
+
+        if (AddNote (notes, NT_FPREGSET, &fpregset, sizeof (fpregset)))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Coredump
+*/
+
+// Nonzero pages are written by runs, zero pages are left as holes
+static int WriteSegment (int fd, off_t offset, const GenArgs* args, const GenVma* vma, char* chunk)
+{
+    for (size_t chunk_start = 0; chunk_start < vma->n_pages; chunk_start += WRITE_CHUNK_PAGES)
+    {
+        size_t chunk_end = chunk_start + WRITE_CHUNK_PAGES < vma->n_pages ? chunk_start + WRITE_CHUNK_PAGES : vma->n_pages;
+        size_t run_start = chunk_start;
+
+        for (size_t page = chunk_start; page <= chunk_end; page++)
+        {
+            uint64_t vaddr = vma->start + page * PAGESIZE;
+            if (page < chunk_end && !IsZeroGenPage (args, vaddr))
+            {
+                FillGenPage (args, vaddr, chunk + (page - chunk_start) * PAGESIZE);
+                continue;
+            }
+
+            size_t len = (page - run_start) * PAGESIZE;
+            if (len && pwrite (fd, chunk + (run_start - chunk_start) * PAGESIZE, len,
+                               offset + run_start * PAGESIZE) != (ssize_t) len)
+                return -1;
+            run_start = page + 1;
+        }
+    }
+
+    return 0;
+}
+
+static int WriteCore (const GenArgs* args, const GenVma* vmas, size_t* core_size)
+{
+    char filename[MAX_PATH_LEN] = "";
+    snprintf (filename, sizeof (filename), "%s/core", args->output_path);
+
+    NoteBuffer notes = {};
+    size_t n_phdrs = args->n_vmas + 1;
+    Elf64_Phdr* phdrs = (Elf64_Phdr*) calloc (n_phdrs, sizeof (*phdrs));
+    char* chunk = (char*) malloc (WRITE_CHUNK_PAGES * PAGESIZE);
+    int fd = -1, res = -1;
+
+    if (!phdrs || !chunk || CreateNotes (&notes, args, vmas))
+    {
+        perror ("Can't create coredump");
+        goto finish;
+    }
+
+    Elf64_Ehdr ehdr = {.e_type = ET_CORE, .e_machine = EM_X86_64, .e_version = EV_CURRENT, .e_phoff = sizeof (ehdr),
+                       .e_ehsize = sizeof (ehdr), .e_phentsize = sizeof (*phdrs), .e_phnum = n_phdrs};
+    memcpy (ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS]   = ELFCLASS64;
+    ehdr.e_ident[EI_DATA]    = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI]   = ELFOSABI_NONE;
+
+    off_t offset = sizeof (ehdr) + n_phdrs * sizeof (*phdrs);
+    phdrs[0] = (Elf64_Phdr) {.p_type = PT_NOTE, .p_offset = offset, .p_filesz = notes.size};
+    offset = (offset + notes.size + PAGESIZE - 1) & ~(off_t) (PAGESIZE - 1);
+
+    for (size_t i_vma = 0; i_vma < args->n_vmas; i_vma++)
+    {
+        const GenVma* vma = vmas + i_vma;
+        phdrs[i_vma + 1] = (Elf64_Phdr) {.p_type = PT_LOAD, .p_offset = offset, .p_vaddr = vma->start,
+                                         .p_filesz = vma->n_pages * PAGESIZE, .p_memsz = vma->n_pages * PAGESIZE,
+                                         .p_flags = PF_R | ((vma->prot & PROT_WRITE) ? PF_W : 0) |
+                                                    ((vma->prot & PROT_EXEC) ? PF_X : 0),
+                                         .p_align = PAGESIZE};
+        offset += vma->n_pages * PAGESIZE;
+    }
+
+    fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate (fd, offset))
+    {
+        perror ("Can't create coredump");
+        goto finish;
+    }
+
+    if (pwrite (fd, &ehdr, sizeof (ehdr), 0) != sizeof (ehdr) ||
+        pwrite (fd, phdrs, n_phdrs * sizeof (*phdrs), sizeof (ehdr)) != (ssize_t) (n_phdrs * sizeof (*phdrs)) ||
+        pwrite (fd, notes.buf, notes.size, phdrs[0].p_offset) != (ssize_t) notes.size)
+    {
+        perror ("Can't write headers of coredump");
+        goto finish;
+    }
+
+    for (size_t i_vma = 0; i_vma < args->n_vmas; i_vma++)
+        if (WriteSegment (fd, phdrs[i_vma + 1].p_offset, args, vmas + i_vma, chunk))
+        {
+            perror ("Can't write memory of coredump");
+            goto finish;
+        }
+
+    *core_size = offset;
+    res = 0;
+
+finish:
+    if (fd != -1)
+        close (fd);
+    free (notes.buf);
+    free (phdrs);
+    free (chunk);
+    return res;
+}
+
+/*
+    Donor's images
+*/
+
+// Image is magic and messages with their sizes, like ImageWriter writes
+static FILE* OpenImage (const GenArgs* args, const char* name, CriuMagic magic)
+{
+    char filename[MAX_PATH_LEN] = "";
+    snprintf (filename, sizeof (filename), "%s/donor/%s.img", args->output_path, name);
+
+    FILE* file = fopen (filename, "wb");
+    if (!file)
+    {
+        perror (filename);
+        return NULL;
+    }
+
+    fwrite (&magic.magic0, sizeof (magic.magic0), 1, file);
+    fwrite (&magic.magic1, sizeof (magic.magic1), 1, file);
+    return file;
+}
+
+static int WriteImageMessage (FILE* file, MessagePacker packer, const void* message, size_t size)
+{
+    uint8_t* packed = (uint8_t*) malloc (size + 1);
+    if (!packed)
+        return -1;
+
+    packer (message, packed);
+    uint32_t size32 = size;
+    int res = (fwrite (&size32, sizeof (size32), 1, file) == 1 && fwrite (packed, 1, size, file) == size) ? 0 : -1;
+
+    free (packed);
+    return res;
+}
+
+static int CloseImage (FILE* file, int res)
+{
+    if (fclose (file))
+        res = -1;
+    return res;
+}
+
+static int WritePstree (const GenArgs* args)
+{
+    uint32_t threads[] = {DONOR_PID};
+    PstreeEntry entry = PSTREE_ENTRY__INIT;
+    entry.pid = entry.pgid = entry.sid = DONOR_PID;
+    entry.n_threads = 1;
+    entry.threads = threads;
+
+    FILE* file = OpenImage (args, "pstree", MY_PSTREE_MAGIC);
+    if (!file)
+        return -1;
+    return CloseImage (file, WriteImageMessage (file, (MessagePacker*) pstree_entry__pack, &entry,
+                                                pstree_entry__get_packed_size (&entry)));
+}
+
+// Registers are replaced from coredump, but arrays of fpregs must have their sizes
+static int WriteDonorCore (const GenArgs* args)
+{
+    uint32_t st_space[32] = {}, xmm_space[64] = {}, padding[24] = {};
+
+    UserX86RegsEntry gpregs = USER_X86_REGS_ENTRY__INIT;
+    UserX86FpregsEntry fpregs = USER_X86_FPREGS_ENTRY__INIT;
+    fpregs.n_st_space  = sizeof (st_space)  / sizeof (*st_space);
+    fpregs.st_space    = st_space;
+    fpregs.n_xmm_space = sizeof (xmm_space) / sizeof (*xmm_space);
+    fpregs.xmm_space   = xmm_space;
+    fpregs.n_padding   = sizeof (padding)   / sizeof (*padding);
+    fpregs.padding     = padding;
+
+    ThreadInfoX86 thread_info = THREAD_INFO_X86__INIT;
+    thread_info.gpregs = &gpregs;
+    thread_info.fpregs = &fpregs;
+
+    SignalQueueEntry signals_s = SIGNAL_QUEUE_ENTRY__INIT, signals_p = SIGNAL_QUEUE_ENTRY__INIT;
+
+    TaskCoreEntry tc = TASK_CORE_ENTRY__INIT;
+    tc.task_state = 1; // alive
+    tc.comm = (char*) "necromancer-gen";
+    tc.signals_s = &signals_s;
+
+    TaskKobjIdsEntry ids = TASK_KOBJ_IDS_ENTRY__INIT;
+    ids.vm_id = ids.files_id = ids.fs_id = ids.sighand_id = 1;
+
+    CredsEntry creds = CREDS_ENTRY__INIT;
+    creds.uid = creds.euid = creds.suid = creds.fsuid = 1000;
+    creds.gid = creds.egid = creds.sgid = creds.fsgid = 1000;
+
+    ThreadCoreEntry thread_core = THREAD_CORE_ENTRY__INIT;
+    thread_core.futex_rla_len = 24;
+    thread_core.signals_p = &signals_p;
+    thread_core.creds = &creds;
+
+    CoreEntry core = CORE_ENTRY__INIT;
+    core.mtype = CORE_ENTRY__MARCH__X86_64;
+    core.thread_info = &thread_info;
+    core.tc = &tc;
+    core.ids = &ids;
+    core.thread_core = &thread_core;
+
+    char name[MAX_PATH_LEN] = "";
+    snprintf (name, sizeof (name), "core-%d", DONOR_PID);
+    FILE* file = OpenImage (args, name, MY_CORE_MAGIC);
+    if (!file)
+        return -1;
+    return CloseImage (file, WriteImageMessage (file, (MessagePacker*) core_entry__pack, &core,
+                                                core_entry__get_packed_size (&core)));
+}
+
+static int WriteMm (const GenArgs* args, const GenVma* vmas)
+{
+    VmaEntry* vma_entries = (VmaEntry*) calloc (args->n_vmas, sizeof (*vma_entries));
+    VmaEntry** vma_ptrs = (VmaEntry**) calloc (args->n_vmas, sizeof (*vma_ptrs));
+    if (!vma_entries || !vma_ptrs)
+    {
+        free (vma_entries);
+        free (vma_ptrs);
+        return -1;
+    }
+
+    for (size_t i_vma = 0; i_vma < args->n_vmas; i_vma++)
+    {
+        const GenVma* vma = vmas + i_vma;
+        VmaEntry* entry = vma_entries + i_vma;
+        vma_entry__init (entry);
+
+        entry->start = vma->start - DONOR_SHIFT;
+        entry->end   = entry->start + vma->n_pages * PAGESIZE;
+        entry->prot  = vma->prot;
+        entry->fd    = -1;
+
+        if (vma->file != -1)
+        {
+            entry->shmid  = vma->file + 1; // id in files.img
+            entry->flags  = MAP_PRIVATE;
+            entry->status = VMA_AREA_REGULAR | VMA_FILE_PRIVATE;
+        }
+        else
+        {
+            entry->flags  = MAP_PRIVATE | MAP_ANONYMOUS | (vma->is_stack ? MAP_GROWSDOWN : 0);
+            entry->status = VMA_AREA_REGULAR | VMA_ANON_PRIVATE | (vma->is_stack ? VMA_AREA_STACK : 0);
+        }
+
+        vma_ptrs[i_vma] = entry;
+    }
+
+    const GenVma* stack = vmas + args->n_vmas - 1;
+    uint64_t exe_start = vmas[0].start - DONOR_SHIFT;
+    uint64_t exe_end   = exe_start + vmas[0].n_pages * PAGESIZE;
+    uint64_t stack_top = GetStackTop (stack) - DONOR_SHIFT;
+
+    uint64_t auxv[] = {AT_PHDR, exe_start + sizeof (Elf64_Ehdr), AT_PAGESZ, PAGESIZE, AT_EXECFN, stack_top, AT_NULL, 0};
+
+    MmEntry mm = MM_ENTRY__INIT;
+    mm.mm_start_code  = exe_start;
+    mm.mm_end_code    = exe_end;
+    mm.mm_start_data  = mm.mm_end_data = exe_end;
+    mm.mm_start_brk   = mm.mm_brk = exe_end + PAGESIZE;
+    mm.mm_start_stack = stack_top - PAGESIZE;
+    mm.mm_arg_start   = mm.mm_arg_end = mm.mm_env_start = mm.mm_env_end = stack_top;
+    mm.exe_file_id    = 1;
+    mm.n_mm_saved_auxv = sizeof (auxv) / sizeof (*auxv);
+    mm.mm_saved_auxv  = auxv;
+    mm.n_vmas = args->n_vmas;
+    mm.vmas   = vma_ptrs;
+
+    char name[MAX_PATH_LEN] = "";
+    snprintf (name, sizeof (name), "mm-%d", DONOR_PID);
+    FILE* file = OpenImage (args, name, MY_MM_MAGIC);
+    int res = file ? CloseImage (file, WriteImageMessage (file, (MessagePacker*) mm_entry__pack, &mm,
+                                                          mm_entry__get_packed_size (&mm))) : -1;
+
+    free (vma_entries);
+    free (vma_ptrs);
+    return res;
+}
+
+static int WriteFiles (const GenArgs* args)
+{
+    FILE* file = OpenImage (args, "files", MY_FILES_MAGIC);
+    if (!file)
+        return -1;
+
+    int res = 0;
+    char name[MAX_PATH_LEN] = "";
+    for (size_t i_file = 0; i_file < args->n_files && !res; i_file++)
+    {
+        GetFileName (i_file, name, sizeof (name));
+
+        FownEntry fown = FOWN_ENTRY__INIT;
+        RegFileEntry reg = REG_FILE_ENTRY__INIT;
+        reg.id = i_file + 1;
+        reg.flags = O_RDONLY;
+        reg.fown = &fown;
+        reg.name = name;
+
+        FileEntry entry = FILE_ENTRY__INIT;
+        entry.type = FD_TYPES__REG;
+        entry.id = reg.id;
+        entry.reg = &reg;
+
+        res = WriteImageMessage (file, (MessagePacker*) file_entry__pack, &entry, file_entry__get_packed_size (&entry));
+    }
+
+    return CloseImage (file, res);
+}
+
+// Donor has the first page of every VMA, it's equal to page of coredump: --parent finds it
+static int WritePagemap (const GenArgs* args, const GenVma* vmas)
+{
+    char name[MAX_PATH_LEN] = "";
+    snprintf (name, sizeof (name), "pagemap-%d", DONOR_PID);
+    FILE* pagemap = OpenImage (args, name, MY_PAGEMAP_MAGIC);
+    if (!pagemap)
+        return -1;
+
+    snprintf (name, sizeof (name), "%s/donor/pages-%u.img", args->output_path, DONOR_PAGES_ID);
+    FILE* pages = fopen (name, "wb");
+    if (!pages)
+    {
+        perror (name);
+        return CloseImage (pagemap, -1);
+    }
+
+    PagemapHead head = PAGEMAP_HEAD__INIT;
+    head.pages_id = DONOR_PAGES_ID;
+    int res = WriteImageMessage (pagemap, (MessagePacker*) pagemap_head__pack, &head, pagemap_head__get_packed_size (&head));
+
+    char page[PAGESIZE];
+    for (size_t i_vma = 0; i_vma < args->n_vmas && !res; i_vma++)
+    {
+        uint64_t vaddr = vmas[i_vma].start;
+        if (IsZeroGenPage (args, vaddr))
+            continue;
+
+        PagemapEntry entry = PAGEMAP_ENTRY__INIT;
+        entry.vaddr = vaddr - DONOR_SHIFT;
+        entry.nr_pages = 1;
+        entry.has_flags = 1;
+        entry.flags = PE_PRESENT;
+
+        FillGenPage (args, vaddr, page);
+        res = WriteImageMessage (pagemap, (MessagePacker*) pagemap_entry__pack, &entry, pagemap_entry__get_packed_size (&entry));
+        if (!res && fwrite (page, PAGESIZE, 1, pages) != 1)
+            res = -1;
+    }
+
+    res = CloseImage (pages, res);
+    return CloseImage (pagemap, res);
+}
+
+int main (int argc, char** argv)
+{
+    GenArgs args = {};
+    if (GenParseArguments (argc, argv, &args))
+        return 1;
+
+    char donor_path[MAX_PATH_LEN] = "";
+    snprintf (donor_path, sizeof (donor_path), "%s/donor", args.output_path);
+    if ((mkdir (args.output_path, 0755) && errno != EEXIST) || (mkdir (donor_path, 0755) && errno != EEXIST))
+    {
+        perror ("Can't create output directory");
+        return 1;
+    }
+
+    GenVma* vmas = CreateLayout (&args);
+    if (!vmas)
+    {
+        perror ("Can't create layout of memory");
+        return 1;
+    }
+
+    size_t core_size = 0;
+    int res = WriteCore (&args, vmas, &core_size);
+
+    #define check_write(retval, name) if (!res && (retval))                                         \
+                                      {                                                             \
+                                          fprintf (stderr, "Error: Can't write %s image.\n", name); \
+                                          res = -1;                                                 \
+                                      }
+
+    check_write (WritePstree (&args), "pstree")
+    check_write (WriteDonorCore (&args), "core")
+    check_write (WriteMm (&args, vmas), "mm")
+    check_write (WriteFiles (&args), "files")
+    check_write (WritePagemap (&args, vmas), "pagemap")
+
+    #undef check_write
+
+    size_t n_pages = 0;
+    for (size_t i_vma = 0; i_vma < args.n_vmas; i_vma++)
+        n_pages += vmas[i_vma].n_pages;
+
+    // It's parsed by bench.sh
+    if (!res)
+        printf ("core_size=%zu pages=%zu vmas=%zu threads=%zu zero_pct=%u\n",
+                core_size, n_pages, args.n_vmas, args.n_threads, args.zero_pct);
+
+    free (vmas);
+    return res ? 1 : 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "jobs.h"
+
+typedef struct
+{
+    JobFunc* func;
+    void* ctx;
+    size_t n_tasks;
+    size_t next_task;
+    int error;
+} JobQueue;
+
+static void* JobWorker (void* arg)
+{
+    JobQueue* queue = (JobQueue*) arg;
+
+    while (!__atomic_load_n (&queue->error, __ATOMIC_RELAXED))
+    {
+        size_t i_task = __atomic_fetch_add (&queue->next_task, 1, __ATOMIC_RELAXED);
+        if (i_task >= queue->n_tasks)
+            break;
+
+        if (queue->func (queue->ctx, i_task))
+            __atomic_store_n (&queue->error, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+int RunJobs (size_t n_jobs, size_t n_tasks, JobFunc* func, void* ctx)
+{
+    assert (func);
+
+    JobQueue queue = {.func = func, .ctx = ctx, .n_tasks = n_tasks};
+    if (n_jobs > n_tasks)
+        n_jobs = n_tasks;
+
+    pthread_t* threads = NULL;
+    size_t n_threads = 0;
+
+    if (n_jobs > 1)
+    {
+        threads = (pthread_t*) calloc (n_jobs - 1, sizeof (*threads));
+        if (!threads)
+            perror ("Can't allocate memory, working in one thread");
+    }
+
+    for (; threads && n_threads < n_jobs - 1; n_threads++)
+        if (pthread_create (threads + n_threads, NULL, JobWorker, &queue))
+        {
+            fprintf (stderr, "Warning: Can't create thread, working with %zu threads.\n", n_threads + 1);
+            break;
+        }
+
+    JobWorker (&queue);
+
+    for (size_t i_thread = 0; i_thread < n_threads; i_thread++)
+        pthread_join (threads[i_thread], NULL);
+
+    free (threads);
+    return queue.error ? -1 : 0;
+}
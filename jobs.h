@@ -0,0 +1,9 @@
+// Simple pool of worker threads. Tasks are numbered 0 ... n_tasks - 1,
+// each free thread takes next task. Caller's thread is working too.
+
+// Returns non-zero value in case of error in the task
+typedef int JobFunc (void* ctx, size_t i_task);
+
+// Returns 0 if all tasks are done without errors, -1 otherwise.
+// After first error remaining tasks aren't started.
+int RunJobs (size_t n_jobs, size_t n_tasks, JobFunc* func, void* ctx);
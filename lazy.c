@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/userfaultfd.h>
+#include "lazy.h"
+
+static const uint64_t READAHEAD_PAGES = 16;  // pages after faulted one are copied with it, if they are in the same range
+static const uint64_t PROBE_INTERVAL  = 1000; // ms, exit of processes is checked so often
+static const int RETRY_INTERVAL       = 10;   // ms, faults interrupted by changes of memory map are repeated so often
+static const size_t MAX_SCM_FDS       = 16;   // criu sends one fd, but message with more of them isn't lost
+
+// Userfaultfd of one restored process (or of its child: fork is reported by event with new userfaultfd)
+typedef struct
+{
+    int uffd;
+    int pid;
+    LazyRange* ranges; // own copy, it's changed by mremap, munmap and madvise of process
+    size_t n_ranges;
+    uint64_t probe;    // the last served page, 0 before the first fault
+    uint64_t* pending; // faults, which got EAGAIN while memory map was changed
+    size_t n_pending, pending_capacity;
+} LazyTask;
+
+typedef struct
+{
+    LazyTask* tasks;
+    size_t n_tasks, capacity;
+    struct pollfd* fds; // client and tasks, capacity + 1
+    size_t page_size;
+    size_t n_copied, n_zero;
+} LazyServer;
+
+static volatile sig_atomic_t stop_serving = 0;
+
+static void StopHandler (int signum)
+{
+    (void) signum;
+    stop_serving = 1;
+}
+
+static uint64_t GetTimeMs (void)
+{
+    struct timespec now = {};
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int AddTask (LazyServer* server, int uffd, int pid, const LazyRange* ranges, size_t n_ranges)
+{
+    if (server->n_tasks == server->capacity)
+    {
+        size_t new_capacity = server->capacity ? 2 * server->capacity : 16;
+        LazyTask* new_tasks = (LazyTask*) realloc (server->tasks, new_capacity * sizeof (*new_tasks));
+        struct pollfd* new_fds = new_tasks ? (struct pollfd*) realloc (server->fds, (new_capacity + 1) * sizeof (*new_fds)) : NULL;
+        if (new_tasks)
+            server->tasks = new_tasks;
+        if (!new_fds)
+        {
+            perror ("Can't allocate memory");
+            return -1;
+        }
+
+        server->fds = new_fds;
+        server->capacity = new_capacity;
+    }
+
+    LazyRange* own_ranges = (LazyRange*) calloc (n_ranges + 1, sizeof (*own_ranges));
+    if (!own_ranges)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+    if (n_ranges)
+        memcpy (own_ranges, ranges, n_ranges * sizeof (*own_ranges));
+
+    // Descriptor is polled, its flags are shared with restorer, which doesn't use it after sending
+    fcntl (uffd, F_SETFL, fcntl (uffd, F_GETFL) | O_NONBLOCK);
+
+    server->tasks[server->n_tasks++] = (LazyTask) {.uffd = uffd, .pid = pid, .ranges = own_ranges, .n_ranges = n_ranges};
+    return 0;
+}
+
+// The last task takes place of removed one
+static void RemoveTask (LazyServer* server, size_t i_task)
+{
+    LazyTask* task = server->tasks + i_task;
+    close (task->uffd);
+    free (task->ranges);
+    free (task->pending);
+
+    server->tasks[i_task] = server->tasks[--server->n_tasks];
+    return;
+}
+
+static const LazyRange* FindRange (const LazyTask* task, uint64_t addr)
+{
+    size_t left = 0, right = task->n_ranges;
+    while (left < right)
+    {
+        size_t middle = left + (right - left) / 2;
+        if (task->ranges[middle].end <= addr)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+
+    return (left < task->n_ranges && task->ranges[left].start <= addr) ? task->ranges + left : NULL;
+}
+
+static int CompareRanges (const void* first, const void* second)
+{
+    uint64_t first_start = ((const LazyRange*) first)->start, second_start = ((const LazyRange*) second)->start;
+    return (first_start > second_start) - (first_start < second_start);
+}
+
+static void PushRange (LazyRange* ranges, size_t* n_ranges, const LazyRange* from, uint64_t start, uint64_t end, uint64_t new_start)
+{
+    if (start < end)
+        ranges[(*n_ranges)++] = (LazyRange) {.start = new_start, .end = new_start + (end - start),
+                                             .data = from->data + (start - from->start)};
+    return;
+}
+
+// Parts of ranges in [start, end) are moved to new_start (mremap) or removed (munmap, MADV_DONTNEED: memory is zero after it)
+static int ChangeRanges (LazyTask* task, uint64_t start, uint64_t end, uint64_t new_start, int remove)
+{
+    // Range, which contains both borders, is cut to 3 parts
+    LazyRange* new_ranges = (LazyRange*) calloc (task->n_ranges + 3, sizeof (*new_ranges));
+    if (!new_ranges)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    size_t n_new = 0;
+    for (size_t i_range = 0; i_range < task->n_ranges; i_range++)
+    {
+        const LazyRange* range = task->ranges + i_range;
+        uint64_t inside_start = (range->start > start) ? range->start : start;
+        uint64_t inside_end   = (range->end   < end)   ? range->end   : end;
+
+        PushRange (new_ranges, &n_new, range, range->start, (range->end < start) ? range->end : start, range->start);
+        if (!remove)
+            PushRange (new_ranges, &n_new, range, inside_start, inside_end, new_start + (inside_start - start));
+        PushRange (new_ranges, &n_new, range, (range->start > end) ? range->start : end, range->end,
+                                              (range->start > end) ? range->start : end);
+    }
+
+    qsort (new_ranges, n_new, sizeof (*new_ranges), CompareRanges);
+
+    free (task->ranges);
+    task->ranges = new_ranges;
+    task->n_ranges = n_new;
+    return 0;
+}
+
+// 0 - page is in place, 1 - fault must be repeated later, -1 - process exited
+static int ServeFault (LazyServer* server, LazyTask* task, uint64_t page)
+{
+    const LazyRange* range = FindRange (task, page);
+    int res = 0;
+
+    if (range)
+    {
+        uint64_t len = (range->end - page < READAHEAD_PAGES * server->page_size) ? range->end - page : READAHEAD_PAGES * server->page_size;
+        struct uffdio_copy copy = {.dst = page, .src = (uintptr_t) (range->data + (page - range->start)), .len = len};
+        res = ioctl (task->uffd, UFFDIO_COPY, &copy);
+
+        // Copying stops at page, which is already present: faulted page is copied anyway
+        if (copy.copy > 0)
+        {
+            server->n_copied += copy.copy / server->page_size;
+            res = 0;
+        }
+    }
+    else
+    {
+        struct uffdio_zeropage zero = {.range = {.start = page, .len = server->page_size}};
+        res = ioctl (task->uffd, UFFDIO_ZEROPAGE, &zero);
+        if (res == 0)
+            server->n_zero++;
+    }
+
+    if (res == 0)
+    {
+        task->probe = page;
+        return 0;
+    }
+
+    switch (errno)
+    {
+        case EAGAIN:
+            return 1;
+
+        case ESRCH:
+            return -1;
+
+        case EEXIST: // page was copied by readahead of other fault, thread is only woken
+            task->probe = page;
+            break;
+
+        case ENOENT: // memory is unmapped, its event is in queue
+            return 0;
+
+        default:
+            fprintf (stderr, "Warning: Can't give page %#lx to process %d: %s.\n", page, task->pid, strerror (errno));
+            break;
+    }
+
+    struct uffdio_range wake = {.start = page, .len = server->page_size};
+    ioctl (task->uffd, UFFDIO_WAKE, &wake);
+    return 0;
+}
+
+static int AddPending (LazyTask* task, uint64_t page)
+{
+    if (task->n_pending == task->pending_capacity)
+    {
+        size_t new_capacity = task->pending_capacity ? 2 * task->pending_capacity : 16;
+        uint64_t* new_pending = (uint64_t*) realloc (task->pending, new_capacity * sizeof (*new_pending));
+        if (!new_pending)
+        {
+            perror ("Can't allocate memory");
+            return -1;
+        }
+
+        task->pending = new_pending;
+        task->pending_capacity = new_capacity;
+    }
+
+    task->pending[task->n_pending++] = page;
+    return 0;
+}
+
+// Faults and events of memory map are read, until queue is empty. -1 means, that task must be removed.
+static int HandleEvents (LazyServer* server, size_t i_task)
+{
+    struct uffd_msg msg = {};
+
+    for (;;)
+    {
+        LazyTask* task = server->tasks + i_task; // tasks can be moved by fork
+        ssize_t n_read = read (task->uffd, &msg, sizeof (msg));
+        if (n_read < 0 && errno == EAGAIN)
+            return 0;
+        if (n_read != sizeof (msg))
+        {
+            fprintf (stderr, "Warning: Can't read userfaultfd of process %d, its pages aren't given more.\n", task->pid);
+            return -1;
+        }
+
+        int res = 0;
+        switch (msg.event)
+        {
+            case UFFD_EVENT_PAGEFAULT:
+            {
+                uint64_t page = msg.arg.pagefault.address & ~((uint64_t) server->page_size - 1);
+                res = ServeFault (server, task, page);
+                if (res == 1)
+                    res = AddPending (task, page);
+                break;
+            }
+
+            case UFFD_EVENT_FORK: // child has the same memory
+                res = AddTask (server, (int) msg.arg.fork.ufd, task->pid, task->ranges, task->n_ranges);
+                if (res == 0)
+                    server->tasks[server->n_tasks - 1].probe = server->tasks[i_task].probe;
+                break;
+
+            case UFFD_EVENT_REMAP:
+                res = ChangeRanges (task, msg.arg.remap.from, msg.arg.remap.from + msg.arg.remap.len, msg.arg.remap.to, 0);
+                break;
+
+            case UFFD_EVENT_REMOVE:
+            case UFFD_EVENT_UNMAP:
+                res = ChangeRanges (task, msg.arg.remove.start, msg.arg.remove.end, 0, 1);
+                break;
+
+            default:
+                break;
+        }
+
+        if (res)
+            return -1;
+    }
+}
+
+static int RetryPending (LazyServer* server, LazyTask* task)
+{
+    size_t n_left = 0;
+    for (size_t i_pending = 0; i_pending < task->n_pending; i_pending++)
+    {
+        int res = ServeFault (server, task, task->pending[i_pending]);
+        if (res == -1)
+            return -1;
+        if (res == 1)
+            task->pending[n_left++] = task->pending[i_pending];
+    }
+
+    task->n_pending = n_left;
+    return 0;
+}
+
+/*
+    Userfaultfd doesn't report exit of process, but its ioctls fail with ESRCH after it. The last served page is
+    asked again: it's present (EEXIST), unmapped (ENOENT) or removed by process, then zero page is right for it.
+    Before the first fault the first lazy page is given, as if it was faulted.
+    Task without lazy ranges isn't kept: all its missing pages are zero, kernel gives them after userfaultfd is closed.
+*/
+static int IsTaskAlive (LazyServer* server, LazyTask* task)
+{
+    if (task->n_ranges == 0)
+        return 0;
+
+    int res = 0;
+    if (task->probe)
+    {
+        struct uffdio_zeropage zero = {.range = {.start = task->probe, .len = server->page_size}, .mode = UFFDIO_ZEROPAGE_MODE_DONTWAKE};
+        res = ioctl (task->uffd, UFFDIO_ZEROPAGE, &zero);
+    }
+    else
+    {
+        struct uffdio_copy copy = {.dst = task->ranges[0].start, .src = (uintptr_t) task->ranges[0].data,
+                                   .len = server->page_size, .mode = UFFDIO_COPY_MODE_DONTWAKE};
+        res = ioctl (task->uffd, UFFDIO_COPY, &copy);
+        if (res == 0)
+            server->n_copied++;
+        if (res == 0 || errno == EEXIST)
+            task->probe = task->ranges[0].start;
+    }
+
+    return res == 0 || errno != ESRCH;
+}
+
+static int ReceiveFd (int sk)
+{
+    char data[256] = "";
+    char control[CMSG_SPACE (MAX_SCM_FDS * sizeof (int))];
+    memset (control, 0, sizeof (control));
+
+    struct iovec iov = {.iov_base = data, .iov_len = sizeof (data)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof (control)};
+    if (recvmsg (sk, &msg, MSG_CMSG_CLOEXEC) < 0)
+        return -1;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len >= CMSG_LEN (sizeof (int)))
+        {
+            int fd = -1;
+            memcpy (&fd, CMSG_DATA (cmsg), sizeof (fd));
+            return fd;
+        }
+
+    return -1;
+}
+
+// 0 - process is added, 1 - restore is finished
+static int ReceiveProcess (LazyServer* server, int client, const LazyProcess* processes, size_t n_processes)
+{
+    int pid = 0;
+    ssize_t n_read = recv (client, &pid, sizeof (pid), 0);
+    if (n_read == 0 || (n_read == sizeof (pid) && pid == 0))
+        return 1;
+    if (n_read != sizeof (pid))
+    {
+        fprintf (stderr, "Error: Bad message from criu restore.\n");
+        return -1;
+    }
+
+    // Zombie or process without lazy memory
+    if (pid < 0)
+        return 0;
+
+    int uffd = ReceiveFd (client);
+    if (uffd < 0)
+    {
+        fprintf (stderr, "Error: Can't receive userfaultfd of process %d.\n", pid);
+        return -1;
+    }
+
+    const LazyProcess* process = NULL;
+    for (size_t i_process = 0; i_process < n_processes && !process; i_process++)
+        if (processes[i_process].pid == pid)
+            process = processes + i_process;
+
+    if (!process)
+        fprintf (stderr, "Warning: Process %d isn't converted now, its lazy memory will be zero.\n", pid);
+
+    if (AddTask (server, uffd, pid, process ? process->ranges : NULL, process ? process->n_ranges : 0))
+    {
+        close (uffd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int LazyPagesServe (const char* socket_path, const LazyProcess* processes, size_t n_processes, size_t page_size)
+{
+    assert (socket_path);
+    assert (processes || n_processes == 0);
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen (socket_path) >= sizeof (addr.sun_path))
+    {
+        fprintf (stderr, "Error: Path of socket %s is too long.\n", socket_path);
+        return -1;
+    }
+    strcpy (addr.sun_path, socket_path);
+
+    int listen_sk = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink (socket_path);
+    if (listen_sk < 0 || bind (listen_sk, (struct sockaddr*) &addr, sizeof (addr)) || listen (listen_sk, 1))
+    {
+        fprintf (stderr, "Error: Can't listen on %s: %s.\n", socket_path, strerror (errno));
+        if (listen_sk >= 0)
+            close (listen_sk);
+        return -1;
+    }
+
+    // Without SA_RESTART accept and poll are interrupted, so daemon stops at once
+    struct sigaction stop_action = {.sa_handler = StopHandler}, old_int = {}, old_term = {};
+    sigaction (SIGINT,  &stop_action, &old_int);
+    sigaction (SIGTERM, &stop_action, &old_term);
+    stop_serving = 0;
+
+    fprintf (stderr, "Waiting for criu restore --lazy-pages on %s.\n", socket_path);
+
+    // The first place is for client, descriptors of tasks follow it
+    LazyServer server = {.page_size = page_size, .fds = (struct pollfd*) calloc (1, sizeof (*server.fds))};
+    int res = 0;
+    if (!server.fds)
+    {
+        perror ("Can't allocate memory");
+        res = -1;
+    }
+    int client = (res == 0) ? accept4 (listen_sk, NULL, NULL, SOCK_CLOEXEC) : -1;
+    if (res == 0 && client < 0 && !stop_serving)
+    {
+        perror ("Can't accept criu restore");
+        res = -1;
+    }
+
+    uint64_t last_probe = GetTimeMs();
+    while (res == 0 && !stop_serving && (client != -1 || server.n_tasks))
+    {
+        int has_pending = 0;
+        server.fds[0] = (struct pollfd) {.fd = client, .events = POLLIN};
+        for (size_t i_task = 0; i_task < server.n_tasks; i_task++)
+        {
+            server.fds[i_task + 1] = (struct pollfd) {.fd = server.tasks[i_task].uffd, .events = POLLIN};
+            has_pending |= (server.tasks[i_task].n_pending != 0);
+        }
+
+        size_t n_polled = server.n_tasks;
+        if (poll (server.fds, n_polled + 1, has_pending ? RETRY_INTERVAL : (int) PROBE_INTERVAL) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror ("Can't wait for faults");
+            res = -1;
+            break;
+        }
+
+        if (client != -1 && server.fds[0].revents)
+        {
+            int client_res = ReceiveProcess (&server, client, processes, n_processes);
+            if (client_res == -1)
+                res = -1;
+            else if (client_res == 1)
+            {
+                close (client);
+                client = -1;
+                fprintf (stderr, "Restore is finished, %zu processes get pages on demand. Don't stop necromancer, "
+                                 "while they are running.\n", server.n_tasks);
+            }
+        }
+
+        // Removing moves the last task, so tasks are passed from the end. Tasks added by fork aren't polled yet.
+        int need_probe = (GetTimeMs() - last_probe >= PROBE_INTERVAL);
+        for (size_t i_task = n_polled; i_task-- > 0; )
+        {
+            if ((server.fds[i_task + 1].revents && HandleEvents (&server, i_task)) ||
+                RetryPending (&server, server.tasks + i_task)                     ||
+                (need_probe && !IsTaskAlive (&server, server.tasks + i_task)))
+                RemoveTask (&server, i_task);
+        }
+
+        if (need_probe)
+            last_probe = GetTimeMs();
+    }
+
+    if (stop_serving && server.n_tasks)
+        fprintf (stderr, "Warning: Lazy-pages daemon is stopped, pages, which aren't given yet, are zero in %zu processes.\n",
+                         server.n_tasks);
+    fprintf (stderr, "Lazy pages: %zu copied, %zu zero.\n", server.n_copied, server.n_zero);
+
+    while (server.n_tasks)
+        RemoveTask (&server, server.n_tasks - 1);
+    free (server.tasks);
+    free (server.fds);
+
+    if (client != -1)
+        close (client);
+    close (listen_sk);
+    unlink (socket_path);
+
+    sigaction (SIGINT,  &old_int,  NULL);
+    sigaction (SIGTERM, &old_term, NULL);
+    return res;
+}
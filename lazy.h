@@ -0,0 +1,29 @@
+// Lazy-pages daemon: local replacement of `criu lazy-pages` for `criu restore --lazy-pages`.
+// Restore connects to unix socket in its work directory and sends pid and userfaultfd of every restored process.
+// Pages, which process touches, are copied to it from memory of coredump, so converting doesn't copy them at all.
+//
+// Protocol of socket (criu/uffd.c): SOCK_SEQPACKET, every process is sent as int pid and then its userfaultfd
+// in SCM_RIGHTS, pid < 0 means process without lazy memory, 0 means that restore is finished.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LAZY_PAGES_SOCKET "lazy-pages.socket" // criu/include/uffd.h: LAZY_PAGES_SOCK_NAME
+
+// Range of address space, which is filled from data, addresses are aligned to page
+typedef struct
+{
+    uint64_t start, end;
+    const char* data; // content of start
+} LazyRange;
+
+typedef struct
+{
+    int pid;           // pid in images, criu sends it
+    LazyRange* ranges; // sorted by start, don't overlap
+    size_t n_ranges;
+} LazyProcess;
+
+// Serves faults of processes until all of them exit or SIGINT/SIGTERM is got. Faulted page out of ranges is zero.
+// Pages, which aren't given yet, are lost (become zero), when daemon is stopped before processes.
+int LazyPagesServe (const char* socket_path, const LazyProcess* processes, size_t n_processes, size_t page_size);
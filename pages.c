@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include "pages.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+__attribute__((target ("avx2")))
+static int IsZeroPageAvx2 (const char* page, size_t page_size)
+{
+    for (size_t i_byte = 0; i_byte < page_size; i_byte += 64)
+    {
+        __m256i lo = _mm256_loadu_si256 ((const __m256i*) (page + i_byte));
+        __m256i hi = _mm256_loadu_si256 ((const __m256i*) (page + i_byte + 32));
+        __m256i both = _mm256_or_si256 (lo, hi);
+
+        if (!_mm256_testz_si256 (both, both))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int IsZeroPageSse2 (const char* page, size_t page_size)
+{
+    for (size_t i_byte = 0; i_byte < page_size; i_byte += 64)
+    {
+        __m128i acc = _mm_or_si128 (_mm_loadu_si128 ((const __m128i*) (page + i_byte)),
+                                    _mm_loadu_si128 ((const __m128i*) (page + i_byte + 16)));
+        acc = _mm_or_si128 (acc, _mm_loadu_si128 ((const __m128i*) (page + i_byte + 32)));
+        acc = _mm_or_si128 (acc, _mm_loadu_si128 ((const __m128i*) (page + i_byte + 48)));
+
+        if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (acc, _mm_setzero_si128 ())) != 0xFFFF)
+            return 0;
+    }
+
+    return 1;
+}
+
+__attribute__((target ("avx2")))
+static int IsSamePageAvx2 (const char* page, const char* other, size_t page_size)
+{
+    for (size_t i_byte = 0; i_byte < page_size; i_byte += 64)
+    {
+        __m256i lo = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i*) (page  + i_byte)),
+                                       _mm256_loadu_si256 ((const __m256i*) (other + i_byte)));
+        __m256i hi = _mm256_xor_si256 (_mm256_loadu_si256 ((const __m256i*) (page  + i_byte + 32)),
+                                       _mm256_loadu_si256 ((const __m256i*) (other + i_byte + 32)));
+        __m256i both = _mm256_or_si256 (lo, hi);
+
+        if (!_mm256_testz_si256 (both, both))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int IsSamePageSse2 (const char* page, const char* other, size_t page_size)
+{
+    for (size_t i_byte = 0; i_byte < page_size; i_byte += 64)
+    {
+        __m128i eq = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*) (page + i_byte)),
+                                     _mm_loadu_si128 ((const __m128i*) (other + i_byte)));
+        for (size_t i_part = 16; i_part < 64; i_part += 16)
+            eq = _mm_and_si128 (eq, _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*) (page + i_byte + i_part)),
+                                                    _mm_loadu_si128 ((const __m128i*) (other + i_byte + i_part))));
+
+        if (_mm_movemask_epi8 (eq) != 0xFFFF)
+            return 0;
+    }
+
+    return 1;
+}
+
+#else
+
+static int IsZeroPageSimple (const char* page, size_t page_size)
+{
+    const uint64_t* words = (const uint64_t*) page;
+    for (size_t i_word = 0; i_word < page_size / sizeof (*words); i_word++)
+        if (words[i_word])
+            return 0;
+
+    return 1;
+}
+
+static int IsSamePageSimple (const char* page, const char* other, size_t page_size)
+{
+    return memcmp (page, other, page_size) == 0;
+}
+
+#endif
+
+int IsZeroPage (const char* page, size_t page_size)
+{
+    assert (page);
+    assert (page_size % 64 == 0);
+
+    static int (*checker) (const char*, size_t) = NULL;
+    if (!checker)
+    {
+    #ifdef __x86_64__
+        checker = __builtin_cpu_supports ("avx2") ? IsZeroPageAvx2 : IsZeroPageSse2;
+    #else
+        checker = IsZeroPageSimple;
+    #endif
+    }
+
+    return checker (page, page_size);
+}
+
+int FindNonZeroRun (const char* buf, int fd, size_t offset, size_t page_size,
+                    size_t from_page, size_t n_pages, size_t* run_start, size_t* run_end)
+{
+    assert (buf);
+    assert (run_start);
+    assert (run_end);
+
+    size_t page = from_page;
+    while (page < n_pages)
+    {
+        // Kernel doesn't write zero pages in coredump, it seeks over them. So holes are zero pages.
+        size_t data_end = n_pages;
+        off_t data = lseek (fd, offset + page * page_size, SEEK_DATA);
+
+        if (data == -1 && errno == ENXIO)
+            return 1; // only hole until EOF
+
+        if (data != -1) // -1 with other errno: filesystem doesn't support it, scan everything
+        {
+            size_t data_page = (data - offset) / page_size;
+            if (data_page >= n_pages)
+                return 1;
+            if (data_page > page)
+                page = data_page;
+
+            off_t hole = lseek (fd, data, SEEK_HOLE);
+            if (hole != -1 && (size_t) hole < offset + n_pages * page_size)
+                data_end = (hole - offset + page_size - 1) / page_size;
+        }
+
+        while (page < data_end && IsZeroPage (buf + offset + page * page_size, page_size))
+            page++;
+
+        if (page == data_end)
+            continue;
+
+        *run_start = page;
+        while (page < data_end && !IsZeroPage (buf + offset + page * page_size, page_size))
+            page++;
+        *run_end = page;
+
+        return 0;
+    }
+
+    return 1;
+}
+
+int IsSamePage (const char* page, const char* other, size_t page_size)
+{
+    assert (page);
+    assert (other);
+    assert (page_size % 64 == 0);
+
+    static int (*checker) (const char*, const char*, size_t) = NULL;
+    if (!checker)
+    {
+    #ifdef __x86_64__
+        checker = __builtin_cpu_supports ("avx2") ? IsSamePageAvx2 : IsSamePageSse2;
+    #else
+        checker = IsSamePageSimple;
+    #endif
+    }
+
+    return checker (page, other, page_size);
+}
+
+int IsFilePage (const char* page, const char* file, size_t file_size, size_t file_offset, size_t page_size)
+{
+    assert (page);
+    assert (file);
+
+    return file_offset < file_size && IsSamePage (page, file + file_offset, page_size);
+}
+
+int FindChangedRun (const char* buf, size_t offset, const char* file, size_t file_size, size_t file_offset,
+                    size_t page_size, size_t from_page, size_t n_pages, size_t* run_start, size_t* run_end)
+{
+    assert (buf);
+    assert (file);
+    assert (run_start);
+    assert (run_end);
+
+    #define is_file_page(page) IsFilePage (buf + offset + (page) * page_size, file, file_size, file_offset + (page) * page_size, page_size)
+
+    size_t page = from_page;
+    while (page < n_pages && is_file_page (page))
+        page++;
+
+    if (page == n_pages)
+        return 1;
+
+    *run_start = page;
+    while (page < n_pages && !is_file_page (page))
+        page++;
+    *run_end = page;
+
+    #undef is_file_page
+    return 0;
+}
@@ -0,0 +1,24 @@
+// Working with raw page data from coredump.
+
+// Checks that page consists of zero bytes only. SSE2/AVX2 is used if CPU supports it.
+// page_size must be a multiple of 64.
+int IsZeroPage (const char* page, size_t page_size);
+
+// Compares pages by SSE2/AVX2 if CPU supports it. page_size must be a multiple of 64.
+int IsSamePage (const char* page, const char* other, size_t page_size);
+
+// Checks that page is equal to page of file from file_offset, so it can be taken from file mapping.
+// Mapping covers the last page of file wholly (the tail is zero), pages after it are SIGBUS there.
+int IsFilePage (const char* page, const char* file, size_t file_size, size_t file_offset, size_t page_size);
+
+// Finds first run of non-zero pages in segment, starting from page from_page.
+// Segment is placed in file with descriptor fd (and in mapping buf) from offset, it has n_pages pages.
+// Holes in file (SEEK_DATA/SEEK_HOLE) are skipped without reading.
+// Returns 0 and [*run_start, *run_end) in pages, or 1 if there is no such run.
+int FindNonZeroRun (const char* buf, int fd, size_t offset, size_t page_size,
+                    size_t from_page, size_t n_pages, size_t* run_start, size_t* run_end);
+
+// The same for private mapping of file: finds first run of pages, which differ from file (were written by process).
+// Segment is mapped to the whole file from offset file_offset (page aligned), file is mapped to buffer file.
+int FindChangedRun (const char* buf, size_t offset, const char* file, size_t file_size, size_t file_offset,
+                    size_t page_size, size_t from_page, size_t n_pages, size_t* run_start, size_t* run_end);
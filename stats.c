@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+static const uint64_t PROGRESS_INTERVAL = 1000000000; // ns
+
+static const char* const PHASE_NAMES[N_PHASES] = {"elf", "images", "notes", "pages", "write"};
+
+static const char* const COUNTER_NAMES[N_COUNTERS] =
+{
+    "coredumps", "core_bytes", "core_bytes_read", "images_bytes_read", "pages_bytes_written", "images_bytes_written",
+    "pages_emitted", "pages_skipped_zero", "pages_skipped_file", "pages_in_parent", "pages_lazy", "pagemap_entries"
+};
+
+static struct
+{
+    int enabled, progress;
+    uint64_t start, last_progress;
+    uint64_t phases[N_PHASES];
+    uint64_t counters[N_COUNTERS];
+} stats;
+
+static uint64_t GetMonotonicTime (void)
+{
+    struct timespec now = {};
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void StatsEnable (int progress)
+{
+    stats.enabled = 1;
+    stats.progress = progress && isatty (STDERR_FILENO);
+    stats.start = stats.last_progress = GetMonotonicTime();
+}
+
+int StatsEnabled (void)
+{
+    return stats.enabled;
+}
+
+uint64_t StatsNow (void)
+{
+    return stats.enabled ? GetMonotonicTime() : 0;
+}
+
+void StatsPhaseEnd (StatsPhase phase, uint64_t start)
+{
+    if (stats.enabled)
+        __atomic_fetch_add (&stats.phases[phase], GetMonotonicTime() - start, __ATOMIC_RELAXED);
+}
+
+void StatsAdd (StatsCounter counter, uint64_t value)
+{
+    if (stats.enabled)
+        __atomic_fetch_add (&stats.counters[counter], value, __ATOMIC_RELAXED);
+}
+
+static double GetMiB (uint64_t bytes)
+{
+    return (double) bytes / (1 << 20);
+}
+
+void StatsProgress (void)
+{
+    if (!stats.progress)
+        return;
+
+    // Only one thread prints: the one, which moved time of the last progress
+    uint64_t now = GetMonotonicTime();
+    uint64_t last = __atomic_load_n (&stats.last_progress, __ATOMIC_RELAXED);
+    if (now - last < PROGRESS_INTERVAL ||
+        !__atomic_compare_exchange_n (&stats.last_progress, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    uint64_t done  = __atomic_load_n (&stats.counters[COUNTER_CORE_READ],  __ATOMIC_RELAXED);
+    uint64_t total = __atomic_load_n (&stats.counters[COUNTER_CORE_BYTES], __ATOMIC_RELAXED);
+    double seconds = (double) (now - stats.start) / 1e9;
+
+    if (total)
+        fprintf (stderr, "\rConverted %.0f / %.0f MiB (%.0f%%), %.1f MiB/s ", GetMiB (done), GetMiB (total),
+                         (done < total) ? 100.0 * done / total : 100.0, GetMiB (done) / seconds);
+    else
+        fprintf (stderr, "\rConverted %.0f MiB, %.1f MiB/s ", GetMiB (done), GetMiB (done) / seconds);
+}
+
+int StatsWrite (FILE* file)
+{
+    if (!stats.enabled)
+        return 0;
+
+    uint64_t wall = GetMonotonicTime() - stats.start;
+    if (stats.progress && stats.last_progress != stats.start)
+        fprintf (stderr, "\n");
+
+    struct rusage usage = {};
+    getrusage (RUSAGE_SELF, &usage);
+
+    fprintf (file, "{\"wall_ms\": %.3f, \"phases_ms\": {", wall / 1e6);
+    for (int i_phase = 0; i_phase < N_PHASES; i_phase++)
+        fprintf (file, "%s\"%s\": %.3f", i_phase ? ", " : "", PHASE_NAMES[i_phase], stats.phases[i_phase] / 1e6);
+    fprintf (file, "}");
+
+    for (int i_counter = 0; i_counter < N_COUNTERS; i_counter++)
+        fprintf (file, ", \"%s\": %" PRIu64, COUNTER_NAMES[i_counter], stats.counters[i_counter]);
+
+    // Speed by page data of coredumps, it's the most of work
+    double seconds = wall / 1e9;
+    fprintf (file, ", \"core_mib_per_s\": %.1f, \"peak_rss_kib\": %ld, \"user_s\": %.3f, \"sys_s\": %.3f}\n",
+             seconds > 0 ? GetMiB (stats.counters[COUNTER_CORE_READ]) / seconds : 0.0, usage.ru_maxrss,
+             usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+
+    return ferror (file) ? -1 : 0;
+}
@@ -0,0 +1,50 @@
+// Statistics of converting (--stats): time of phases, counters of bytes and pages, peak RSS.
+// Everything is collected only after StatsEnable, otherwise functions return at once.
+// Counters are shared by all threads and processes of one run, so in batch mode they are sums for all coredumps,
+// and time of phase is sum of time of this phase in every coredump (it can be more than wall time).
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum
+{
+    PHASE_ELF,    // ElfConstructor: headers and notes of coredump
+    PHASE_IMAGES, // ImagesConstructor: reading of donor's images
+    PHASE_NOTES,  // GoNotes, MatchVmas, ConvertThreads
+    PHASE_PAGES,  // GoLoadPhdr and plan of pages: scanning and copying
+    PHASE_WRITE,  // ImagesWrite and pstree
+    N_PHASES
+} StatsPhase;
+
+typedef enum
+{
+    COUNTER_COREDUMPS,
+    COUNTER_CORE_BYTES,      // sizes of coredumps, 0 for streams: it's total for progress
+    COUNTER_CORE_READ,       // page data of coredumps: every byte is counted once, when it's scanned or copied
+    COUNTER_IMAGES_READ,     // donor's images
+    COUNTER_PAGES_WRITTEN,   // bytes of pages image (or of store)
+    COUNTER_IMAGES_WRITTEN,  // other images
+    COUNTER_PAGES_EMITTED,
+    COUNTER_PAGES_ZERO,      // skipped: zero pages of anonymous memory
+    COUNTER_PAGES_FILE,      // skipped: pages equal to mapped file (--file-pages)
+    COUNTER_PAGES_PARENT,    // in_parent (--parent)
+    COUNTER_PAGES_LAZY,      // not copied, given to restore on demand (--lazy-pages)
+    COUNTER_PAGEMAP_ENTRIES,
+    N_COUNTERS
+} StatsCounter;
+
+// progress: line with amount of data and speed is updated on stderr about once a second
+void StatsEnable (int progress);
+int StatsEnabled (void);
+
+// Monotonic time in nanoseconds, 0 if stats are disabled
+uint64_t StatsNow (void);
+// Thread-safe. Time from start (given from StatsNow) to now is added to phase
+void StatsPhaseEnd (StatsPhase phase, uint64_t start);
+// Thread-safe
+void StatsAdd (StatsCounter counter, uint64_t value);
+// Thread-safe. Is called after every part of page data, prints progress if it's time
+void StatsProgress (void);
+
+// JSON object with all stats
+int StatsWrite (FILE* file);
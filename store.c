@@ -0,0 +1,621 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "store.h"
+#include "fileworking.h"
+
+static const char STORE_MAGIC[8]    = "NCRSTOR1";
+static const char MANIFEST_MAGIC[8] = "NCRMANI1";
+
+typedef struct
+{
+    char magic[8];
+    uint64_t page_size;
+    uint64_t generation;
+    uint64_t pack_size;
+    uint64_t n_entries;
+} StoreHeader;
+
+typedef struct
+{
+    char magic[8];
+    uint64_t page_size;
+    uint64_t n_keys;
+} ManifestHeader;
+
+// Offset of page, which is being written to pack by other thread: entries are saved only after all threads
+static const uint64_t OFFSET_WRITING = (uint64_t) -1;
+
+// 4 independent lanes of multiply and xorshift, so CPU computes them in parallel. Lanes are mixed by splitmix64 at the end.
+uint64_t HashPage (const char* page, size_t page_size)
+{
+    assert (page);
+    assert (page_size % 32 == 0);
+
+    const uint64_t PRIME = 0x9E3779B97F4A7C15ULL;
+    uint64_t lanes[4] = {page_size, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+
+    for (size_t i_byte = 0; i_byte < page_size; i_byte += 32)
+        for (size_t i_lane = 0; i_lane < 4; i_lane++)
+        {
+            uint64_t word = 0;
+            memcpy (&word, page + i_byte + i_lane * sizeof (word), sizeof (word));
+            lanes[i_lane] = (lanes[i_lane] ^ word) * PRIME;
+            lanes[i_lane] ^= lanes[i_lane] >> 29;
+        }
+
+    uint64_t hash = lanes[0] ^ (lanes[1] << 17 | lanes[1] >> 47) ^ (lanes[2] << 31 | lanes[2] >> 33) ^ (lanes[3] << 47 | lanes[3] >> 17);
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+// Slot with key or free slot, where it can be placed
+static StoreEntry* FindSlot (StoreEntry* table, size_t capacity, uint64_t key)
+{
+    size_t mask = capacity - 1;
+    for (size_t i_slot = key & mask; ; i_slot = (i_slot + 1) & mask)
+        if (table[i_slot].key == key || table[i_slot].key == 0)
+            return table + i_slot;
+}
+
+static int InsertEntry (PageStore* store, const StoreEntry* entry)
+{
+    // Load factor is kept below 3/4
+    if ((store->n_entries + 1) * 4 > store->capacity * 3)
+    {
+        size_t new_capacity = store->capacity ? 2 * store->capacity : 1024;
+        StoreEntry* new_table = (StoreEntry*) calloc (new_capacity, sizeof (*new_table));
+        if (!new_table)
+        {
+            perror ("Can't allocate memory");
+            return -1;
+        }
+
+        for (size_t i_slot = 0; i_slot < store->capacity; i_slot++)
+            if (store->table[i_slot].key)
+                *FindSlot (new_table, new_capacity, store->table[i_slot].key) = store->table[i_slot];
+
+        free (store->table);
+        store->table = new_table;
+        store->capacity = new_capacity;
+    }
+
+    *FindSlot (store->table, store->capacity, entry->key) = *entry;
+    store->n_entries++;
+    return 0;
+}
+
+static char* GetStoreFilename (const PageStore* store, const char* name)
+{
+    char* filename = NULL;
+    if (asprintf (&filename, "%s/%s", store->path, name) == -1)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
+    }
+
+    return filename;
+}
+
+static int OpenPack (PageStore* store, uint64_t generation, int flags)
+{
+    char name[64] = "";
+    snprintf (name, sizeof (name), "pages-%" PRIu64 ".pack", generation);
+
+    char* filename = GetStoreFilename (store, name);
+    int fd = filename ? open (filename, flags, 0666) : -1;
+    if (filename && fd == -1)
+        fprintf (stderr, "Error: Can't open pack %s : %s.\n", filename, strerror (errno));
+
+    free (filename);
+    return fd;
+}
+
+static void RemovePack (PageStore* store, uint64_t generation)
+{
+    char name[64] = "";
+    snprintf (name, sizeof (name), "pages-%" PRIu64 ".pack", generation);
+
+    char* filename = GetStoreFilename (store, name);
+    if (filename)
+        unlink (filename);
+    free (filename);
+    return;
+}
+
+static int LoadIndex (PageStore* store)
+{
+    char* filename = GetStoreFilename (store, "index");
+    if (!filename)
+        return -1;
+
+    FILE* file = fopen (filename, "rb");
+    free (filename);
+    if (!file)
+        return (errno == ENOENT) ? 0 : -1; // new store
+
+    StoreHeader header = {};
+    int res = -1;
+
+    if (fread (&header, sizeof (header), 1, file) != 1 || memcmp (header.magic, STORE_MAGIC, sizeof (STORE_MAGIC)))
+        fprintf (stderr, "Error: Bad index of store %s.\n", store->path);
+    else if (header.page_size != store->page_size)
+        fprintf (stderr, "Error: Store %s has pages of size %" PRIu64 ".\n", store->path, header.page_size);
+    else
+    {
+        store->generation = header.generation;
+        store->pack_size  = header.pack_size;
+        res = 0;
+
+        for (uint64_t i_entry = 0; i_entry < header.n_entries && !res; i_entry++)
+        {
+            StoreEntry entry = {};
+            if (fread (&entry, sizeof (entry), 1, file) != 1 || entry.key == 0)
+            {
+                fprintf (stderr, "Error: Index of store %s is cut.\n", store->path);
+                res = -1;
+            }
+            else
+            {
+                res = InsertEntry (store, &entry);
+                store->dead_size += entry.refs ? 0 : store->page_size;
+            }
+        }
+    }
+
+    fclose (file);
+    return res;
+}
+
+// Index is replaced atomically, it always points to full pack
+static int SaveIndex (const PageStore* store)
+{
+    char* filename = GetStoreFilename (store, "index");
+    char* tmp_filename = GetStoreFilename (store, "index.tmp");
+    FILE* file = tmp_filename ? fopen (tmp_filename, "wb") : NULL;
+    int res = file ? 0 : -1;
+
+    if (file)
+    {
+        StoreHeader header = {.page_size = store->page_size, .generation = store->generation,
+                              .pack_size = store->pack_size, .n_entries = store->n_entries};
+        memcpy (header.magic, STORE_MAGIC, sizeof (STORE_MAGIC));
+        res |= (fwrite (&header, sizeof (header), 1, file) != 1);
+
+        for (size_t i_slot = 0; i_slot < store->capacity && !res; i_slot++)
+            if (store->table[i_slot].key)
+                res |= (fwrite (store->table + i_slot, sizeof (*store->table), 1, file) != 1);
+
+        // Pack must be on disk before index, which points to it
+        res |= fsync (store->pack_fd);
+        res |= fclose (file);
+        res = res ? -1 : 0;
+    }
+
+    if (res == 0 && (!filename || rename (tmp_filename, filename)))
+        res = -1;
+
+    if (res)
+        fprintf (stderr, "Error: Can't write index of store %s.\n", store->path);
+
+    free (filename);
+    free (tmp_filename);
+    return res;
+}
+
+PageStore* PageStoreOpen (const char* path, size_t page_size)
+{
+    assert (path);
+    assert (page_size);
+
+    PageStore* store = (PageStore*) calloc (1, sizeof (*store));
+    if (!store || !(store->path = strdup (path)))
+    {
+        perror ("Can't allocate memory");
+        free (store);
+        return NULL;
+    }
+
+    store->lock_fd = -1;
+    store->pack_fd = -1;
+    store->page_size = page_size;
+    pthread_mutex_init (&store->mutex, NULL);
+    pthread_cond_init (&store->written, NULL);
+
+    if (mkdir (path, 0777) && errno != EEXIST)
+    {
+        fprintf (stderr, "Error: Can't create store %s : %s.\n", path, strerror (errno));
+        PageStoreClose (store);
+        return NULL;
+    }
+
+    // Other conversions wait here, until this one saves index
+    char* lock_filename = GetStoreFilename (store, "lock");
+    if (lock_filename)
+        store->lock_fd = open (lock_filename, O_RDWR | O_CREAT, 0666);
+    free (lock_filename);
+
+    if (store->lock_fd == -1 || flock (store->lock_fd, LOCK_EX) || LoadIndex (store) ||
+        (store->pack_fd = OpenPack (store, store->generation, O_RDWR | O_CREAT)) == -1)
+    {
+        fprintf (stderr, "Error: Can't open store %s.\n", path);
+        PageStoreClose (store);
+        return NULL;
+    }
+
+    return store;
+}
+
+// Slot is reserved under lock, data is written and compared without it, so threads don't wait for I/O of each other.
+// Thread, which finds slot being written, waits for the end of writing.
+int PageStoreAdd (PageStore* store, const char* page, uint64_t* key)
+{
+    assert (store);
+    assert (page);
+    assert (key);
+
+    uint64_t now_key = HashPage (page, store->page_size);
+    char* stored = (char*) malloc (store->page_size);
+    int res = -1;
+    if (!stored)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    pthread_mutex_lock (&store->mutex);
+    for (now_key = now_key ? now_key : 1; ; now_key = (now_key + 1) ? now_key + 1 : 1)
+    {
+        StoreEntry* slot = store->capacity ? FindSlot (store->table, store->capacity, now_key) : NULL;
+
+        if (!slot || slot->key == 0)
+        {
+            StoreEntry entry = {.key = now_key, .offset = OFFSET_WRITING, .refs = 1};
+            uint64_t offset = store->pack_size;
+            if (InsertEntry (store, &entry))
+                break;
+            store->pack_size += store->page_size;
+            pthread_mutex_unlock (&store->mutex);
+
+            int is_written = (pwrite (store->pack_fd, page, store->page_size, offset) == (ssize_t) store->page_size);
+            if (!is_written)
+                fprintf (stderr, "Error: Can't write pack of store %s : %s.\n", store->path, strerror (errno));
+
+            // Table can be moved by other threads. Page, which isn't written, is dead: its data doesn't match any page.
+            pthread_mutex_lock (&store->mutex);
+            slot = FindSlot (store->table, store->capacity, now_key);
+            slot->offset = offset;
+            if (!is_written)
+            {
+                slot->refs = 0;
+                store->dead_size += store->page_size;
+            }
+            pthread_cond_broadcast (&store->written);
+            res = is_written ? 0 : -1;
+            break;
+        }
+
+        if (slot->offset == OFFSET_WRITING)
+        {
+            pthread_cond_wait (&store->written, &store->mutex);
+            now_key--; // the same key is tried again
+            continue;
+        }
+
+        // The same key with other data is collision of hash, the next key is tried
+        uint64_t offset = slot->offset;
+        pthread_mutex_unlock (&store->mutex);
+        int is_read = (pread (store->pack_fd, stored, store->page_size, offset) == (ssize_t) store->page_size);
+        int is_same = is_read && memcmp (stored, page, store->page_size) == 0;
+        pthread_mutex_lock (&store->mutex);
+
+        if (!is_read)
+        {
+            fprintf (stderr, "Error: Can't read pack of store %s : %s.\n", store->path, strerror (errno));
+            break;
+        }
+
+        if (is_same)
+        {
+            // Entries aren't removed before closing, so slot is found again
+            slot = FindSlot (store->table, store->capacity, now_key);
+            store->dead_size -= slot->refs ? 0 : store->page_size;
+            slot->refs++;
+            res = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock (&store->mutex);
+
+    free (stored);
+    *key = res ? 0 : now_key; // reference isn't taken
+    return res;
+}
+
+// References of keys are changed by delta, n_keys of them are undone, if any key isn't referenced
+static int ChangeRefs (PageStore* store, const uint64_t* keys, size_t n_keys, int delta)
+{
+    for (size_t i_key = 0; i_key < n_keys; i_key++)
+    {
+        StoreEntry* slot = store->capacity ? FindSlot (store->table, store->capacity, keys[i_key]) : NULL;
+
+        if (!slot || slot->key != keys[i_key] || (delta < 0 && slot->refs == 0))
+        {
+            fprintf (stderr, "Error: Page %016" PRIx64 " isn't referenced in store %s.\n", keys[i_key], store->path);
+            ChangeRefs (store, keys, i_key, -delta);
+            return -1;
+        }
+
+        if (slot->refs == 0)
+            store->dead_size -= store->page_size;
+        slot->refs += delta;
+        if (slot->refs == 0)
+            store->dead_size += store->page_size;
+    }
+
+    return 0;
+}
+
+// Release is transaction: references of all keys are decremented or none of them, manifest is removed before index is
+// saved. If necromancer dies between them, pages are only leaked, they are never lost by double release.
+int PageStoreRelease (PageStore* store, const char* manifest_filename)
+{
+    assert (store);
+    assert (manifest_filename);
+
+    size_t n_keys = 0;
+    uint64_t* keys = ManifestRead (manifest_filename, &n_keys, store->page_size);
+    if (!keys)
+        return -1;
+
+    pthread_mutex_lock (&store->mutex);
+    int res = ChangeRefs (store, keys, n_keys, -1);
+
+    if (res == 0 && unlink (manifest_filename))
+    {
+        fprintf (stderr, "Error: Can't remove manifest %s : %s.\n", manifest_filename, strerror (errno));
+        ChangeRefs (store, keys, n_keys, 1);
+        res = -1;
+    }
+    else if (res == 0 && SaveIndex (store))
+    {
+        // Manifest is returned, so release can be repeated
+        ChangeRefs (store, keys, n_keys, 1);
+        ManifestWrite (manifest_filename, keys, n_keys, store->page_size);
+        res = -1;
+    }
+    pthread_mutex_unlock (&store->mutex);
+
+    free (keys);
+    return res;
+}
+
+int PageStoreReleaseKeys (PageStore* store, const uint64_t* keys, size_t n_keys)
+{
+    assert (store);
+    assert (keys || !n_keys);
+
+    uint64_t* taken = (uint64_t*) calloc (n_keys + 1, sizeof (*taken));
+    if (!taken)
+    {
+        perror ("Can't allocate memory");
+        return -1;
+    }
+
+    size_t n_taken = 0;
+    for (size_t i_key = 0; i_key < n_keys; i_key++)
+        if (keys[i_key])
+            taken[n_taken++] = keys[i_key];
+
+    pthread_mutex_lock (&store->mutex);
+    int res = ChangeRefs (store, taken, n_taken, -1);
+    pthread_mutex_unlock (&store->mutex);
+
+    free (taken);
+    return res;
+}
+
+int PageStoreCopy (PageStore* store, const uint64_t* keys, size_t n_keys, int fd_out, off_t off_out)
+{
+    assert (store);
+    assert (keys || !n_keys);
+
+    // Neighbour pages of pack are copied by one call
+    uint64_t run_offset = 0;
+    size_t run_size = 0;
+
+    for (size_t i_key = 0; i_key <= n_keys; i_key++)
+    {
+        StoreEntry* slot = NULL;
+        if (i_key < n_keys)
+        {
+            slot = store->capacity ? FindSlot (store->table, store->capacity, keys[i_key]) : NULL;
+            if (!slot || slot->key != keys[i_key])
+            {
+                fprintf (stderr, "Error: There is no page %016" PRIx64 " in store %s.\n", keys[i_key], store->path);
+                return -1;
+            }
+
+            if (run_size && slot->offset == run_offset + run_size)
+            {
+                run_size += store->page_size;
+                continue;
+            }
+        }
+
+        if (run_size && CopyFileRange (store->pack_fd, run_offset, fd_out, off_out, run_size))
+            return -1;
+
+        off_out += run_size;
+        run_offset = slot ? slot->offset : 0;
+        run_size = store->page_size;
+    }
+
+    return 0;
+}
+
+static int CompareEntriesByOffset (const void* a, const void* b)
+{
+    uint64_t offset_a = (*(StoreEntry* const*) a)->offset;
+    uint64_t offset_b = (*(StoreEntry* const*) b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+// Live pages are copied to pack of the next generation, old pack is removed after index points to new one
+static int CompactStore (PageStore* store)
+{
+    size_t n_live = 0;
+    StoreEntry** live = (StoreEntry**) calloc (store->n_entries + 1, sizeof (*live));
+    uint64_t* new_offsets = (uint64_t*) calloc (store->n_entries + 1, sizeof (*new_offsets));
+    int new_fd = OpenPack (store, store->generation + 1, O_RDWR | O_CREAT | O_TRUNC);
+    int res = (live && new_offsets && new_fd != -1) ? 0 : -1;
+
+    for (size_t i_slot = 0; i_slot < store->capacity && !res; i_slot++)
+        if (store->table[i_slot].key && store->table[i_slot].refs)
+            live[n_live++] = store->table + i_slot;
+
+    if (!res)
+        qsort (live, n_live, sizeof (*live), CompareEntriesByOffset);
+
+    uint64_t new_size = 0;
+    for (size_t i_live = 0; i_live < n_live && !res; )
+    {
+        // Run of neighbour pages in old pack
+        size_t i_end = i_live + 1;
+        while (i_end < n_live && live[i_end]->offset == live[i_end - 1]->offset + store->page_size)
+            i_end++;
+
+        res = CopyFileRange (store->pack_fd, live[i_live]->offset, new_fd, new_size, (i_end - i_live) * store->page_size);
+        for (; i_live < i_end; i_live++, new_size += store->page_size)
+            new_offsets[i_live] = new_size;
+    }
+
+    if (res)
+    {
+        fprintf (stderr, "Error: Can't compact store %s.\n", store->path);
+        if (new_fd != -1)
+        {
+            close (new_fd);
+            RemovePack (store, store->generation + 1);
+        }
+        free (live);
+        free (new_offsets);
+        return -1;
+    }
+
+    // Pages without references are dropped from index
+    for (size_t i_live = 0; i_live < n_live; i_live++)
+        live[i_live]->offset = new_offsets[i_live];
+    for (size_t i_slot = 0; i_slot < store->capacity; i_slot++)
+        if (store->table[i_slot].key && store->table[i_slot].refs == 0)
+            store->table[i_slot].key = 0;
+
+    StoreEntry* old_table = store->table;
+    size_t old_capacity = store->capacity;
+    store->table = NULL;
+    store->capacity = store->n_entries = 0;
+    for (size_t i_slot = 0; i_slot < old_capacity && !res; i_slot++)
+        if (old_table[i_slot].key)
+            res = InsertEntry (store, old_table + i_slot);
+    free (old_table);
+
+    int old_fd = store->pack_fd;
+    store->pack_fd = new_fd;
+    store->generation++;
+    store->pack_size = new_size;
+    store->dead_size = 0;
+
+    if (!res && (res = SaveIndex (store)) == 0)
+        RemovePack (store, store->generation - 1);
+
+    close (old_fd);
+    free (live);
+    free (new_offsets);
+    return res;
+}
+
+int PageStoreClose (PageStore* store)
+{
+    if (!store)
+        return 0;
+
+    int res = 0;
+    if (store->pack_fd != -1)
+        res = (store->dead_size && store->dead_size * 2 > store->pack_size) ? CompactStore (store) : SaveIndex (store);
+
+    if (store->pack_fd != -1)
+        close (store->pack_fd);
+    if (store->lock_fd != -1)
+        close (store->lock_fd); // lock is released too
+
+    pthread_mutex_destroy (&store->mutex);
+    pthread_cond_destroy (&store->written);
+    free (store->table);
+    free (store->path);
+    free (store);
+    return res;
+}
+
+int ManifestWrite (const char* filename, const uint64_t* keys, size_t n_keys, size_t page_size)
+{
+    assert (filename);
+    assert (keys || !n_keys);
+
+    FILE* file = fopen (filename, "wb");
+    if (!file)
+    {
+        fprintf (stderr, "Error: Can't write manifest %s : %s.\n", filename, strerror (errno));
+        return -1;
+    }
+
+    ManifestHeader header = {.page_size = page_size, .n_keys = n_keys};
+    memcpy (header.magic, MANIFEST_MAGIC, sizeof (MANIFEST_MAGIC));
+
+    int res = (fwrite (&header, sizeof (header), 1, file) != 1) || (n_keys && fwrite (keys, sizeof (*keys), n_keys, file) != n_keys);
+    res |= fclose (file);
+    if (res)
+        fprintf (stderr, "Error: Can't write manifest %s.\n", filename);
+
+    return res ? -1 : 0;
+}
+
+uint64_t* ManifestRead (const char* filename, size_t* n_keys, size_t page_size)
+{
+    assert (filename);
+    assert (n_keys);
+
+    FILE* file = fopen (filename, "rb");
+    if (!file)
+    {
+        fprintf (stderr, "Error: Can't read manifest %s : %s.\n", filename, strerror (errno));
+        return NULL;
+    }
+
+    ManifestHeader header = {};
+    uint64_t* keys = NULL;
+
+    if (fread (&header, sizeof (header), 1, file) != 1 || memcmp (header.magic, MANIFEST_MAGIC, sizeof (MANIFEST_MAGIC)) ||
+        header.page_size != page_size)
+        fprintf (stderr, "Error: Bad manifest %s.\n", filename);
+    else if (!(keys = (uint64_t*) calloc (header.n_keys + 1, sizeof (*keys))))
+        perror ("Can't allocate memory");
+    else if (fread (keys, sizeof (*keys), header.n_keys, file) != header.n_keys)
+    {
+        fprintf (stderr, "Error: Manifest %s is cut.\n", filename);
+        free (keys);
+        keys = NULL;
+    }
+
+    fclose (file);
+    *n_keys = keys ? header.n_keys : 0;
+    return keys;
+}
@@ -0,0 +1,60 @@
+// Content-addressed store of pages, shared by many converted coredumps.
+// Every unique page is kept once in pack file, index has its key, offset in pack and number of references.
+// Converted images have manifest instead of pages image: list of keys in order of pages image.
+// Standard pages-<id>.img is materialized from manifest on demand.
+//
+// Directory of store:
+//     lock           - flock for the whole session, store is used by one process at once
+//     index          - header and entries, replaced atomically
+//     pages-<N>.pack - raw pages, N is generation of pack (it's changed by compaction)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef struct
+{
+    uint64_t key;    // hash of page, the next free value on collision
+    uint64_t offset; // in pack
+    uint64_t refs;   // number of references from manifests, page without them is removed by compaction
+} StoreEntry;
+
+typedef struct
+{
+    char* path;
+    int lock_fd, pack_fd;
+    uint64_t generation;
+    uint64_t pack_size;
+    uint64_t dead_size; // pages without references
+    size_t page_size;
+
+    StoreEntry* table; // open addressing by key, key 0 means free slot
+    size_t capacity;   // power of 2
+    size_t n_entries;
+
+    pthread_mutex_t mutex; // for adding from several threads, I/O of pack is done without it
+    pthread_cond_t written; // page, which is being written by other thread, is in pack
+} PageStore;
+
+// Creates store, if directory is empty. page_size must be the same as in existing store.
+PageStore* PageStoreOpen (const char* path, size_t page_size);
+// Saves index. Pack is compacted, if the most of it is pages without references.
+int PageStoreClose (PageStore* store);
+
+// Thread-safe. Page is added once, the next adding only increases number of references. key is 0 on error.
+int PageStoreAdd (PageStore* store, const char* page, uint64_t* key);
+// Releases all pages of manifest and removes it, index is saved at once. Nothing is changed on error.
+int PageStoreRelease (PageStore* store, const char* manifest_filename);
+// Thread-safe. Releases pages, which have no manifest (conversion failed), key 0 is skipped. Index is saved by closing.
+int PageStoreReleaseKeys (PageStore* store, const uint64_t* keys, size_t n_keys);
+
+// Writes pages with keys to fd_out from off_out one after another
+int PageStoreCopy (PageStore* store, const uint64_t* keys, size_t n_keys, int fd_out, off_t off_out);
+
+// Fast non-cryptographic 64-bit hash, page_size must be a multiple of 32
+uint64_t HashPage (const char* page, size_t page_size);
+
+// Manifest: magic, page size, number of pages, keys
+int ManifestWrite (const char* filename, const uint64_t* keys, size_t n_keys, size_t page_size);
+uint64_t* ManifestRead (const char* filename, size_t* n_keys, size_t page_size);
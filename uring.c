@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+#include "fileworking.h"
+
+// Fields of rings, which are shared with kernel: head of SQ and tail of CQ are moved by kernel
+typedef struct
+{
+    unsigned *head, *tail, *mask, *array;
+} SubmitRing;
+
+typedef struct
+{
+    unsigned *head, *tail, *mask;
+    struct io_uring_cqe* cqes;
+} CompleteRing;
+
+struct Uring
+{
+    int fd;
+    SubmitRing sq;
+    CompleteRing cq;
+    struct io_uring_sqe* sqes;
+    void *sq_map, *cq_map; // cq_map == sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned sq_tail; // the next place in SQ, it's given to kernel by Reap
+    unsigned n_unsubmitted;
+
+    char* buffers; // depth * chunk_size, aligned for O_DIRECT
+    size_t depth, chunk_size;
+    int is_registered; // without registering (RLIMIT_MEMLOCK on old kernels) plain READ and WRITE are used
+    size_t* free_buffers;
+    size_t n_free;
+    unsigned* n_cqes; // CQEs, which buffer waits for: 2 for read and write
+    size_t* lens;     // expected result of both requests of buffer
+    int error;
+};
+
+static int UringSetup (unsigned entries, struct io_uring_params* params)
+{
+    return (int) syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int UringEnter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int UringRegister (int fd, unsigned opcode, const void* arg, unsigned n_args)
+{
+    return (int) syscall (__NR_io_uring_register, fd, opcode, arg, n_args);
+}
+
+static int MapRings (Uring* ring, const struct io_uring_params* params)
+{
+    ring->sq_map_size = params->sq_off.array + params->sq_entries * sizeof (unsigned);
+    ring->cq_map_size = params->cq_off.cqes + params->cq_entries * sizeof (struct io_uring_cqe);
+    ring->sqes_size   = params->sq_entries * sizeof (struct io_uring_sqe);
+
+    int single_map = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map)
+        ring->sq_map_size = ring->cq_map_size = (ring->sq_map_size > ring->cq_map_size) ? ring->sq_map_size : ring->cq_map_size;
+
+    ring->sq_map = mmap (NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+        return -1;
+
+    ring->cq_map = single_map ? ring->sq_map :
+                   mmap (NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED)
+        return -1;
+
+    ring->sqes = (struct io_uring_sqe*) mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                              ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    char* sq = (char*) ring->sq_map;
+    char* cq = (char*) ring->cq_map;
+    ring->sq = (SubmitRing) {.head  = (unsigned*) (sq + params->sq_off.head),  .tail = (unsigned*) (sq + params->sq_off.tail),
+                             .mask  = (unsigned*) (sq + params->sq_off.ring_mask), .array = (unsigned*) (sq + params->sq_off.array)};
+    ring->cq = (CompleteRing) {.head = (unsigned*) (cq + params->cq_off.head), .tail = (unsigned*) (cq + params->cq_off.tail),
+                               .mask = (unsigned*) (cq + params->cq_off.ring_mask), .cqes = (struct io_uring_cqe*) (cq + params->cq_off.cqes)};
+    return 0;
+}
+
+Uring* UringOpen (size_t depth, size_t chunk_size)
+{
+    assert (depth);
+    assert (chunk_size % DIRECT_ALIGN == 0);
+
+    Uring* ring = (Uring*) calloc (1, sizeof (*ring));
+    if (!ring)
+    {
+        perror ("Can't allocate memory");
+        return NULL;
+    }
+    ring->fd = -1;
+    ring->sq_map = ring->cq_map = ring->sqes = MAP_FAILED;
+    ring->depth = depth;
+    ring->chunk_size = chunk_size;
+
+    // Every buffer has read and write in flight at once
+    struct io_uring_params params = {};
+    ring->fd = UringSetup (2 * depth, &params);
+    if (ring->fd < 0 || MapRings (ring, &params))
+    {
+        UringClose (ring);
+        return NULL;
+    }
+
+    ring->free_buffers = (size_t*) calloc (depth, sizeof (*ring->free_buffers));
+    ring->n_cqes = (unsigned*) calloc (depth, sizeof (*ring->n_cqes));
+    ring->lens = (size_t*) calloc (depth, sizeof (*ring->lens));
+    struct iovec* iovs = (struct iovec*) calloc (depth, sizeof (*iovs));
+    if (!ring->free_buffers || !ring->n_cqes || !ring->lens || !iovs ||
+        posix_memalign ((void**) &ring->buffers, DIRECT_ALIGN, depth * chunk_size))
+    {
+        perror ("Can't allocate memory");
+        free (iovs);
+        UringClose (ring);
+        return NULL;
+    }
+
+    for (size_t i_buffer = 0; i_buffer < depth; i_buffer++)
+    {
+        ring->free_buffers[ring->n_free++] = depth - 1 - i_buffer;
+        iovs[i_buffer] = (struct iovec) {.iov_base = ring->buffers + i_buffer * chunk_size, .iov_len = chunk_size};
+    }
+
+    ring->sq_tail = *ring->sq.tail;
+
+    // Registered buffers aren't pinned and mapped by kernel for every request
+    ring->is_registered = (UringRegister (ring->fd, IORING_REGISTER_BUFFERS, iovs, depth) == 0);
+    free (iovs);
+    return ring;
+}
+
+void UringClose (Uring* ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->sqes != MAP_FAILED)
+        munmap (ring->sqes, ring->sqes_size);
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap (ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map != MAP_FAILED)
+        munmap (ring->sq_map, ring->sq_map_size);
+    if (ring->fd != -1)
+        close (ring->fd);
+
+    free (ring->buffers);
+    free (ring->free_buffers);
+    free (ring->n_cqes);
+    free (ring->lens);
+    free (ring);
+    return;
+}
+
+static void PrepareRequest (Uring* ring, int is_write, int fd, off_t offset, size_t i_buffer, size_t len, int is_linked)
+{
+    unsigned index = ring->sq_tail++ & *ring->sq.mask;
+    struct io_uring_sqe* sqe = ring->sqes + index;
+
+    memset (sqe, 0, sizeof (*sqe));
+    if (ring->is_registered)
+        sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    else
+        sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t) (ring->buffers + i_buffer * ring->chunk_size);
+    sqe->len = len;
+    sqe->buf_index = i_buffer;
+    sqe->flags = is_linked ? IOSQE_IO_LINK : 0;
+    sqe->user_data = i_buffer;
+
+    ring->sq.array[index] = index;
+    ring->n_unsubmitted++;
+    return;
+}
+
+// Queued requests are submitted, completions are taken. With wait at least one completion is waited for.
+static int Reap (Uring* ring, int wait)
+{
+    __atomic_store_n (ring->sq.tail, ring->sq_tail, __ATOMIC_RELEASE);
+
+    int n_submitted = 0;
+    do
+        n_submitted = UringEnter (ring->fd, ring->n_unsubmitted, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    while (n_submitted < 0 && errno == EINTR);
+
+    if (n_submitted < 0)
+    {
+        perror ("Can't submit io_uring requests");
+        return -1;
+    }
+    ring->n_unsubmitted -= n_submitted;
+
+    unsigned head = *ring->cq.head;
+    unsigned tail = __atomic_load_n (ring->cq.tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe* cqe = ring->cq.cqes + (head & *ring->cq.mask);
+        size_t i_buffer = cqe->user_data;
+
+        // Short read breaks the link, write gets -ECANCELED then
+        if (cqe->res < 0 || (size_t) cqe->res != ring->lens[i_buffer])
+            ring->error = 1;
+
+        if (--ring->n_cqes[i_buffer] == 0)
+            ring->free_buffers[ring->n_free++] = i_buffer;
+    }
+
+    __atomic_store_n (ring->cq.head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int UringCopy (Uring* ring, int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len)
+{
+    assert (ring);
+
+    for (size_t done = 0; done < len; done += ring->chunk_size)
+    {
+        while (ring->n_free == 0)
+            if (Reap (ring, 1))
+                return -1;
+
+        size_t i_buffer = ring->free_buffers[--ring->n_free];
+        size_t chunk_len = (len - done > ring->chunk_size) ? ring->chunk_size : len - done;
+        ring->lens[i_buffer] = chunk_len;
+        ring->n_cqes[i_buffer] = 2;
+
+        PrepareRequest (ring, 0, fd_in,  off_in  + done, i_buffer, chunk_len, 1);
+        PrepareRequest (ring, 1, fd_out, off_out + done, i_buffer, chunk_len, 0);
+    }
+
+    // Requests are submitted by batches, when buffers are over
+    return 0;
+}
+
+int UringWait (Uring* ring)
+{
+    assert (ring);
+
+    while (ring->n_free < ring->depth || ring->n_unsubmitted)
+        if (Reap (ring, ring->n_free < ring->depth))
+            return -1;
+
+    int error = ring->error;
+    ring->error = 0;
+    return error ? -1 : 0;
+}
@@ -0,0 +1,19 @@
+// Copying of file ranges by io_uring: one thread keeps many reads and writes in flight.
+// Every chunk is a linked pair: read to registered buffer, then write from it. Raw syscalls are used, liburing isn't needed.
+// UringOpen returns NULL, if kernel has no io_uring or it's disabled (kernel.io_uring_disabled, seccomp),
+// then caller copies synchronously.
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct Uring Uring;
+
+// depth chunks of chunk_size bytes are in flight, chunk_size must be a multiple of DIRECT_ALIGN
+Uring* UringOpen (size_t depth, size_t chunk_size);
+void UringClose (Uring* ring);
+
+// Queues copying of len bytes, it blocks only while all buffers are busy. Both fds can be opened with O_DIRECT,
+// then offsets and len must be aligned as O_DIRECT needs.
+int UringCopy (Uring* ring, int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len);
+// Waits for all queued chunks. -1 if any of them wasn't copied wholly (short read of truncated file, error of device).
+int UringWait (Uring* ring);